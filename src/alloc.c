@@ -8,23 +8,609 @@
  */
 #include <stdlib.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
 #include <pthread.h>
+#include <sys/mman.h>
 #include "alloc.h"
 #include "locks.h"
 #include "list.h"
+#include "freeindex.h"
+#include "trace.h"
+#include "profile.h"
+#include "heapdump.h"
 
 /* Stratergy we are currently using for the allocator (defaults to FIRST) */
 static enum stratergy current_stratergy = FIRST;
 
-/* Linked lists for the alloc and freed lists */
-static struct linked_list alloc_list = {NULL, NULL, RW_LOCK_INIT};
-static struct linked_list freed_list = {NULL, NULL, RW_LOCK_INIT};
+/* Static initialisers for an empty linked list, and for runs of them */
+#define LIST_INIT {NULL, NULL, RW_LOCK_INIT}
+#define LIST_INIT_8 LIST_INIT, LIST_INIT, LIST_INIT, LIST_INIT, \
+    LIST_INIT, LIST_INIT, LIST_INIT, LIST_INIT
 
-/* Mutex to apply thread safety to sbrk(), as it is not natively thread safe */
+/* Amount of size classes the alloc list is split into, one per power of two */
+#define ALLOC_LIST_BINS ALLOC_SIZE_CLASSES
+
+/* Policy table set by set_policy(), sorted by ascending max_size. Requests
+ * larger than every range use current_stratergy */
+static struct policy_range policy[POLICY_MAX_RANGES];
+static int policy_count = 0;
+
+/* Linked lists for the alloc and freed lists. The alloc list is split into one
+ * list per power of two size class, so a block can be found from its size
+ * without searching every allocation. The freed list is split into one list
+ * per policy range (plus the catch all range), holding the free blocks whose
+ * size falls within that range */
+static struct linked_list alloc_lists[ALLOC_LIST_BINS] = {
+    LIST_INIT_8, LIST_INIT_8, LIST_INIT_8, LIST_INIT_8,
+    LIST_INIT_8, LIST_INIT_8, LIST_INIT_8, LIST_INIT_8
+};
+static struct linked_list freed_lists[POLICY_MAX_RANGES + 1] = {
+    LIST_INIT, LIST_INIT, LIST_INIT, LIST_INIT, LIST_INIT,
+    LIST_INIT, LIST_INIT, LIST_INIT, LIST_INIT
+};
+
+/* Index of the sizes of each freed list's blocks, which the fit searches
+ * scan rather than the list. Guarded by the lock of its list */
+static struct free_index freed_indexes[POLICY_MAX_RANGES + 1];
+
+/* Slots a chunk table has when it is first mapped, a power of two */
+#define CHUNK_TABLE_INITIAL 1024
+
+/* Left in a chunk table's slot when its block is deleted, so probes carry on
+ * past it */
+#define CHUNK_TABLE_HOLE ((struct block*) 1)
+
+/*
+ * Hash table of the blocks in an alloc list by their data, so a chunk is
+ * found without walking the list. Slots are probed linearly, and each block
+ * records its slot so it can be deleted without a probe.
+ */
+struct chunk_table
+{
+    struct block** slots;
+    size_t capacity;
+    size_t count;   /* Blocks in the table */
+    size_t used;    /* Slots holding a block or a hole */
+};
+
+/* Chunk table of each alloc list. Guarded by the lock of its list */
+static struct chunk_table chunk_tables[ALLOC_LIST_BINS];
+
+/* Amount of allocations sampled by the ADAPTIVE stratergy before it decides
+ * whether to switch fit policy */
+#define ADAPTIVE_WINDOW 1024
+
+/* Amount of windows in a row that must favour a different fit policy before
+ * the ADAPTIVE stratergy switches to it */
+#define ADAPTIVE_CONFIRM 3
+
+/* Thresholds for the ADAPTIVE stratergy. Moving to a policy needs its metric
+ * past the HIGH threshold, while staying on it only needs the metric past the
+ * LOW threshold, so metrics sitting near a threshold dont cause thrashing */
+#define ADAPTIVE_SEARCH_HIGH 64.0 /* Blocks looked at per allocation */
+#define ADAPTIVE_SEARCH_LOW  16.0
+#define ADAPTIVE_FRAG_HIGH   0.90 /* 1 - largest free block / total free */
+#define ADAPTIVE_FRAG_LOW    0.75
+#define ADAPTIVE_SPLIT_HIGH  0.75 /* Splits per allocation */
+#define ADAPTIVE_SPLIT_LOW   0.50
+
+/* Fit policy the ADAPTIVE stratergy is currently using */
+static enum stratergy adaptive_stratergy = FIRST;
+
+/* Metrics gathered over the current ADAPTIVE window */
+static unsigned long adaptive_allocs = 0;
+static unsigned long adaptive_steps = 0;
+static unsigned long adaptive_splits = 0;
+
+/* Windows in a row that have favoured adaptive_candidate */
+static enum stratergy adaptive_candidate = FIRST;
+static int adaptive_streak = 0;
+
+/* Mutex held by the thread deciding the outcome of an ADAPTIVE window */
+static pthread_mutex_t adaptive_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Callback notified of allocator events, such as ADAPTIVE switches */
+static alloc_event_callback event_callback = NULL;
+
+/* Blocks looked at and whether a split happened during this thread's last
+ * search */
+static __thread unsigned long search_steps;
+static __thread int search_split;
+
+/* Whether this thread's last search skipped a block another thread had
+ * locked, so it may have found a different block to a walk of the list */
+static __thread int search_contended;
+
+/* Owner of the thread pages this thread's search may use blocks from (0 when
+ * thread pages are off), and whether it may only use blocks from them */
+static __thread unsigned int search_owner;
+static __thread int search_owned_only;
+
+/* Size of a cache line, which chunks handed to different threads never share
+ * while thread pages are on */
+#define CACHE_LINE 64
+
+/* Largest chunk carved from thread pages, and the size of each span of pages
+ * a thread carves them from */
+#define THREAD_PAGE_MAX 1024
+#define THREAD_SPAN_SIZE (16 * 1024)
+
+/* Whether small chunks are carved from the thread pages of the thread
+ * allocating them */
+static int thread_pages = 0;
+
+/* Call sites whose chunk lifetimes are learnt (a power of two), and the
+ * entries a lookup probes before giving up on a site */
+#define LIFETIME_SITE_BITS 10
+#define LIFETIME_SITES (1 << LIFETIME_SITE_BITS)
+#define LIFETIME_PROBES 8
+
+/* Lifetimes are measured in allocations made while the chunk was live. Once
+ * LIFETIME_MIN_SAMPLES chunks of a site have been freed, it is predicted short
+ * lived while their average lifetime is LIFETIME_SHORT or less */
+#define LIFETIME_SHORT 1024
+#define LIFETIME_MIN_SAMPLES 16
+
+/* Each new lifetime moves a site's average 1/8th of the way towards it */
+#define LIFETIME_SHIFT 3
+
+/* Size (and alignment) of a short lived region, the largest chunk placed in
+ * one, and the empty regions kept for reuse before the rest are unmapped */
+#define SHORT_REGION_SIZE (256 * 1024)
+#define SHORT_CHUNK_MAX 4096
+#define SHORT_REGION_KEEP 4
+
+/*
+ * The learnt lifetime of the chunks allocated from a call site.
+ */
+struct lifetime_site
+{
+    void* site;
+    unsigned long average;
+    unsigned long samples;
+};
+
+/*
+ * Header at the start of a short lived region. Chunks are carved from the
+ * current region by moving 'cur' forward, and once a region is no longer
+ * current it is recycled as soon as its last live chunk is freed. 'live' is
+ * only changed under the short_lock, so whichever thread sees it reach 0 on
+ * a region that isnt current is the only one to recycle it.
+ */
+struct short_region
+{
+    struct short_region* next;
+    char* cur;
+    unsigned long live;
+};
+
+/* Whether lifetime prediction is on, the lifetime clock (allocations made
+ * while it has been on), and the mapped table of call sites */
+static int lifetime_prediction = 0;
+static unsigned long lifetime_clock = 0;
+static struct lifetime_site* lifetime_sites = NULL;
+
+/* The short lived region being carved from and the empty regions kept for
+ * reuse, guarded by short_lock, and running totals of the regions */
+static struct short_region* short_current = NULL;
+static struct short_region* short_empty = NULL;
+static int short_empty_count = 0;
+static pthread_mutex_t short_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long short_regions = 0;
+static unsigned long region_recycles = 0;
+static unsigned long region_unmaps = 0;
+
+/* Chunks at least this large are zeroed by zalloc() by handing their pages
+ * back to the OS rather than with memset */
+#define ZERO_REMAP_THRESHOLD (128 * 1024)
+
+/* Most free blocks the maintenance thread looks at each tick, and the merges
+ * or purges it does before yielding to other threads */
+#define MAINT_SNAPSHOT 16384
+#define MAINT_SLICE 64
+
+/*
+ * A free block as seen by the maintenance thread when it took its snapshot.
+ * The block may have been allocated since, so it is checked again under the
+ * locks before anything is done to it.
+ */
+struct maint_entry
+{
+    struct block* block;
+    uintptr_t start;
+    size_t size;
+};
+
+/* The maintenance thread and the settings it runs with, guarded by
+ * maint_lock. An interval of 0 is a thread that only reclaims for the soft
+ * limit, and 'maint_reclaim' is the size of the growth a reclaim was last
+ * asked for before (or 0 if there isnt one waiting) */
+static pthread_t maint_thread;
+static int maint_running = 0;
+static int maint_stop = 0;
+static unsigned int maint_interval_ms = 0;
+static unsigned int maint_decay_ms = 0;
+static size_t maint_reclaim = 0;
+static pthread_mutex_t maint_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t maint_wake = PTHREAD_COND_INITIALIZER;
+
+/* Ticks of the maintenance thread, which free blocks are stamped with so it
+ * can tell how long they have been idle without reading the clock */
+static unsigned long maint_tick = 0;
+
+/* Metadata of blocks that have been merged into another, ready to be used
+ * again by new_block(), then the metadata reserved by alloc_reserve() (or
+ * carved in a batch) that hasnt been used yet. Both are guarded by
+ * spare_lock */
+static struct block* spare_blocks = NULL;
+static struct block* reserve_blocks = NULL;
+static struct block* reserve_blocks_end = NULL;
+static pthread_mutex_t spare_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Bytes of metadata blocks mapped at a time once there are no spare ones.
+ * They are mapped apart from the heap so metadata never sits between the
+ * chunks at the top of the heap and stops it being trimmed */
+#define BLOCK_BATCH_BYTES (64 * 1024)
+#define BLOCK_BATCH (BLOCK_BATCH_BYTES / sizeof(struct block))
+
+/* Handles the table has room for, the handles looked at by a single step of
+ * compaction and the bytes moved by each step the maintenance thread takes */
+#define HANDLE_MAX (1 << 20)
+#define COMPACT_STEP_HANDLES 4096
+#define COMPACT_STEP_BYTES (256 * 1024)
+
+/* Free blocks at the end of the heap handed back to the top chunk by a
+ * single trim */
+#define TRIM_BLOCKS 64
+
+/* States of a handle, along with the count of its pins */
+#define HANDLE_MOVING 0x40000000u
+#define HANDLE_FREE 0x80000000u
+
+/*
+ * A handle's chunk and block. The state is the count of pins on the chunk,
+ * which can only be moved (or freed) once it has no pins and is marked
+ * HANDLE_MOVING.
+ */
+struct handle_entry
+{
+    void* chunk;
+    struct block* block;
+    unsigned int state;
+    unsigned int next_free;
+};
+
+/* Table of handles mapped on the first halloc(), the entries used so far and
+ * the freed entries (as handles), guarded by handle_lock */
+static struct handle_entry* handles = NULL;
+static pthread_once_t handles_once = PTHREAD_ONCE_INIT;
+static unsigned int handle_count = 0;
+static unsigned int handle_free_list = 0;
+static pthread_mutex_t handle_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Next handle compaction looks at, and the snapshot hcompact() merges and
+ * searches with, guarded by compact_lock */
+static unsigned int compact_cursor = 0;
+static struct maint_entry* compact_entries = NULL;
+static pthread_mutex_t compact_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Cgroup directory read by default, and the share of the soft limit in use
+ * (or memory pressure) at which free memory is reclaimed */
+#define SOFT_LIMIT_DEFAULT_CGROUP "/sys/fs/cgroup"
+#define SOFT_LIMIT_HIGH 0.90
+#define SOFT_LIMIT_PRESSURE 10.0
+
+/* Bytes the heap grows by between checks of the memory in use, so the cgroup
+ * files arent read on every growth */
+#define SOFT_LIMIT_CHECK_BYTES (256 * 1024)
+
+/* Soft limit and the cgroup directory to watch (empty if there isnt one),
+ * guarded by soft_limit_lock */
+static size_t soft_limit = SOFT_LIMIT_OFF;
+static char soft_limit_dir[256] = "";
+static pthread_mutex_t soft_limit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Bytes mapped from the OS at which the memory in use is checked next */
+static size_t soft_limit_next_check = 0;
+
+/* Checks the soft limit before the heap grows, and reclaims for it on the
+ * maintenance thread, defined with the rest of the soft limit below */
+static void soft_limit_check(size_t chunk_size);
+static void soft_limit_reclaim(struct maint_entry* entries, 
+    size_t chunk_size);
+
+/* Used to make the orphaned end of the top chunk a free block, defined
+ * below */
+static struct block* new_block();
+static void freed_list_insert(struct block* block);
+
+/* Most bytes a thread may take from its cache before it next counts them */
+#define CACHE_BUDGET_MAX (64 * 1024)
+
+__thread struct alloc_cache alloc_thread_cache;
+
+/* Moved on to have every thread stop taking from its cache and empty it at
+ * its next slow path */
+unsigned long alloc_cache_generation = 0;
+
+/* Empties this thread's cache as it exits, defined with the rest of the
+ * thread cache below */
+static void cache_exit();
+
+/* Bytes of a reserve's left over chunk per spare metadata block reserved
+ * along with it, for the blocks later split from it */
+#define RESERVE_SPLIT_BYTES 256
+
+/* Records the heap dump buffer starts with */
+#define DUMP_INITIAL_RECORDS 4096
+
+/* Mutex to apply thread safety to sbrk(), as it is not natively thread safe.
+ * It also guards the huge page regions below */
 static pthread_mutex_t sbrk_lock = PTHREAD_MUTEX_INITIALIZER;
 
+/* Total bytes handed to the heap by change_break(), the most it has been
+ * (it shrinks as the top is trimmed), and the bytes mapped from the OS to
+ * provide them (sbrk plus whole huge page regions) */
+static size_t heap_size = 0;
+static size_t heap_peak = 0;
+static size_t os_bytes = 0;
+
+/* Smallest and largest amounts the top chunk grows the program break by. The
+ * amount doubles every time it grows, so a growing heap only moves the break
+ * a handful of times */
+#define TOP_MIN_GROW (64 * 1024)
+#define TOP_MAX_GROW (64 * 1024 * 1024)
+
+/* Chunks carved from the top chunk are aligned to this */
+#define TOP_ALIGN 16
+
+/* The top chunk, the memory past the end of the heap that the break has
+ * already been moved over. change_break() carves chunks from it by moving
+ * top_cur forward, and only moves the break once it runs out. If something
+ * else has moved the break in the meantime, whatever was left of the old top
+ * chunk is kept as the orphan until it can be made a free block. All guarded
+ * by sbrk_lock */
+static char* top_cur = NULL;
+static char* top_end = NULL;
+static size_t top_grow = TOP_MIN_GROW;
+static char* top_orphan = NULL;
+static size_t top_orphan_size = 0;
+
+/* Calls to change_break() (each of which moved the break before the top
+ * chunk), and the calls to sbrk() and mmap() made to get memory from the OS */
+static unsigned long grow_calls = 0;
+static unsigned long os_calls = 0;
+
+/* Tags counted on each page of a thread's tag counters, and the pages needed
+ * to count every tag. A page is only mapped once the thread uses one of its
+ * tags */
+#define TAG_PAGE_TAGS 128
+#define TAG_PAGES (65536 / TAG_PAGE_TAGS)
+
+/* Bytes a thread allocates with a tag between checks of the tag's live bytes
+ * against its peak and quota */
+#define TAG_CHECK_BYTES (64 * 1024)
+
+/*
+ * A thread's counters of a single tag.
+ */
+struct tag_counters
+{
+    unsigned long allocs;
+    unsigned long deallocs;
+    unsigned long alloc_bytes;
+    unsigned long dealloc_bytes;
+};
+
+/*
+ * The quota and peak of a tag, shared by every thread.
+ */
+struct tag_state
+{
+    size_t quota;
+    size_t peak;
+    int over;
+};
+
+/* Quota and peak of every tag, mapped the first time a tag is used */
+static struct tag_state* tag_states = NULL;
+static pthread_once_t tag_states_once = PTHREAD_ONCE_INIT;
+
+/*
+ * A thread's allocator counters. Only the owning thread writes to them, so
+ * they are updated without atomic read-modify-writes, and alloc_stats() sums
+ * every thread's counters when it is called. Counters are only ever added to,
+ * so figures like the bytes in use are the difference of two sums.
+ *
+ * A thread's counters are kept when it exits and handed to the next new
+ * thread, so nothing it counted is lost.
+ */
+struct thread_stats
+{
+    struct thread_stats* next;
+    int owned;
+    unsigned int id;  /* Owner of the blocks carved from its thread pages */
+    char* span_cur;   /* Free part of the span of thread pages being carved */
+    char* span_end;
+    unsigned long allocs;
+    unsigned long deallocs;
+    unsigned long alloc_bytes;
+    unsigned long dealloc_bytes;
+    unsigned long created_blocks;
+    unsigned long created_bytes;
+    unsigned long splits;
+    unsigned long merges;
+    unsigned long purges;
+    unsigned long purged_bytes;
+    unsigned long searches;
+    unsigned long search_steps;
+    unsigned long short_allocs;
+    unsigned long short_blocks; /* Short lived blocks given back to regions */
+    unsigned long short_bytes;
+    unsigned long cache_allocs;
+    unsigned long moves;
+    unsigned long moved_bytes;
+    unsigned long trimmed_blocks;
+    unsigned long trimmed_bytes;
+    unsigned long class_allocs[ALLOC_SIZE_CLASSES];
+    unsigned long class_deallocs[ALLOC_SIZE_CLASSES];
+    struct tag_counters* tag_pages[TAG_PAGES];
+};
+
+/* Every thread's counters, only ever added to at the head, and how many
+ * there are */
+static struct thread_stats* thread_stats_list = NULL;
+static unsigned int thread_stats_count = 0;
+
+/* This thread's counters, and the key that gives them up when it exits */
+static __thread struct thread_stats* my_stats = NULL;
+static pthread_key_t thread_stats_key;
+static pthread_once_t thread_stats_once = PTHREAD_ONCE_INIT;
+
+/* Size and alignment of a huge page region, one x86-64 huge page */
+#define HUGE_REGION_SIZE (2 * 1024 * 1024)
+
+/* Requests at least this large get a region to themselves, so they dont break
+ * up the region that small allocations are being packed into */
+#define HUGE_REGION_LARGE (HUGE_REGION_SIZE / 4)
+
+/* Alignment of each chunk carved from a huge page region */
+#define HUGE_REGION_ALIGN 16
+
+/* Flags set on a huge page region */
+#define REGION_HUGETLB 0x1 /* Mapped with explicit MAP_HUGETLB pages */
+#define REGION_THP     0x2 /* Transparent huge pages requested via madvise */
+
+/*
+ * Header at the start of every huge page region, linking all of the regions
+ * together so their backing can be looked up.
+ */
+struct huge_region
+{
+    struct huge_region* next;
+    size_t size;
+    unsigned int flags;
+};
+
+/* Source of heap memory used by change_break() (defaults to sbrk) */
+static enum hugepage_mode current_hugepage_mode = HUGEPAGE_OFF;
+
+/* Every region mapped so far, and the free space left in the region small
+ * allocations are currently being packed into */
+static struct huge_region* huge_regions = NULL;
+static char* huge_region_cur = NULL;
+static char* huge_region_end = NULL;
+
+/* Running totals of the huge page regions */
+static size_t huge_region_count = 0;
+static size_t huge_bytes_reserved = 0;
+static size_t huge_bytes_used = 0;
+static size_t huge_bytes_hugetlb = 0;
+static size_t huge_bytes_thp = 0;
+
+/*
+ * Called as a thread exits to give up its counters to the next new thread.
+ */
+static void release_thread_stats(void* stats)
+{
+    cache_exit();
+    __atomic_store_n(&((struct thread_stats*) stats)->owned, 0, 
+        __ATOMIC_RELEASE);
+}
+
+/*
+ * Create the key used to give up a thread's counters.
+ */
+static void create_thread_stats_key()
+{
+    pthread_key_create(&thread_stats_key, release_thread_stats);
+}
+
+/*
+ * Returns this thread's counters, taking over the counters of an exited
+ * thread or mapping new ones on its first call. They are mapped directly so
+ * counting never calls back into an allocator. Along with the counters, a
+ * thread takes over the thread pages of the thread that had them.
+ */
+static struct thread_stats* get_thread_stats()
+{
+    struct thread_stats* stats = my_stats;
+
+    if(stats != NULL)
+    {
+        return stats;
+    }
+
+    pthread_once(&thread_stats_once, create_thread_stats_key);
+
+    for(stats = __atomic_load_n(&thread_stats_list, __ATOMIC_ACQUIRE); 
+        stats != NULL; stats = stats->next)
+    {
+        int unowned = 0;
+        if(__atomic_compare_exchange_n(&stats->owned, &unowned, 1, 0, 
+            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            break;
+        }
+    }
+
+    if(stats == NULL)
+    {
+        stats = mmap(NULL, sizeof(struct thread_stats), PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(stats == MAP_FAILED)
+        {
+            perror("'mmap()' failed unexpectedly");
+            abort();
+        }
+        stats->owned = 1;
+        stats->id = __atomic_add_fetch(&thread_stats_count, 1, 
+            __ATOMIC_RELAXED);
+
+        stats->next = __atomic_load_n(&thread_stats_list, __ATOMIC_RELAXED);
+        while(!__atomic_compare_exchange_n(&thread_stats_list, &stats->next, 
+            stats, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+
+    pthread_setspecific(thread_stats_key, stats);
+    my_stats = stats;
+
+    return stats;
+}
+
+/*
+ * Add to one of this thread's counters. A relaxed store is enough as no other
+ * thread writes to it, and it stops alloc_stats() reading a torn value.
+ */
+static inline void count(unsigned long* counter, unsigned long amount)
+{
+    __atomic_store_n(counter, *counter + amount, __ATOMIC_RELAXED);
+}
+
+/*
+ * Read one of any thread's counters.
+ */
+static inline unsigned long read_count(const unsigned long* counter)
+{
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/*
+ * Difference of two sums of counters, or 0 if a count made while the sums
+ * were being read put them the wrong way around.
+ */
+static inline size_t count_difference(unsigned long added, 
+    unsigned long taken)
+{
+    return added > taken ? added - taken : 0;
+}
+
 /*
  * Prints out the current freed and alloc lists and all the data
  * assosiated with them as well as some stats about them.
@@ -33,45 +619,57 @@ void list()
 {
     int alloc_count = 0, freed_count = 0, alloc_total = 0, freed_total = 0;
 
-    /* Print out the entire alloc_list linked list */
-    r_lock(&alloc_list.rw_lock);
-
-    struct block* alloc_current = alloc_list.head;
-    printf("\n\nALLOC LIST\n----------\n");
-    while(alloc_current != NULL)
+    /* Print out every alloc list linked list that has any blocks */
+    for(int i = 0; i < ALLOC_LIST_BINS; ++i)
     {
-        printf("-->Block: %p, Next: %p, Prev: %p, Size: %ld, Data: %p\n", 
-            (void*) alloc_current, (void*) alloc_current->next,
-            (void*) alloc_current->prev, alloc_current->size, 
-            alloc_current->data);
-        ++alloc_count;
-        alloc_total += alloc_current->size;
-        alloc_current = alloc_current->next;
-    }
-    printf("-->Head: %p\n", (void*) alloc_list.head);
-    printf("-->Tail: %p\n", (void*) alloc_list.tail);
+        r_lock(&alloc_lists[i].rw_lock);
 
-    r_unlock(&alloc_list.rw_lock);
+        struct block* alloc_current = alloc_lists[i].head;
+        if(alloc_current != NULL)
+        {
+            printf("\n\nALLOC LIST %d\n------------\n", i);
+        }
+        while(alloc_current != NULL)
+        {
+            printf("-->Block: %p, Next: %p, Prev: %p, Size: %ld, Data: %p\n", 
+                (void*) alloc_current, (void*) alloc_current->next,
+                (void*) alloc_current->prev, alloc_current->size, 
+                alloc_current->data);
+            ++alloc_count;
+            alloc_total += alloc_current->size;
+            alloc_current = alloc_current->next;
+        }
+        if(alloc_lists[i].head != NULL)
+        {
+            printf("-->Head: %p\n", (void*) alloc_lists[i].head);
+            printf("-->Tail: %p\n", (void*) alloc_lists[i].tail);
+        }
 
-    /* Print out the entire freed_list linked list */
-    r_lock(&freed_list.rw_lock);
+        r_unlock(&alloc_lists[i].rw_lock);
+    }
 
-    struct block* freed_current = freed_list.head;
-    printf("\n\nFREED LIST\n----------\n");
-    while(freed_current != NULL)
+    /* Print out every freed list linked list */
+    for(int i = 0; i <= policy_count; ++i)
     {
-        printf("-->Block: %p, Next: %p, Prev: %p, Size: %ld, Data: %p\n", 
-            (void*) freed_current, (void*) freed_current->next, 
-            (void*) freed_current->prev, freed_current->size, 
-            freed_current->data);
-        ++freed_count;
-        freed_total += freed_current->size;
-        freed_current = freed_current->next;
-    }
-    printf("-->Head: %p\n", (void*) freed_list.head);
-    printf("-->Tail: %p\n", (void*) freed_list.tail);
+        r_lock(&freed_lists[i].rw_lock);
+
+        struct block* freed_current = freed_lists[i].head;
+        printf("\n\nFREED LIST %d\n------------\n", i);
+        while(freed_current != NULL)
+        {
+            printf("-->Block: %p, Next: %p, Prev: %p, Size: %ld, Data: %p\n", 
+                (void*) freed_current, (void*) freed_current->next, 
+                (void*) freed_current->prev, freed_current->size, 
+                freed_current->data);
+            ++freed_count;
+            freed_total += freed_current->size;
+            freed_current = freed_current->next;
+        }
+        printf("-->Head: %p\n", (void*) freed_lists[i].head);
+        printf("-->Tail: %p\n", (void*) freed_lists[i].tail);
 
-    r_unlock(&freed_list.rw_lock);
+        r_unlock(&freed_lists[i].rw_lock);
+    }
 
     /* Print total nodes and average block sizes of each list */
     printf("Alloc list size: %d\n", alloc_count);
@@ -81,549 +679,4209 @@ void list()
 }
 
 /*
- * Simply push the program heap break forward by the passed in size and return
- * the pointer to the data just created.
- * 
- * Mutex locks are utilised here to ensure it is thread safe.
- * 
- * If this fucntion is to fail, we abort the program.
+ * Walk the freed and alloc lists totalling up the figures printed by list(),
+ * without printing every block.
  */
-static void* change_break(size_t chunk_size)
+void list_summary(struct list_summary* summary)
 {
-    /* Mutually this sections so calls to sbrk() are thread safe */
-    pthread_mutex_lock(&sbrk_lock);
+    summary->alloc_count = 0;
+    summary->alloc_bytes = 0;
+    summary->freed_count = 0;
+    summary->freed_bytes = 0;
+    summary->largest_freed = 0;
 
-    #ifdef DEBUG
-    printf("-->Moving program break %ld bytes forward. (%p -> %p)\n", 
-        chunk_size, sbrk(0), (void*)((char*) sbrk(0) + chunk_size));
-    #endif
+    for(int i = 0; i < ALLOC_LIST_BINS; ++i)
+    {
+        r_lock(&alloc_lists[i].rw_lock);
 
-    void* sbrk_ret = sbrk(chunk_size);
+        for(struct block* block = alloc_lists[i].head; block != NULL; 
+            block = block->next)
+        {
+            /* A cached chunk is still in its alloc list, but is free */
+            if(__atomic_load_n(&block->cached, __ATOMIC_RELAXED) != 0)
+            {
+                ++summary->freed_count;
+                summary->freed_bytes += block->size;
+                if(block->size > summary->largest_freed)
+                {
+                    summary->largest_freed = block->size;
+                }
+                continue;
+            }
+            ++summary->alloc_count;
+            summary->alloc_bytes += block->size;
+        }
 
-    pthread_mutex_unlock(&sbrk_lock);
+        r_unlock(&alloc_lists[i].rw_lock);
+    }
 
-    /* If we get (void*) -1 returned from sbrk() then it has failed and we need
-     * to abort the program. */
-    if(sbrk_ret == (void*) -1)
+    for(int i = 0; i <= policy_count; ++i)
     {
-        perror("'sbrk()' failed unexpectedly");
-        abort();
+        r_lock(&freed_lists[i].rw_lock);
+
+        for(struct block* block = freed_lists[i].head; block != NULL; 
+            block = block->next)
+        {
+            ++summary->freed_count;
+            summary->freed_bytes += block->size;
+            if(block->size > summary->largest_freed)
+            {
+                summary->largest_freed = block->size;
+            }
+        }
+
+        r_unlock(&freed_lists[i].rw_lock);
     }
-    return sbrk_ret;
+
+    pthread_mutex_lock(&sbrk_lock);
+
+    summary->heap_size = heap_size;
+
+    pthread_mutex_unlock(&sbrk_lock);
 }
 
 /*
- * Allocates both the requested size 'chunk_size' and the metadata block
- * assosiated with it on the heap and returns a pointer to the metadata block.
+ * Sum the counters of every thread, without taking any list locks
  */
-static struct block* create_block(size_t chunk_size)
+void alloc_stats(struct alloc_stats* stats)
 {
-    /* Allocate the metadata block on the heap */
-    struct block* current_block = 
-        (struct block*) change_break(sizeof(struct block));
-    
-    /* Initialise some default values */
-    current_block->next = NULL;
-    current_block->prev = NULL;
-    if(pthread_mutex_init(&current_block->lock, NULL))
+    unsigned long alloc_bytes = 0, dealloc_bytes = 0;
+    unsigned long created_blocks = 0, created_bytes = 0;
+    unsigned long short_blocks = 0, short_bytes = 0;
+    unsigned long trimmed_blocks = 0;
+    unsigned long class_allocs[ALLOC_SIZE_CLASSES] = {0};
+    unsigned long class_deallocs[ALLOC_SIZE_CLASSES] = {0};
+
+    memset(stats, 0, sizeof(struct alloc_stats));
+
+    for(struct thread_stats* thread = 
+        __atomic_load_n(&thread_stats_list, __ATOMIC_ACQUIRE); 
+        thread != NULL; thread = thread->next)
     {
-        perror("'pthread_mutex_init' failed unexpectedly");
-        abort();
+        stats->allocs += read_count(&thread->allocs);
+        stats->deallocs += read_count(&thread->deallocs);
+        alloc_bytes += read_count(&thread->alloc_bytes);
+        dealloc_bytes += read_count(&thread->dealloc_bytes);
+        created_blocks += read_count(&thread->created_blocks);
+        created_bytes += read_count(&thread->created_bytes);
+        stats->splits += read_count(&thread->splits);
+        stats->merges += read_count(&thread->merges);
+        stats->purges += read_count(&thread->purges);
+        stats->purged_bytes += read_count(&thread->purged_bytes);
+        stats->searches += read_count(&thread->searches);
+        stats->search_steps += read_count(&thread->search_steps);
+        stats->short_allocs += read_count(&thread->short_allocs);
+        stats->cache_allocs += read_count(&thread->cache_allocs);
+        stats->moves += read_count(&thread->moves);
+        stats->moved_bytes += read_count(&thread->moved_bytes);
+        trimmed_blocks += read_count(&thread->trimmed_blocks);
+        stats->trimmed_bytes += read_count(&thread->trimmed_bytes);
+        short_blocks += read_count(&thread->short_blocks);
+        short_bytes += read_count(&thread->short_bytes);
+
+        for(int i = 0; i < ALLOC_SIZE_CLASSES; ++i)
+        {
+            class_allocs[i] += read_count(&thread->class_allocs[i]);
+            class_deallocs[i] += read_count(&thread->class_deallocs[i]);
+        }
     }
 
-    /* Allocate the requested data on the heap and set the data ptr to 
-     * the allocation, as well as record the size of this allocation */
-    current_block->data = change_break(chunk_size);
-    current_block->size = chunk_size;
+    /* Every block is either created or split off another, until it is merged
+     * into another (or given back to its short lived region, or trimmed off
+     * the heap), and is then in use or free */
+    stats->blocks_in_use = count_difference(stats->allocs, stats->deallocs);
+    stats->bytes_in_use = count_difference(alloc_bytes, dealloc_bytes);
+    stats->blocks_free = count_difference(created_blocks + stats->splits, 
+        stats->merges + short_blocks + trimmed_blocks + stats->blocks_in_use);
+    stats->bytes_free = count_difference(created_bytes, 
+        short_bytes + stats->trimmed_bytes + stats->bytes_in_use);
+    for(int i = 0; i < ALLOC_SIZE_CLASSES; ++i)
+    {
+        stats->class_allocs[i] = class_allocs[i];
+        stats->class_in_use[i] = count_difference(class_allocs[i], 
+            class_deallocs[i]);
+    }
 
-    #ifdef DEBUG
-    printf("-->Created block (Block: %p, Next: %p, Prev: %p, Size: %ld,"
-        "Data: %p)\n", 
-        (void*) current_block, (void*) current_block->next, 
-        (void*) current_block->prev, current_block->size, current_block->data);
-    #endif
+    stats->heap_size = __atomic_load_n(&heap_size, __ATOMIC_RELAXED);
+    stats->heap_peak = __atomic_load_n(&heap_peak, __ATOMIC_RELAXED);
+    stats->os_bytes = __atomic_load_n(&os_bytes, __ATOMIC_RELAXED);
+    stats->grow_calls = __atomic_load_n(&grow_calls, __ATOMIC_RELAXED);
+    stats->os_calls = __atomic_load_n(&os_calls, __ATOMIC_RELAXED);
+    stats->short_regions = __atomic_load_n(&short_regions, __ATOMIC_RELAXED);
+    stats->region_recycles = 
+        __atomic_load_n(&region_recycles, __ATOMIC_RELAXED);
+    stats->region_unmaps = __atomic_load_n(&region_unmaps, __ATOMIC_RELAXED);
+}
 
-    return current_block;
+/*
+ * Map a buffer for 'capacity' heap dump records, copying the first 'count'
+ * records of the old buffer into it. The buffer is mapped directly so the
+ * dump never calls back into the allocator it is dumping.
+ */
+static struct dump_record* grow_dump(struct dump_record* records, 
+    size_t count, size_t old_capacity, size_t capacity)
+{
+    struct dump_record* grown = mmap(NULL, 
+        capacity * sizeof(struct dump_record), PROT_READ | PROT_WRITE, 
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(grown == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    if(records != NULL)
+    {
+        memcpy(grown, records, count * sizeof(struct dump_record));
+        munmap(records, old_capacity * sizeof(struct dump_record));
+    }
+    return grown;
 }
 
 /*
- * Split the block passed in down to the size specified, returning a new 
- * block with the size that is left over.
+ * Copy every block of the list into the dump buffer, holding the list's read
+ * lock only while it is copied. If the buffer is too small, the lock is
+ * dropped while it grows and the list is copied again. Returns -1 if the
+ * buffer couldnt grow.
  */
-static struct block* split_block(struct block* block, size_t new_size)
+static int dump_list(struct linked_list* list, uint8_t state, uint16_t index,
+    struct dump_record** records, size_t* count, size_t* capacity)
 {
-    #ifdef DEBUG
-    printf("-->Splitting block (Block: %p, Next: %p, Prev: %p, Size: %ld,"
-        "Data: %p) down to %ld and %ld\n", 
-        (void*) block, (void*) block->next, (void*) block->prev, 
-        block->size, block->data, new_size, block->size - new_size);
-    #endif
+    for(;;)
+    {
+        size_t length = 0;
 
-    /* Create a new block with the left over size */
-    struct block* new_block = create_block(block->size - new_size);
+        r_lock(&list->rw_lock);
 
-    /* Set the block we are splitting to its smaller new size */
-    block->size = new_size;
+        for(struct block* block = list->head; block != NULL; 
+            block = block->next)
+        {
+            ++length;
+        }
 
-    /* Give the new block a pointer to the data of the old block, but offset
-     * by the old blocks new size */
-    new_block->data = (void *) (((char *) block->data) + new_size);
+        if(*count + length <= *capacity)
+        {
+            for(struct block* block = list->head; block != NULL; 
+                block = block->next)
+            {
+                struct dump_record* record = &(*records)[(*count)++];
+                record->address = (uint64_t) (uintptr_t) block->data;
+                record->size = block->size;
+                record->state = 
+                    __atomic_load_n(&block->cached, __ATOMIC_RELAXED) != 0 ? 
+                    DUMP_FREE : state;
+                record->flags = (uint8_t) block->flags;
+                record->list = index;
+                record->reserved = 0;
+            }
+
+            r_unlock(&list->rw_lock);
+            return 0;
+        }
+
+        r_unlock(&list->rw_lock);
+
+        size_t capacity_needed = (*count + length) * 2;
+        struct dump_record* grown = grow_dump(*records, *count, *capacity, 
+            capacity_needed);
+        if(grown == NULL)
+        {
+            return -1;
+        }
+        *records = grown;
+        *capacity = capacity_needed;
+    }
+}
+
+/*
+ * Compare two heap dump records by address for qsort.
+ */
+static int compare_address(const void* a, const void* b)
+{
+    uint64_t x = ((const struct dump_record*) a)->address;
+    uint64_t y = ((const struct dump_record*) b)->address;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Copy each list in turn, then sort and write out the copy
+ */
+int heap_dump(int fd)
+{
+    struct dump_header header;
+    size_t count = 0, capacity = DUMP_INITIAL_RECORDS;
+    int result = 0;
+
+    struct dump_record* records = grow_dump(NULL, 0, 0, capacity);
+    if(records == NULL)
+    {
+        return -1;
+    }
+
+    for(int i = 0; i < ALLOC_LIST_BINS && result == 0; ++i)
+    {
+        result = dump_list(&alloc_lists[i], DUMP_ALLOCATED, i, &records, 
+            &count, &capacity);
+    }
+    for(int i = 0; i <= POLICY_MAX_RANGES && result == 0; ++i)
+    {
+        result = dump_list(&freed_lists[i], DUMP_FREE, i, &records, &count, 
+            &capacity);
+    }
+
+    if(result == 0)
+    {
+        qsort(records, count, sizeof(struct dump_record), compare_address);
+
+        memcpy(header.magic, DUMP_MAGIC, sizeof(header.magic));
+        header.version = DUMP_VERSION;
+        header.record_size = sizeof(struct dump_record);
+        header.reserved = 0;
+        header.heap_size = __atomic_load_n(&heap_size, __ATOMIC_RELAXED);
+        header.os_bytes = __atomic_load_n(&os_bytes, __ATOMIC_RELAXED);
+        header.count = count;
+
+        /* Write out the header and then the records, carrying on after any
+         * partial writes */
+        const char* parts[2] = {(const char*) &header, (const char*) records};
+        size_t lengths[2] = {sizeof(header), 
+            count * sizeof(struct dump_record)};
+        for(int i = 0; i < 2 && result == 0; ++i)
+        {
+            while(lengths[i] > 0)
+            {
+                ssize_t written = write(fd, parts[i], lengths[i]);
+                if(written <= 0)
+                {
+                    result = -1;
+                    break;
+                }
+                parts[i] += written;
+                lengths[i] -= written;
+            }
+        }
+    }
+
+    munmap(records, capacity * sizeof(struct dump_record));
+    return result;
+}
+
+/*
+ * Map a new huge page region of at least 'size' bytes aligned to
+ * HUGE_REGION_SIZE, returning NULL if it couldnt be mapped.
+ *
+ * In HUGEPAGE_HUGETLB mode explicit huge pages are tried first, falling back
+ * to transparent huge pages if none are available. Transparent huge pages are
+ * requested by over mapping so the region can be aligned, then advising the
+ * kernel with MADV_HUGEPAGE.
+ *
+ * Must be called with the sbrk_lock held.
+ */
+static struct huge_region* map_region(size_t size)
+{
+    struct huge_region* region = NULL;
+    unsigned int flags = 0;
+
+    size = (size + HUGE_REGION_SIZE - 1) & ~((size_t) HUGE_REGION_SIZE - 1);
+
+    #ifdef MAP_HUGETLB
+    if(current_hugepage_mode == HUGEPAGE_HUGETLB)
+    {
+        void* map = mmap(NULL, size, PROT_READ | PROT_WRITE, 
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        __atomic_store_n(&os_calls, os_calls + 1, __ATOMIC_RELAXED);
+        if(map != MAP_FAILED)
+        {
+            region = (struct huge_region*) map;
+            flags = REGION_HUGETLB;
+        }
+    }
+    #endif
+
+    if(region == NULL)
+    {
+        char* map = mmap(NULL, size + HUGE_REGION_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        __atomic_store_n(&os_calls, os_calls + 1, __ATOMIC_RELAXED);
+        if(map == MAP_FAILED)
+        {
+            return NULL;
+        }
+
+        /* Trim the over mapped memory either side of the aligned region */
+        char* aligned = (char*) (((uintptr_t) map + HUGE_REGION_SIZE - 1) & 
+            ~((uintptr_t) HUGE_REGION_SIZE - 1));
+        if(aligned > map)
+        {
+            munmap(map, aligned - map);
+        }
+        munmap(aligned + size, (map + size + HUGE_REGION_SIZE) - 
+            (aligned + size));
+
+        region = (struct huge_region*) aligned;
+
+        #ifdef MADV_HUGEPAGE
+        if(madvise(region, size, MADV_HUGEPAGE) == 0)
+        {
+            flags = REGION_THP;
+        }
+        #endif
+    }
+
+    region->next = huge_regions;
+    region->size = size;
+    region->flags = flags;
+    huge_regions = region;
+
+    ++huge_region_count;
+    huge_bytes_reserved += size;
+    __atomic_store_n(&os_bytes, os_bytes + size, __ATOMIC_RELAXED);
+    if(flags & REGION_HUGETLB)
+    {
+        huge_bytes_hugetlb += size;
+    }
+    else if(flags & REGION_THP)
+    {
+        huge_bytes_thp += size;
+    }
+
+    #ifdef DEBUG
+    printf("-->Mapped huge page region (Region: %p, Size: %ld, Flags: %u)\n",
+        (void*) region, size, flags);
+    #endif
+
+    return region;
+}
+
+/*
+ * Carve 'chunk_size' bytes out of the huge page regions. Small chunks are
+ * packed into the current region, only mapping a new one once it is full.
+ * Large chunks get a region of their own, with whatever is left at the end of
+ * it taking over as the current region if it has more space free.
+ *
+ * Must be called with the sbrk_lock held.
+ */
+static void* carve_region(size_t chunk_size)
+{
+    size_t size = (chunk_size + HUGE_REGION_ALIGN - 1) & 
+        ~((size_t) HUGE_REGION_ALIGN - 1);
+    size_t header = (sizeof(struct huge_region) + HUGE_REGION_ALIGN - 1) & 
+        ~((size_t) HUGE_REGION_ALIGN - 1);
+    char* chunk;
+
+    if(size < HUGE_REGION_LARGE && huge_region_cur != NULL && 
+        size <= (size_t) (huge_region_end - huge_region_cur))
+    {
+        chunk = huge_region_cur;
+        huge_region_cur += size;
+    }
+    else
+    {
+        struct huge_region* region = map_region(header + size);
+        if(region == NULL)
+        {
+            return (void*) -1;
+        }
+
+        /* A large chunk's region only takes over from the current region if
+         * it has more room left over for small chunks */
+        chunk = (char*) region + header;
+        if(size < HUGE_REGION_LARGE || huge_region_cur == NULL || 
+            region->size - header - size > 
+            (size_t) (huge_region_end - huge_region_cur))
+        {
+            huge_region_cur = chunk + size;
+            huge_region_end = (char*) region + region->size;
+        }
+    }
+
+    huge_bytes_used += size;
+
+    return chunk;
+}
+
+/*
+ * Move the program break forward so the top chunk has at least 'size' bytes
+ * free, growing it by the larger of 'size' and the growth amount, which is
+ * then doubled. Returns -1 if sbrk() fails.
+ *
+ * Must be called with the sbrk_lock held.
+ */
+static int grow_top(size_t size)
+{
+    size_t grow = top_grow;
+    if(grow < size + TOP_ALIGN)
+    {
+        grow = (size + TOP_ALIGN + TOP_MIN_GROW - 1) & 
+            ~((size_t) TOP_MIN_GROW - 1);
+    }
+
+    #ifdef DEBUG
+    printf("-->Moving program break %ld bytes forward. (%p -> %p)\n", 
+        grow, sbrk(0), (void*)((char*) sbrk(0) + grow));
+    #endif
+
+    char* sbrk_ret = (char*) sbrk(grow);
+    __atomic_store_n(&os_calls, os_calls + 1, __ATOMIC_RELAXED);
+    if(sbrk_ret == (char*) -1)
+    {
+        return -1;
+    }
+    __atomic_store_n(&os_bytes, os_bytes + grow, __ATOMIC_RELAXED);
+
+    /* The new memory only carries on from the top chunk if nothing else has
+     * moved the break since, otherwise it starts a new top chunk */
+    if(sbrk_ret != top_end)
+    {
+        if(top_end - top_cur >= TOP_ALIGN)
+        {
+            top_orphan = top_cur;
+            top_orphan_size = top_end - top_cur;
+            __atomic_store_n(&heap_size, heap_size + top_orphan_size, 
+                __ATOMIC_RELAXED);
+            if(heap_size > heap_peak)
+            {
+                __atomic_store_n(&heap_peak, heap_size, __ATOMIC_RELAXED);
+            }
+        }
+        top_cur = (char*) (((uintptr_t) sbrk_ret + TOP_ALIGN - 1) & 
+            ~((uintptr_t) TOP_ALIGN - 1));
+    }
+    top_end = sbrk_ret + grow;
+
+    if(top_grow < TOP_MAX_GROW)
+    {
+        top_grow *= 2;
+    }
+
+    return 0;
+}
+
+/*
+ * Carve the passed in size off the top chunk and return the pointer to the
+ * data just created, growing the top chunk with sbrk when it runs out. When
+ * huge pages are enabled, the memory is carved from a huge page region
+ * instead.
+ * 
+ * Mutex locks are utilised here to ensure it is thread safe.
+ * 
+ * If this fucntion is to fail, we abort the program.
+ */
+static void* change_break(size_t chunk_size)
+{
+    void* sbrk_ret;
+    char* orphan;
+    size_t orphan_size;
+
+    /* Near the soft limit, free memory is handed back before growing */
+    if(__atomic_load_n(&soft_limit, __ATOMIC_RELAXED) != SOFT_LIMIT_OFF)
+    {
+        soft_limit_check(chunk_size);
+    }
+
+    /* Mutually this sections so calls to sbrk() are thread safe */
+    pthread_mutex_lock(&sbrk_lock);
+
+    __atomic_store_n(&grow_calls, grow_calls + 1, __ATOMIC_RELAXED);
+
+    if(current_hugepage_mode != HUGEPAGE_OFF)
+    {
+        sbrk_ret = carve_region(chunk_size);
+    }
+    else
+    {
+        size_t size = (chunk_size + TOP_ALIGN - 1) & 
+            ~((size_t) TOP_ALIGN - 1);
+
+        sbrk_ret = (void*) -1;
+        if(size <= (size_t) (top_end - top_cur) || grow_top(size) == 0)
+        {
+            sbrk_ret = top_cur;
+            top_cur += size;
+        }
+    }
+
+    if(sbrk_ret != (void*) -1)
+    {
+        __atomic_store_n(&heap_size, heap_size + chunk_size, __ATOMIC_RELAXED);
+        if(heap_size > heap_peak)
+        {
+            __atomic_store_n(&heap_peak, heap_size, __ATOMIC_RELAXED);
+        }
+    }
+
+    orphan = top_orphan;
+    orphan_size = top_orphan_size;
+    top_orphan = NULL;
+    top_orphan_size = 0;
+
+    pthread_mutex_unlock(&sbrk_lock);
+
+    /* If we get (void*) -1 returned from sbrk() then it has failed and we need
+     * to abort the program. */
+    if(sbrk_ret == (void*) -1)
+    {
+        perror("'sbrk()' failed unexpectedly");
+        abort();
+    }
+
+    /* The end of a top chunk cut off by something else moving the break is
+     * freed rather than lost */
+    if(orphan != NULL)
+    {
+        struct block* block = new_block();
+        block->data = orphan;
+        block->size = orphan_size;
+        block->flags = BLOCK_ZEROED;
+
+        struct thread_stats* stats = get_thread_stats();
+        count(&stats->created_blocks, 1);
+        count(&stats->created_bytes, orphan_size);
+
+        freed_list_insert(block);
+    }
+
+    return sbrk_ret;
+}
+
+/*
+ * Returns a metadata block with no data yet, reusing the metadata of a block
+ * that has been merged into another (or reserved by alloc_reserve()) if there
+ * is one, otherwise mapping a new batch of them.
+ */
+static struct block* new_block()
+{
+    pthread_mutex_lock(&spare_lock);
+
+    struct block* current_block = spare_blocks;
+    if(current_block != NULL)
+    {
+        spare_blocks = current_block->next;
+    }
+    else if(reserve_blocks < reserve_blocks_end)
+    {
+        current_block = reserve_blocks++;
+    }
+
+    pthread_mutex_unlock(&spare_lock);
+
+    if(current_block == NULL)
+    {
+        struct block* batch = mmap(NULL, BLOCK_BATCH_BYTES, 
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(batch == MAP_FAILED)
+        {
+            perror("'mmap()' failed unexpectedly");
+            abort();
+        }
+
+        pthread_mutex_lock(&sbrk_lock);
+
+        __atomic_store_n(&os_calls, os_calls + 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&os_bytes, os_bytes + BLOCK_BATCH_BYTES, 
+            __ATOMIC_RELAXED);
+
+        pthread_mutex_unlock(&sbrk_lock);
+
+        /* Another thread may have mapped a batch meanwhile, in which case
+         * this one is kept as spares */
+        pthread_mutex_lock(&spare_lock);
+
+        if(reserve_blocks >= reserve_blocks_end)
+        {
+            reserve_blocks = &batch[1];
+            reserve_blocks_end = &batch[BLOCK_BATCH];
+        }
+        else
+        {
+            for(size_t i = 1; i < BLOCK_BATCH; ++i)
+            {
+                batch[i].next = spare_blocks;
+                spare_blocks = &batch[i];
+            }
+        }
+
+        pthread_mutex_unlock(&spare_lock);
+
+        current_block = batch;
+    }
+    
+    /* Initialise some default values */
+    current_block->next = NULL;
+    current_block->prev = NULL;
+    current_block->flags = 0;
+    current_block->owner = 0;
+    current_block->tag = 0;
+    if(pthread_mutex_init(&current_block->lock, NULL))
+    {
+        perror("'pthread_mutex_init' failed unexpectedly");
+        abort();
+    }
+
+    return current_block;
+}
+
+/*
+ * Carve 'chunk_size' bytes aligned to 'align' from this thread's span of
+ * thread pages, taking a new span from the heap if it doesnt fit. What was
+ * left of the old span is freed, still belonging to this thread.
+ */
+static void* carve_span(struct thread_stats* stats, size_t chunk_size, 
+    size_t align)
+{
+    char* data = (char*) (((uintptr_t) stats->span_cur + align - 1) & 
+        ~((uintptr_t) align - 1));
+
+    if(stats->span_cur == NULL || chunk_size > (size_t) (stats->span_end - data))
+    {
+        char* old_cur = stats->span_cur;
+        size_t old_size = stats->span_end - stats->span_cur;
+
+        /* Spans start on a cache line so none of their lines are shared */
+        char* span = (char*) change_break(THREAD_SPAN_SIZE + CACHE_LINE);
+        stats->span_cur = (char*) (((uintptr_t) span + CACHE_LINE - 1) & 
+            ~((uintptr_t) CACHE_LINE - 1));
+        stats->span_end = stats->span_cur + THREAD_SPAN_SIZE;
+        data = (char*) (((uintptr_t) stats->span_cur + align - 1) & 
+            ~((uintptr_t) align - 1));
+
+        if(old_cur != NULL && old_size >= TOP_ALIGN)
+        {
+            struct block* left_over = new_block();
+            left_over->data = old_cur;
+            left_over->size = old_size;
+            left_over->flags = BLOCK_ZEROED;
+            left_over->owner = stats->id;
+
+            count(&stats->created_blocks, 1);
+            count(&stats->created_bytes, old_size);
+
+            freed_list_insert(left_over);
+        }
+    }
+
+    stats->span_cur = data + chunk_size;
+    return data;
+}
+
+/*
+ * Allocates both the requested size 'chunk_size' and the metadata block
+ * assosiated with it on the heap and returns a pointer to the metadata block.
+ * The data is aligned to 'align', which is at most CACHE_LINE. Small chunks
+ * are carved from this thread's pages when thread pages are on (or the chunk
+ * needs its own cache lines).
+ */
+static struct block* create_block(size_t chunk_size, size_t align)
+{
+    struct block* current_block = new_block();
+
+    /* Allocate the requested data on the heap and set the data ptr to 
+     * the allocation, as well as record the size of this allocation */
+    if(chunk_size <= THREAD_PAGE_MAX && (align > TOP_ALIGN || 
+        __atomic_load_n(&thread_pages, __ATOMIC_RELAXED)))
+    {
+        struct thread_stats* stats = get_thread_stats();
+        current_block->data = carve_span(stats, chunk_size, align);
+        current_block->owner = stats->id;
+    }
+    else if(align > TOP_ALIGN)
+    {
+        char* data = (char*) change_break(chunk_size + align - TOP_ALIGN);
+        current_block->data = (void*) (((uintptr_t) data + align - 1) & 
+            ~((uintptr_t) align - 1));
+    }
+    else
+    {
+        current_block->data = change_break(chunk_size);
+    }
+    current_block->size = chunk_size;
+
+    /* Memory fresh from the OS is always zero filled */
+    current_block->flags = BLOCK_ZEROED;
+
+    #ifdef DEBUG
+    printf("-->Created block (Block: %p, Next: %p, Prev: %p, Size: %ld,"
+        "Data: %p)\n", 
+        (void*) current_block, (void*) current_block->next, 
+        (void*) current_block->prev, current_block->size, current_block->data);
+    #endif
+
+    return current_block;
+}
+
+/*
+ * Split the block passed in down to the size specified, returning a new 
+ * block with the size that is left over.
+ */
+static struct block* split_block(struct block* block, size_t new_size)
+{
+    #ifdef DEBUG
+    printf("-->Splitting block (Block: %p, Next: %p, Prev: %p, Size: %ld,"
+        "Data: %p) down to %ld and %ld\n", 
+        (void*) block, (void*) block->next, (void*) block->prev, 
+        block->size, block->data, new_size, block->size - new_size);
+    #endif
+
+    /* Create a new block for the left over memory, which already belongs to
+     * the heap so only its metadata is needed */
+    struct block* left_over = new_block();
+    left_over->size = block->size - new_size;
+
+    /* Set the block we are splitting to its smaller new size */
+    block->size = new_size;
+
+    /* The left over memory is only known to be zero if the whole block was,
+     * and stays in the same thread's pages */
+    left_over->flags = block->flags & BLOCK_ZEROED;
+    left_over->owner = block->owner;
+
+    /* Give the new block a pointer to the data of the old block, but offset
+     * by the old blocks new size */
+    left_over->data = (void *) (((char *) block->data) + new_size);
+
+    return left_over;
+}
+
+/*
+ * Returns the index of the policy range (and freed list) that the passed in
+ * size falls within.
+ */
+static int policy_index(size_t size)
+{
+    for(int i = 0; i < policy_count; ++i)
+    {
+        if(size <= policy[i].max_size)
+        {
+            return i;
+        }
+    }
+    return policy_count;
+}
+
+/*
+ * Returns the index of the alloc list holding blocks of the passed in size,
+ * which is the position of its highest set bit.
+ */
+static int alloc_index(size_t size)
+{
+    return (int) (sizeof(unsigned long) * 8 - 1) - 
+        __builtin_clzl((unsigned long) size);
+}
+
+/*
+ * Append a block pointer to the back of the passed in list
+ */
+static void list_append(struct linked_list* list, struct block* block)
+{
+    /* If this is the first ever block we need to set it as the head */
+    if(list->head == NULL)
+    {
+        list->head = block;
+    }
+
+    /* Set the current tail's next block to this block and this blocks previous
+     * to the current tail (if there is a tail) */
+    if(list->tail != NULL)
+    {
+        list->tail->next = block;
+        block->prev = list->tail;
+    }
+
+    /* This block will always become the new tail */
+    list->tail = block;
+
+    #ifdef DEBUG
+    printf("-->Appended block (Block: %p, Next: %p, Prev: %p, Size: %ld,"
+        "Data: %p) to back of list %p.\n", 
+        (void*) block, (void*) block->next, (void*) block->prev,
+        block->size, block->data, (void*) list);
+    #endif
+}
+
+/*
+ * Delete the specified block from the passed in list
+ */
+static void list_delete(struct linked_list* list, struct block* block)
+{
+    #ifdef DEBUG
+    printf("-->Removing block (Block: %p, Next: %p, Prev: %p, Size: %ld,"
+        "Data: %p)\n", 
+        (void*) block, (void*) block->next, (void*) block->prev,
+        block->size, block->data);
+    #endif
+
+    /* If the block is the head of the list we need to set the new head as the
+     * next block (the next block could be NULL in this case, which is fine) */
+    if(block == list->head)
+    {
+        list->head = block->next;
+    }
+
+    /* If the block is the tail of the list we need to set the new tail as the
+     * prev block (the prev block could be NULL in this case, which is fine) */
+    if(block == list->tail)
+    {
+        list->tail = block->prev;
+    }
+
+    /* If the block has either a next or prev block, then we rebuild the list
+     * by linking the prev node with the next node */
+    if(block->next != NULL)
+    {
+        block->next->prev = block->prev;
+    }
+    if(block->prev != NULL)
+    {
+        block->prev->next = block->next;
+    }
+
+    /* Remove the references to the prev and next so that it is completely
+     * unrelated either list */
+    block->next = NULL;
+    block->prev = NULL;
+}
+
+/*
+ * Returns the first slot of a chunk table to probe for the data
+ */
+static inline size_t chunk_table_hash(const struct chunk_table* table, 
+    const void* data)
+{
+    uint64_t hash = ((uintptr_t) data >> 4) * 0x9e3779b97f4a7c15ull;
+    return (size_t) (hash >> 32) & (table->capacity - 1);
+}
+
+/*
+ * Put a block in the first free slot from its hash, which must be there
+ */
+static void chunk_table_place(struct chunk_table* table, struct block* block)
+{
+    size_t slot = chunk_table_hash(table, block->data);
+
+    while(table->slots[slot] != NULL && table->slots[slot] != CHUNK_TABLE_HOLE)
+    {
+        slot = (slot + 1) & (table->capacity - 1);
+    }
+    if(table->slots[slot] == NULL)
+    {
+        ++table->used;
+    }
+    table->slots[slot] = block;
+    block->slot = slot;
+    ++table->count;
+}
+
+/*
+ * Add a block to a chunk table, moving the table to a new mapping without its
+ * holes (twice as large if over half of it would be blocks) once three
+ * quarters of it is in use.
+ */
+static void chunk_table_insert(struct chunk_table* table, struct block* block)
+{
+    if((table->used + 1) * 4 > table->capacity * 3)
+    {
+        struct block** old_slots = table->slots;
+        size_t old_capacity = table->capacity;
+        size_t capacity = old_capacity == 0 ? CHUNK_TABLE_INITIAL : 
+            (table->count + 1) * 2 > old_capacity ? old_capacity * 2 : 
+            old_capacity;
+
+        table->slots = mmap(NULL, capacity * sizeof(struct block*), 
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(table->slots == MAP_FAILED)
+        {
+            perror("Can't map chunk table");
+            abort();
+        }
+        table->capacity = capacity;
+        table->count = 0;
+        table->used = 0;
+
+        for(size_t i = 0; i < old_capacity; ++i)
+        {
+            if(old_slots[i] != NULL && old_slots[i] != CHUNK_TABLE_HOLE)
+            {
+                chunk_table_place(table, old_slots[i]);
+            }
+        }
+        if(old_slots != NULL)
+        {
+            munmap(old_slots, old_capacity * sizeof(struct block*));
+        }
+    }
+
+    chunk_table_place(table, block);
+}
+
+/*
+ * Remove a block from a chunk table, leaving a hole in its slot
+ */
+static void chunk_table_delete(struct chunk_table* table, struct block* block)
+{
+    #ifdef DEBUG
+    if(block->slot >= table->capacity || table->slots[block->slot] != block)
+    {
+        printf("Block %p isnt at slot %ld of the chunk table\n",
+            (void*) block, block->slot);
+        abort();
+    }
+    #endif
+
+    table->slots[block->slot] = CHUNK_TABLE_HOLE;
+    --table->count;
+}
+
+/*
+ * Returns the block in the chunk table whose data is 'chunk', or NULL if it
+ * isnt in the table
+ */
+static struct block* chunk_table_find(const struct chunk_table* table, 
+    const void* chunk)
+{
+    if(table->capacity == 0)
+    {
+        return NULL;
+    }
+
+    for(size_t slot = chunk_table_hash(table, chunk); 
+        table->slots[slot] != NULL; slot = (slot + 1) & (table->capacity - 1))
+    {
+        if(table->slots[slot] != CHUNK_TABLE_HOLE && 
+            table->slots[slot]->data == chunk)
+        {
+            return table->slots[slot];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Append a block to the back of an alloc list and its chunk table. The list
+ * must be write locked.
+ */
+static void alloc_append(int index, struct block* block)
+{
+    list_append(&alloc_lists[index], block);
+    chunk_table_insert(&chunk_tables[index], block);
+}
+
+/*
+ * Delete a block from an alloc list and its chunk table. The list must be
+ * write locked.
+ */
+static void alloc_delete(int index, struct block* block)
+{
+    list_delete(&alloc_lists[index], block);
+    chunk_table_delete(&chunk_tables[index], block);
+}
+
+/*
+ * Append a block to the back of a freed list and its index. The list must be
+ * write locked.
+ */
+static void freed_append(int index, struct block* block)
+{
+    list_append(&freed_lists[index], block);
+    free_index_insert(&freed_indexes[index], block);
+}
+
+/*
+ * Delete a block from a freed list and its index. The list must be write
+ * locked.
+ */
+static void freed_delete(int index, struct block* block)
+{
+    list_delete(&freed_lists[index], block);
+    free_index_delete(&freed_indexes[index], block);
+}
+
+/*
+ * Append a block to the back of the freed list for its size, taking the
+ * write lock of that list.
+ */
+static void freed_list_insert(struct block* block)
+{
+    int index = policy_index(block->size);
+    struct linked_list* list = &freed_lists[index];
+
+    w_lock(&list->rw_lock);
+
+    freed_append(index, block);
+    block->flags |= BLOCK_FREE;
+    block->freed_at = __atomic_load_n(&maint_tick, __ATOMIC_RELAXED);
+
+    w_unlock(&list->rw_lock);
+}
+
+/*
+ * Create a new block of the chunk_size with its data aligned to 'align' and
+ * add it to the alloc list for the 'asked' size.
+ */
+static struct block* aquire_new_block(size_t chunk_size, size_t align, 
+    size_t asked)
+{
+    struct block* block = create_block(chunk_size, align);
+
+    struct thread_stats* stats = get_thread_stats();
+    count(&stats->created_blocks, 1);
+    count(&stats->created_bytes, chunk_size);
+
+    int index = alloc_index(asked);
+    struct linked_list* list = &alloc_lists[index];
+
+    w_lock(&list->rw_lock);
+
+    block->asked = asked;
+    alloc_append(index, block);
+
+    w_unlock(&list->rw_lock);
+
+    return block;
+}
+
+/* 
+ * Allocate the passed in block and split it down to the passed in chunk size
+ * if the block is larger. It is assumed that the blocks mutex lock is owned by
+ * this thread, as it will be unlocked before exiting this function.
+ * 
+ * If NULL is passed in as the block, we create a new block of the chunk_size
+ * and allocate it. Either way it goes in the alloc list for the 'asked' size,
+ * being the rounded size the caller asked for.
+ */
+static struct block* aquire_block(struct block* block, size_t chunk_size, 
+    size_t asked)
+{
+    /* If we have found and locked a valid block, we remove it from its freed
+     * list (splitting the block if need be) and add it to the alloc list.
+     * We also release the lock on the block, so if it gets deallocated at a 
+     * later date, another thread is able to lock it for themselves. 
+     * 
+     * If the block is NULL, we create a new block and add it to the alloc
+     * list.
+     * 
+     * In both cases, write locks are used on the lists, as we are altering the
+     * data and need to maintain thread safety */
+    if(block != NULL)
+    {
+        int index = policy_index(block->size);
+        struct linked_list* list = &freed_lists[index];
+
+        w_lock(&list->rw_lock);
+
+        freed_delete(index, block);
+        block->flags &= ~BLOCK_FREE;
+
+        w_unlock(&list->rw_lock);
+
+        /* The left over memory may belong to a different range than the block
+         * it came from, so it is inserted into whichever list it now fits */
+        if(block->size > chunk_size)
+        {
+            search_split = 1;
+            freed_list_insert(split_block(block, chunk_size));
+        }
+
+        index = alloc_index(asked);
+        list = &alloc_lists[index];
+
+        w_lock(&list->rw_lock);
+
+        block->asked = asked;
+        alloc_append(index, block);
+        pthread_mutex_unlock(&block->lock);
+
+        w_unlock(&list->rw_lock);
+    }
+    else
+    {       
+        block = aquire_new_block(chunk_size, TOP_ALIGN, asked);
+    }
+
+    return block;
+}
+
+/*
+ * Returns 1 if this thread's search may use the free block. While thread
+ * pages are on, a small chunk only comes from this thread's own pages, and a
+ * block in another thread's pages is never used.
+ */
+static inline int block_usable(const struct block* block)
+{
+    if(search_owner == 0 || block->owner == search_owner)
+    {
+        return 1;
+    }
+    return !search_owned_only && block->owner == 0;
+}
+
+/*
+ * Returns the position of the first block from 'from' on in a freed list's
+ * index that is large enough for the size passed in and that this thread may
+ * use, or the index's count if there isnt one. The keys are rounded up, so
+ * each block found by its key is checked against the size itself.
+ */
+static size_t index_first(struct free_index* index, size_t from, 
+    size_t chunk_size)
+{
+    uint32_t key = free_index_key(chunk_size);
+    size_t i = free_index_next(index, from, key, FREE_INDEX_KEY_MAX);
+
+    while(i < index->count && (index->blocks[i]->size < chunk_size || 
+        !block_usable(index->blocks[i])))
+    {
+        i = free_index_next(index, i + 1, key, FREE_INDEX_KEY_MAX);
+    }
+
+    return i;
+}
+
+/*
+ * Search the blocks of a freed list's index with the passed in key for the
+ * block closest in size (BEST) or largest (WORST) that can hold the size,
+ * returning it locked or NULL if none was found. The blocks sharing a key
+ * are looked at in the order of the list, keeping the first smallest or
+ * largest block, so the same block is found as a walk of the list would.
+ */
+static struct block* index_fit(struct free_index* index, uint32_t key, 
+    size_t chunk_size, enum stratergy fit)
+{
+    struct block* fit_block = NULL;
+
+    for(size_t i = free_index_next(index, 0, key, key); i < index->count; 
+        i = free_index_next(index, i + 1, key, key))
+    {
+        struct block* current_block = index->blocks[i];
+
+        ++search_steps;
+        if(current_block->size < chunk_size || !block_usable(current_block))
+        {
+            continue;
+        }
+        if(fit_block != NULL && (fit == BEST ? 
+            current_block->size >= fit_block->size : 
+            current_block->size <= fit_block->size))
+        {
+            continue;
+        }
+
+        /* A block another thread has locked is skipped, and the lock on
+         * the previous choice is only given up once the new one is held */
+        if(pthread_mutex_trylock(&current_block->lock) != 0)
+        {
+            search_contended = 1;
+            continue;
+        }
+        if(fit_block != NULL)
+        {
+            pthread_mutex_unlock(&fit_block->lock);
+        }
+        fit_block = current_block;
+
+        /* A block of equal size is the best possible, so we can stop */
+        if(fit == BEST && fit_block->size == chunk_size)
+        {
+            break;
+        }
+    }
+
+    return fit_block;
+}
+
+#ifdef DEBUG
+/*
+ * Abort if the index found a different block to the one a walk of the freed
+ * list finds with the fit policy passed in. Blocks that other threads have
+ * locked are skipped by the searches, so a search that skipped one isnt
+ * checked.
+ */
+static void check_fit(struct linked_list* list, size_t chunk_size, 
+    enum stratergy fit, struct block* block)
+{
+    struct block* expected = NULL;
+
+    if(search_contended)
+    {
+        return;
+    }
+
+    for(struct block* current_block = list->head; current_block != NULL; 
+        current_block = current_block->next)
+    {
+        if(current_block->size < chunk_size || !block_usable(current_block))
+        {
+            continue;
+        }
+        if(expected == NULL || 
+            (fit == BEST && current_block->size < expected->size) || 
+            (fit == WORST && current_block->size > expected->size))
+        {
+            expected = current_block;
+        }
+        if(fit == FIRST)
+        {
+            break;
+        }
+    }
+
+    if(block != expected)
+    {
+        printf("Free index found block %p rather than %p for %ld bytes\n",
+            (void*) block, (void*) expected, chunk_size);
+        abort();
+    }
+}
+#endif
+
+/*
+ * Search a single freed list for the first block large enough for the size
+ * passed in, returning it locked or NULL if none was found.
+ */
+static struct block* first_fit(struct linked_list* list, size_t chunk_size)
+{
+    struct free_index* index = &freed_indexes[list - freed_lists];
+    struct block* current_block = NULL; // Our temporary block pointer
+    
+    /* Here we lock down the list for reading and attempt to find a
+     * valid block */
+    r_lock(&list->rw_lock);
+
+    size_t i = index_first(index, 0, chunk_size);
+
+    #ifdef DEBUG
+    check_fit(list, chunk_size, FIRST, i < index->count ? 
+        index->blocks[i] : NULL);
+    #endif
+
+    /* We've found a valid block! Now we attempt to lock the block's mutex. If
+     * another thread has already locked this block then we simply go back to
+     * searching */
+    while(i < index->count && 
+        pthread_mutex_trylock(&index->blocks[i]->lock) != 0)
+    {
+        search_contended = 1;
+        i = index_first(index, i + 1, chunk_size);
+    }
+    search_steps += i;
+
+    if(i < index->count)
+    {
+        current_block = index->blocks[i];
+    }
+
+    r_unlock(&list->rw_lock);
+
+    return current_block;
+}
+
+/*
+ * Search a single freed list for the block closest in size to the size passed
+ * in, returning it locked or NULL if none was found.
+ *
+ * The smallest key that is large enough is found first, and only the blocks
+ * with that key are looked at. If none of them can be used, the next
+ * smallest key is tried.
+ */
+static struct block* best_fit(struct linked_list* list, size_t chunk_size)
+{
+    struct free_index* index = &freed_indexes[list - freed_lists];
+    struct block* best_block = NULL; // The currently best suited block
+    uint32_t low = free_index_key(chunk_size);
+    uint32_t key;
+
+    /* Here we lock down the list for reading and attempt to find the best
+     * fitting block */
+    r_lock(&list->rw_lock);
+
+    while(best_block == NULL && low <= FREE_INDEX_KEY_MAX &&
+        (key = free_index_min(index, low, FREE_INDEX_KEY_MAX)) != 0)
+    {
+        best_block = index_fit(index, key, chunk_size, BEST);
+        low = key + 1;
+    }
+
+    #ifdef DEBUG
+    check_fit(list, chunk_size, BEST, best_block);
+    #endif
+
+    r_unlock(&list->rw_lock);
+
+    return best_block;
+}
+
+/*
+ * Search a single freed list for the largest block that can hold the size
+ * passed in, returning it locked or NULL if none was found, in the same way
+ * as best_fit but from the largest key down.
+ */
+static struct block* worst_fit(struct linked_list* list, size_t chunk_size)
+{
+    struct free_index* index = &freed_indexes[list - freed_lists];
+    struct block* worst_block = NULL; // The currently worst suited block
+    uint32_t low = free_index_key(chunk_size);
+    uint32_t high = FREE_INDEX_KEY_MAX;
+    uint32_t key;
+
+    /* Here we lock down the list for reading and attempt to find the worst
+     * fitting block */
+    r_lock(&list->rw_lock);
+
+    while(worst_block == NULL && low <= high &&
+        (key = free_index_max(index, low, high)) != 0)
+    {
+        worst_block = index_fit(index, key, chunk_size, WORST);
+        high = key - 1;
+    }
+
+    #ifdef DEBUG
+    check_fit(list, chunk_size, WORST, worst_block);
+    #endif
+
+    r_unlock(&list->rw_lock);
+
+    return worst_block;
+}
+
+/*
+ * Searches the freed list for the first block whose data starts on a cache
+ * line and is large enough for the chunk_size, in the same way as first_fit.
+ */
+static struct block* line_fit(struct linked_list* list, size_t chunk_size)
+{
+    struct free_index* index = &freed_indexes[list - freed_lists];
+    struct block* current_block = NULL;
+
+    r_lock(&list->rw_lock);
+
+    size_t i = index_first(index, 0, chunk_size);
+    while(i < index->count && 
+        (((uintptr_t) index->blocks[i]->data & (CACHE_LINE - 1)) != 0 ||
+        pthread_mutex_trylock(&index->blocks[i]->lock) != 0))
+    {
+        i = index_first(index, i + 1, chunk_size);
+    }
+    search_steps += i;
+
+    if(i < index->count)
+    {
+        current_block = index->blocks[i];
+    }
+
+    r_unlock(&list->rw_lock);
+
+    return current_block;
+}
+
+/*
+ * Attempt to find a suitable block in the freed lists for the size passed
+ * into the function using the first algorithm, if no suitable block is 
+ * found, we create a new block.
+ *
+ * Only the list of the request's own range and the lists of larger ranges are
+ * searched, as every block in a smaller range is too small.
+ */
+static struct block* alloc_first(int range, size_t chunk_size)
+{
+    struct block* block = NULL;
+
+    for(int i = range; i <= policy_count && block == NULL; ++i)
+    {
+        block = first_fit(&freed_lists[i], chunk_size);
+    }
+
+    return aquire_block(block, chunk_size, chunk_size);
+}
+
+/*
+ * Attempt to find a suitable block in the freed lists for the size passed
+ * into the function using the best algorithm, if no suitable block is 
+ * found, we create a new block.
+ *
+ * As every block in a larger range is larger than every block in a smaller
+ * one, the first range with a valid block holds the best block.
+ */
+static struct block* alloc_best(int range, size_t chunk_size)
+{
+    struct block* block = NULL;
+
+    for(int i = range; i <= policy_count && block == NULL; ++i)
+    {
+        block = best_fit(&freed_lists[i], chunk_size);
+    }
+
+    return aquire_block(block, chunk_size, chunk_size);
+}
+
+/*
+ * Attempt to find a suitable block in the freed lists for the size passed
+ * into the function using the worst algorithm, if no suitable block is 
+ * found, we create a new block.
+ *
+ * The ranges are searched from largest to smallest, so the first range with a
+ * valid block holds the worst block.
+ */
+static struct block* alloc_worst(int range, size_t chunk_size)
+{
+    struct block* block = NULL;
+
+    for(int i = policy_count; i >= range && block == NULL; --i)
+    {
+        block = worst_fit(&freed_lists[i], chunk_size);
+    }
+
+    return aquire_block(block, chunk_size, chunk_size);
+}
+
+/*
+ * Work out the external fragmentation of the freed lists, being how much of
+ * the free memory is outside of the largest free block (0 when there is no
+ * free memory).
+ */
+static double freed_fragmentation()
+{
+    size_t total = 0, largest = 0;
+
+    for(int i = 0; i <= policy_count; ++i)
+    {
+        r_lock(&freed_lists[i].rw_lock);
+
+        for(struct block* block = freed_lists[i].head; block != NULL; 
+            block = block->next)
+        {
+            total += block->size;
+            if(block->size > largest)
+            {
+                largest = block->size;
+            }
+        }
+
+        r_unlock(&freed_lists[i].rw_lock);
+    }
+
+    return total == 0 ? 0.0 : 1.0 - (double) largest / total;
+}
+
+/*
+ * Pick the fit policy the ADAPTIVE stratergy should be using for the metrics
+ * of the last window. Long searches favour first fit as it stops at the first
+ * valid block, a fragmented freed list favours best fit as it keeps the large
+ * blocks whole and splitting most allocations favours worst fit as it leaves
+ * the largest (and so most reusable) left overs.
+ */
+static enum stratergy adaptive_choose(enum stratergy active, double search, 
+    double split, double frag)
+{
+    if(search > (active == FIRST ? ADAPTIVE_SEARCH_LOW : ADAPTIVE_SEARCH_HIGH))
+    {
+        return FIRST;
+    }
+    if(frag > (active == BEST ? ADAPTIVE_FRAG_LOW : ADAPTIVE_FRAG_HIGH))
+    {
+        return BEST;
+    }
+    if(split > (active == WORST ? ADAPTIVE_SPLIT_LOW : ADAPTIVE_SPLIT_HIGH))
+    {
+        return WORST;
+    }
+    return active;
+}
+
+/*
+ * Reset this thread's search state before searching for 'chunk_size' bytes.
+ */
+static void search_start(size_t chunk_size)
+{
+    search_steps = 0;
+    search_split = 0;
+    search_contended = 0;
+    search_owner = __atomic_load_n(&thread_pages, __ATOMIC_RELAXED) ? 
+        get_thread_stats()->id : 0;
+    search_owned_only = chunk_size <= THREAD_PAGE_MAX;
+}
+
+/*
+ * Count an allocation of the block, along with the search that found it.
+ */
+static void count_alloc(struct block* block)
+{
+    struct thread_stats* stats = get_thread_stats();
+    count(&stats->allocs, 1);
+    count(&stats->alloc_bytes, block->size);
+    count(&stats->class_allocs[alloc_index(block->size)], 1);
+    count(&stats->splits, search_split);
+    count(&stats->searches, 1);
+    count(&stats->search_steps, search_steps);
+}
+
+/*
+ * Add this thread's last search to the ADAPTIVE metrics. The thread that fills
+ * up a window decides if the fit policy should be switched, which only
+ * happens once ADAPTIVE_CONFIRM windows in a row have agreed on it.
+ */
+static void adaptive_sample()
+{
+    struct alloc_event event;
+    int switched = 0;
+
+    __atomic_fetch_add(&adaptive_steps, search_steps, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&adaptive_splits, search_split, __ATOMIC_RELAXED);
+    if(__atomic_add_fetch(&adaptive_allocs, 1, __ATOMIC_RELAXED) < 
+        ADAPTIVE_WINDOW)
+    {
+        return;
+    }
+
+    /* If another thread is already deciding this window, let it */
+    if(pthread_mutex_trylock(&adaptive_lock) != 0)
+    {
+        return;
+    }
+
+    unsigned long allocs = __atomic_exchange_n(&adaptive_allocs, 0, 
+        __ATOMIC_RELAXED);
+    if(allocs >= ADAPTIVE_WINDOW)
+    {
+        enum stratergy active = adaptive_stratergy;
+
+        event.type = EVENT_STRATERGY_SWITCH;
+        event.from = active;
+        event.avg_search_length = (double) __atomic_exchange_n(
+            &adaptive_steps, 0, __ATOMIC_RELAXED) / allocs;
+        event.split_rate = (double) __atomic_exchange_n(
+            &adaptive_splits, 0, __ATOMIC_RELAXED) / allocs;
+        event.fragmentation = freed_fragmentation();
+        event.to = adaptive_choose(active, event.avg_search_length, 
+            event.split_rate, event.fragmentation);
+
+        if(event.to == active)
+        {
+            adaptive_streak = 0;
+        }
+        else if(event.to == adaptive_candidate && 
+            ++adaptive_streak >= ADAPTIVE_CONFIRM)
+        {
+            __atomic_store_n(&adaptive_stratergy, event.to, __ATOMIC_RELAXED);
+            adaptive_streak = 0;
+            switched = 1;
+        }
+        else if(event.to != adaptive_candidate)
+        {
+            adaptive_candidate = event.to;
+            adaptive_streak = 1;
+        }
+    }
+    else
+    {
+        /* Another thread already took this window, so put the count back */
+        __atomic_fetch_add(&adaptive_allocs, allocs, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_unlock(&adaptive_lock);
+
+    if(switched)
+    {
+        #ifdef DEBUG
+        printf("-->Adaptive stratergy switched: %d -> %d\n", event.from, 
+            event.to);
+        #endif
+
+        alloc_event_callback callback = event_callback;
+        if(callback != NULL)
+        {
+            callback(&event);
+        }
+    }
+}
+
+/* 
+ * Attempt to allocate the given size using the stratergy set for its range,
+ * returning the allocated block
+ */
+static struct block* alloc_block(size_t chunk_size)
+{
+    struct block* block = NULL;
+
+    /* Look up the range this request falls in, which decides both the
+     * stratergy and the freed lists we search */
+    int range = policy_index(chunk_size);
+    enum stratergy stratergy = 
+        range < policy_count ? policy[range].stratergy : current_stratergy;
+    int adaptive = stratergy == ADAPTIVE;
+
+    if(adaptive)
+    {
+        stratergy = __atomic_load_n(&adaptive_stratergy, __ATOMIC_RELAXED);
+    }
+    search_start(chunk_size);
+
+    /* Pass off the allocation to whichever algorithm is selected */
+    switch(stratergy)
+    {
+        case FIRST:
+            #ifdef DEBUG
+            printf("-->Allocating using first fit...\n");
+            #endif
+            block = alloc_first(range, chunk_size);
+            break;
+        case BEST:
+            #ifdef DEBUG
+            printf("-->Allocating using best fit...\n");
+            #endif
+            block = alloc_best(range, chunk_size);
+            break;
+        case WORST:
+            #ifdef DEBUG
+            printf("-->Allocating using worst fit...\n");
+            #endif
+            block = alloc_worst(range, chunk_size);
+            break;
+        default:
+            #ifdef DEBUG
+            printf("-->Reached default case of alloc...\n");
+            #endif
+            abort();
+    }
+
+    if(adaptive)
+    {
+        adaptive_sample();
+    }
+
+    count_alloc(block);
+
+    return block;
+}
+
+/*
+ * Allocate a block that sits alone on its cache lines, rounding the size up
+ * to whole lines. A free block starting on a line is used if there is one,
+ * otherwise a new one is created on a line. It is listed under 'chunk_size',
+ * so dealloc_sized() finds it by the size it was asked for.
+ */
+static struct block* alloc_isolated(size_t chunk_size)
+{
+    struct block* block = NULL;
+    size_t size = (chunk_size + CACHE_LINE - 1) & ~((size_t) CACHE_LINE - 1);
+
+    search_start(size);
+
+    for(int i = policy_index(size); i <= policy_count && block == NULL; ++i)
+    {
+        block = line_fit(&freed_lists[i], size);
+    }
+
+    block = block != NULL ? aquire_block(block, size, chunk_size) : 
+        aquire_new_block(size, CACHE_LINE, chunk_size);
+
+    count_alloc(block);
+
+    return block;
+}
+
+/*
+ * Returns the index (plus 1) of the call site in the lifetime table, adding
+ * it if it isnt there, or 0 if the table has no room for it.
+ */
+static unsigned int lifetime_lookup(void* site)
+{
+    uintptr_t hash = ((uintptr_t) site >> 2) * 0x9E3779B97F4A7C15ULL;
+    unsigned int index = hash >> (64 - LIFETIME_SITE_BITS);
+
+    for(int i = 0; i < LIFETIME_PROBES; ++i)
+    {
+        struct lifetime_site* entry = 
+            &lifetime_sites[(index + i) & (LIFETIME_SITES - 1)];
+        void* current = __atomic_load_n(&entry->site, __ATOMIC_RELAXED);
+
+        if(current == NULL && __atomic_compare_exchange_n(&entry->site, 
+            &current, site, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+            current = site;
+        }
+        if(current == site)
+        {
+            return ((index + i) & (LIFETIME_SITES - 1)) + 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Returns 1 if the chunks of the call site are predicted to be short lived.
+ */
+static int lifetime_short(unsigned int site)
+{
+    struct lifetime_site* entry = &lifetime_sites[site - 1];
+    return __atomic_load_n(&entry->samples, __ATOMIC_RELAXED) >= 
+        LIFETIME_MIN_SAMPLES && 
+        __atomic_load_n(&entry->average, __ATOMIC_RELAXED) <= LIFETIME_SHORT;
+}
+
+/*
+ * Learn the lifetime of the block being freed into its call site's average.
+ * Racing updates may lose a sample, which only slows the learning a little.
+ */
+static void lifetime_learn(struct block* block)
+{
+    struct lifetime_site* entry = &lifetime_sites[block->site - 1];
+    unsigned long lifetime = 
+        __atomic_load_n(&lifetime_clock, __ATOMIC_RELAXED) - block->born;
+    unsigned long samples = __atomic_load_n(&entry->samples, __ATOMIC_RELAXED);
+    unsigned long average = __atomic_load_n(&entry->average, __ATOMIC_RELAXED);
+
+    average = samples == 0 ? lifetime : 
+        average - (average >> LIFETIME_SHIFT) + (lifetime >> LIFETIME_SHIFT);
+
+    __atomic_store_n(&entry->average, average, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->samples, samples + 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Map a new short lived region aligned to its size, so the region of a chunk
+ * can be found from its address. Returns NULL if it couldnt be mapped.
+ *
+ * Must be called with the short_lock held.
+ */
+static struct short_region* short_region_map()
+{
+    char* map = mmap(NULL, 2 * SHORT_REGION_SIZE, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(map == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    /* Trim the over mapped memory either side of the aligned region */
+    char* aligned = (char*) (((uintptr_t) map + SHORT_REGION_SIZE - 1) & 
+        ~((uintptr_t) SHORT_REGION_SIZE - 1));
+    if(aligned > map)
+    {
+        munmap(map, aligned - map);
+    }
+    munmap(aligned + SHORT_REGION_SIZE, 
+        (map + 2 * SHORT_REGION_SIZE) - (aligned + SHORT_REGION_SIZE));
+
+    pthread_mutex_lock(&sbrk_lock);
+
+    __atomic_store_n(&os_bytes, os_bytes + SHORT_REGION_SIZE, 
+        __ATOMIC_RELAXED);
+    __atomic_store_n(&os_calls, os_calls + 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&sbrk_lock);
+
+    __atomic_store_n(&short_regions, short_regions + 1, __ATOMIC_RELAXED);
+
+    #ifdef DEBUG
+    printf("-->Mapped short lived region %p\n", (void*) aligned);
+    #endif
+
+    return (struct short_region*) aligned;
+}
+
+/*
+ * Recycle a short lived region that has emptied out, keeping it for reuse or
+ * unmapping it if enough are kept already.
+ *
+ * Must be called with the short_lock held.
+ */
+static void short_region_recycle(struct short_region* region)
+{
+    if(short_empty_count < SHORT_REGION_KEEP)
+    {
+        region->next = short_empty;
+        short_empty = region;
+        ++short_empty_count;
+
+        __atomic_store_n(&region_recycles, region_recycles + 1, 
+            __ATOMIC_RELAXED);
+        return;
+    }
+
+    munmap(region, SHORT_REGION_SIZE);
+
+    pthread_mutex_lock(&sbrk_lock);
+
+    __atomic_store_n(&os_bytes, os_bytes - SHORT_REGION_SIZE, 
+        __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&sbrk_lock);
+
+    __atomic_store_n(&short_regions, short_regions - 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&region_unmaps, region_unmaps + 1, __ATOMIC_RELAXED);
+
+    #ifdef DEBUG
+    printf("-->Unmapped short lived region %p\n", (void*) region);
+    #endif
+}
+
+/*
+ * Carve a chunk predicted to be short lived from the current short lived
+ * region, moving on to an empty (or new) region when it is full, and add its
+ * block to the alloc list. Returns NULL if no region could be mapped.
+ */
+static struct block* short_alloc(size_t chunk_size)
+{
+    size_t header = (sizeof(struct short_region) + TOP_ALIGN - 1) & 
+        ~((size_t) TOP_ALIGN - 1);
+    size_t size = (chunk_size + TOP_ALIGN - 1) & ~((size_t) TOP_ALIGN - 1);
+    char* data = NULL;
+
+    pthread_mutex_lock(&short_lock);
+
+    struct short_region* region = short_current;
+    if(region == NULL || 
+        size > (size_t) ((char*) region + SHORT_REGION_SIZE - region->cur))
+    {
+        /* A full region is recycled once its last chunk is freed, which may
+         * have happened already */
+        if(region != NULL && region->live == 0)
+        {
+            short_region_recycle(region);
+        }
+
+        region = short_empty;
+        if(region != NULL)
+        {
+            short_empty = region->next;
+            --short_empty_count;
+        }
+        else
+        {
+            region = short_region_map();
+        }
+        if(region != NULL)
+        {
+            region->cur = (char*) region + header;
+            region->live = 0;
+        }
+        short_current = region;
+    }
+
+    if(region != NULL)
+    {
+        data = region->cur;
+        region->cur += size;
+        ++region->live;
+    }
+
+    pthread_mutex_unlock(&short_lock);
+
+    if(data == NULL)
+    {
+        return NULL;
+    }
+
+    struct block* block = new_block();
+    block->data = data;
+    block->size = chunk_size;
+    block->flags = BLOCK_SHORT;
+
+    struct thread_stats* stats = get_thread_stats();
+    count(&stats->created_blocks, 1);
+    count(&stats->created_bytes, chunk_size);
+    count(&stats->short_allocs, 1);
+
+    int index = alloc_index(chunk_size);
+    struct linked_list* list = &alloc_lists[index];
+
+    w_lock(&list->rw_lock);
+
+    block->asked = chunk_size;
+    alloc_append(index, block);
+
+    w_unlock(&list->rw_lock);
+
+    return block;
+}
+
+/*
+ * Give a freed short lived chunk back to its region, recycling the region if
+ * it was the last live chunk of a region that is no longer current. The
+ * block's metadata is kept for reuse.
+ */
+static void short_release(struct block* block)
+{
+    struct short_region* region = (struct short_region*) 
+        ((uintptr_t) block->data & ~((uintptr_t) SHORT_REGION_SIZE - 1));
+
+    struct thread_stats* stats = get_thread_stats();
+    count(&stats->short_blocks, 1);
+    count(&stats->short_bytes, block->size);
+
+    pthread_mutex_lock(&spare_lock);
+
+    block->next = spare_blocks;
+    spare_blocks = block;
+
+    pthread_mutex_unlock(&spare_lock);
+
+    /* The count is dropped under the lock, so a thread moving on from a full
+     * region cant recycle it between this thread emptying it and checking */
+    pthread_mutex_lock(&short_lock);
+
+    if(--region->live == 0 && region != short_current)
+    {
+        short_region_recycle(region);
+    }
+
+    pthread_mutex_unlock(&short_lock);
+}
+
+/*
+ * Hand every whole page of the block's data back to the OS with
+ * MADV_DONTNEED (which refills it with zeros on the next touch) and memset the
+ * partial pages at either end, leaving the whole block zeroed. Returns the
+ * bytes handed back, or 0 if there were no whole pages or madvise failed, in
+ * which case nothing is changed.
+ */
+static size_t remap_block(struct block* block)
+{
+    char* start = (char*) block->data;
+    char* end = start + block->size;
+    uintptr_t page_size = (uintptr_t) sysconf(_SC_PAGESIZE);
+    char* page_start = 
+        (char*) (((uintptr_t) start + page_size - 1) & ~(page_size - 1));
+    char* page_end = (char*) ((uintptr_t) end & ~(page_size - 1));
+
+    if(page_end <= page_start || 
+        madvise(page_start, page_end - page_start, MADV_DONTNEED) != 0)
+    {
+        return 0;
+    }
+
+    #ifdef DEBUG
+    printf("-->Remapped %ld bytes\n", (long) (page_end - page_start));
+    #endif
+
+    memset(start, 0, page_start - start);
+    memset(page_end, 0, end - page_end);
+    return page_end - page_start;
+}
+
+/*
+ * Zero the data of the passed in block. Small chunks are simply memset, while
+ * large chunks are remapped so most of their pages dont have to be written.
+ */
+static void zero_block(struct block* block)
+{
+    if(block->size >= ZERO_REMAP_THRESHOLD && remap_block(block) > 0)
+    {
+        return;
+    }
+
+    memset(block->data, 0, block->size);
+}
+
+/*
+ * Map the quota and peak of every tag. Only the pages of the tags used are
+ * ever touched.
+ */
+static void map_tag_states()
+{
+    struct tag_state* states = mmap(NULL, 65536 * sizeof(struct tag_state), 
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(states == MAP_FAILED)
+    {
+        perror("'mmap()' failed unexpectedly");
+        abort();
+    }
+    __atomic_store_n(&tag_states, states, __ATOMIC_RELEASE);
+}
+
+/*
+ * Returns this thread's counters of the tag, mapping the page holding them
+ * on the first use of any of its tags.
+ */
+static struct tag_counters* get_tag_counters(uint16_t tag)
+{
+    struct thread_stats* stats = get_thread_stats();
+    struct tag_counters* page = stats->tag_pages[tag / TAG_PAGE_TAGS];
+
+    if(page == NULL)
+    {
+        page = mmap(NULL, TAG_PAGE_TAGS * sizeof(struct tag_counters), 
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(page == MAP_FAILED)
+        {
+            perror("'mmap()' failed unexpectedly");
+            abort();
+        }
+        __atomic_store_n(&stats->tag_pages[tag / TAG_PAGE_TAGS], page, 
+            __ATOMIC_RELEASE);
+    }
+
+    return &page[tag % TAG_PAGE_TAGS];
+}
+
+/*
+ * Sum every thread's counters of the tag into the passed in struct, leaving
+ * its peak and quota alone.
+ */
+static void sum_tag_counters(uint16_t tag, struct tag_stats* stats)
+{
+    unsigned long alloc_bytes = 0, dealloc_bytes = 0;
+
+    stats->allocs = 0;
+    stats->deallocs = 0;
+
+    for(struct thread_stats* thread = 
+        __atomic_load_n(&thread_stats_list, __ATOMIC_ACQUIRE); 
+        thread != NULL; thread = thread->next)
+    {
+        struct tag_counters* page = __atomic_load_n(
+            &thread->tag_pages[tag / TAG_PAGE_TAGS], __ATOMIC_ACQUIRE);
+        if(page != NULL)
+        {
+            struct tag_counters* counters = &page[tag % TAG_PAGE_TAGS];
+            stats->allocs += read_count(&counters->allocs);
+            stats->deallocs += read_count(&counters->deallocs);
+            alloc_bytes += read_count(&counters->alloc_bytes);
+            dealloc_bytes += read_count(&counters->dealloc_bytes);
+        }
+    }
+
+    stats->bytes_live = count_difference(alloc_bytes, dealloc_bytes);
+}
+
+/*
+ * Raise the tag's peak to its live bytes and check them against its quota,
+ * reporting it to the stats callback if it has just gone over.
+ */
+static void tag_check(uint16_t tag)
+{
+    struct tag_state* state = &tag_states[tag];
+    struct tag_stats stats;
+
+    sum_tag_counters(tag, &stats);
+
+    size_t peak = __atomic_load_n(&state->peak, __ATOMIC_RELAXED);
+    while(stats.bytes_live > peak && !__atomic_compare_exchange_n(
+        &state->peak, &peak, stats.bytes_live, 0, __ATOMIC_RELAXED, 
+        __ATOMIC_RELAXED));
+
+    size_t quota = __atomic_load_n(&state->quota, __ATOMIC_RELAXED);
+    int over = quota != 0 && stats.bytes_live > quota;
+    if(__atomic_exchange_n(&state->over, over, __ATOMIC_RELAXED) || !over)
+    {
+        return;
+    }
+
+    #ifdef DEBUG
+    printf("-->Tag %u over its quota (%ld of %ld bytes)\n", tag, 
+        stats.bytes_live, quota);
+    #endif
+
+    alloc_event_callback callback = event_callback;
+    if(callback != NULL)
+    {
+        struct alloc_event event;
+        memset(&event, 0, sizeof(event));
+        event.type = EVENT_TAG_QUOTA;
+        event.tag = tag;
+        event.usage = stats.bytes_live;
+        event.limit = quota;
+        callback(&event);
+    }
+}
+
+/*
+ * Count the block's allocation against its tag, checking the tag every
+ * TAG_CHECK_BYTES this thread allocates with it.
+ */
+static void tag_count_alloc(struct block* block)
+{
+    struct tag_counters* counters = get_tag_counters(block->tag);
+    unsigned long before = counters->alloc_bytes;
+
+    count(&counters->allocs, 1);
+    count(&counters->alloc_bytes, block->size);
+
+    if(before / TAG_CHECK_BYTES != counters->alloc_bytes / TAG_CHECK_BYTES)
+    {
+        tag_check(block->tag);
+    }
+}
+
+/*
+ * Returns the size of block a chunk of the given size is allocated. A small
+ * chunk fills its size class, and every other is rounded up to
+ * ALLOC_CACHE_ALIGN so chunks carved from the top one after another meet
+ * exactly, and can be merged.
+ */
+static inline size_t round_size(size_t chunk_size)
+{
+    if(chunk_size - 1 < ALLOC_CACHE_MAX)
+    {
+        return size_class_sizes[size_class_index[(chunk_size + 
+            ALLOC_CACHE_ALIGN - 1) / ALLOC_CACHE_ALIGN]];
+    }
+    return (chunk_size + ALLOC_CACHE_ALIGN - 1) & 
+        ~(size_t) (ALLOC_CACHE_ALIGN - 1);
+}
+
+/*
+ * Count the chunks alloc() has taken from this thread's cache since it last
+ * looked, charging their bytes to the heap profiler and marking them no
+ * longer cached.
+ */
+static void cache_count()
+{
+    struct alloc_cache* cache = &alloc_thread_cache;
+
+    if(cache->budget != cache->granted)
+    {
+        struct thread_stats* stats = get_thread_stats();
+        for(int i = 0; i < ALLOC_CACHE_CLASSES; ++i)
+        {
+            struct alloc_cache_bin* bin = &cache->bins[i];
+            if(bin->allocs != 0)
+            {
+                size_t size = size_class_sizes[i];
+
+                /* The chunks taken are those just past the cached ones. One
+                 * may have since been freed, and even cached, by another
+                 * thread, so it is only unmarked if this thread still holds
+                 * the mark */
+                for(unsigned long j = 0; j < bin->allocs; ++j)
+                {
+                    struct block* block = bin->blocks[bin->count + j];
+                    unsigned int id = stats->id;
+                    __atomic_compare_exchange_n(&block->cached, &id, 0, 0, 
+                        __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+                }
+
+                count(&stats->allocs, bin->allocs);
+                count(&stats->alloc_bytes, bin->allocs * size);
+                count(&stats->class_allocs[alloc_index(size)], bin->allocs);
+                count(&stats->cache_allocs, bin->allocs);
+                bin->allocs = 0;
+            }
+        }
+        profile_countdown -= cache->granted - cache->budget;
+        cache->granted = cache->budget;
+    }
+}
+
+/*
+ * Hand every block in this thread's cache back to the freed lists. They were
+ * counted as deallocated as they were cached. The chunks taken from it since
+ * it was last looked at are counted first, as they sit in the bins just past
+ * the cached ones.
+ */
+static void cache_flush()
+{
+    cache_count();
+
+    for(int i = 0; i < ALLOC_CACHE_CLASSES; ++i)
+    {
+        struct alloc_cache_bin* bin = &alloc_thread_cache.bins[i];
+        while(bin->count > 0)
+        {
+            struct block* block = bin->blocks[--bin->count];
+            int index = alloc_index(block->asked);
+            struct linked_list* list = &alloc_lists[index];
+
+            w_lock(&list->rw_lock);
+
+            alloc_delete(index, block);
+            __atomic_store_n(&block->cached, 0, __ATOMIC_RELAXED);
+
+            w_unlock(&list->rw_lock);
+
+            freed_list_insert(block);
+        }
+    }
+}
+
+/*
+ * Count the chunks alloc() has taken from this thread's cache since it last
+ * looked, and work out the bytes it may take before it next looks. The cache
+ * is emptied if the soft limit or compaction has asked for it.
+ */
+static void cache_sync()
+{
+    struct alloc_cache* cache = &alloc_thread_cache;
+
+    cache_count();
+
+    unsigned long generation = 
+        __atomic_load_n(&alloc_cache_generation, __ATOMIC_ACQUIRE);
+    if(cache->generation != generation)
+    {
+        cache->generation = generation;
+        cache_flush();
+    }
+
+    /* The cache is only used while every allocation neednt be seen */
+    cache->budget = 0;
+    if(!trace_enabled && profile_countdown > 0 &&
+        !__atomic_load_n(&lifetime_prediction, __ATOMIC_RELAXED))
+    {
+        cache->budget = profile_countdown < CACHE_BUDGET_MAX ? 
+            (size_t) profile_countdown : CACHE_BUDGET_MAX;
+    }
+    cache->granted = cache->budget;
+}
+
+/*
+ * Keep a deallocated block in this thread's cache if it is a whole size class
+ * and nothing needs to see it freed, returning 1 if it was cached. The block
+ * stays in its alloc list, so alloc() can hand it straight back out, marked
+ * as cached by this thread so it is counted as free. The mark is kept out of
+ * the flags, as the thread that took the chunk from its cache may clear it
+ * at any time.
+ */
+static int cache_push(struct block* block)
+{
+    size_t size = block->size;
+
+    /* Another thread may have taken the chunk from its cache without having
+     * looked since */
+    __atomic_store_n(&block->cached, 0, __ATOMIC_RELAXED);
+
+    if(size > ALLOC_CACHE_MAX || size % ALLOC_CACHE_ALIGN != 0 || 
+        (block->flags & (BLOCK_SAMPLED | BLOCK_SHORT)) || block->tag != 0 || 
+        block->site != 0 || trace_enabled)
+    {
+        return 0;
+    }
+
+    /* A block left bigger than its chunk's class may not fill one, and one
+     * bigger than it was asked for is listed under a smaller class */
+    unsigned int class = size_class_index[size / ALLOC_CACHE_ALIGN];
+    if(size_class_sizes[class] != size || block->asked != size)
+    {
+        return 0;
+    }
+
+    struct alloc_cache_bin* bin = &alloc_thread_cache.bins[class];
+    struct thread_stats* stats = get_thread_stats();
+
+    /* A block in another thread's pages would share its lines */
+    if(bin->count == ALLOC_CACHE_DEPTH || 
+        (block->owner != 0 && block->owner != stats->id))
+    {
+        return 0;
+    }
+
+    #ifdef DEBUG
+    for(unsigned int i = 0; i < bin->count; ++i)
+    {
+        if(bin->blocks[i] == block)
+        {
+            printf("Attempted to deallocate a chunk twice: %p\n", block->data);
+            abort();
+        }
+    }
+    #endif
+
+    bin->chunks[bin->count] = block->data;
+    bin->blocks[bin->count] = block;
+    ++bin->count;
+    __atomic_store_n(&block->cached, stats->id, __ATOMIC_RELAXED);
+
+    count(&stats->deallocs, 1);
+    count(&stats->dealloc_bytes, size);
+    count(&stats->class_deallocs[alloc_index(size)], 1);
+
+    return 1;
+}
+
+/*
+ * Count this thread's last allocations from its cache and empty it as the
+ * thread exits
+ */
+static void cache_exit()
+{
+    cache_sync();
+    cache_flush();
+}
+
+/*
+ * Allocate the given size for the call site, placing it as the flags ask.
+ * With lifetime prediction on, a chunk from a site whose chunks are predicted
+ * to be short lived goes into a short lived region.
+ */
+static void* alloc_site(size_t chunk_size, unsigned int flags, void* caller,
+    uint16_t tag)
+{
+    #ifdef DEBUG
+    printf("\n\n-->Allocating %ld bytes (Flags: %u)\n", chunk_size, flags);
+    #endif
+
+    /* If we attempt to allocate <= 0 bytes we just return null */
+    if((signed long long int)chunk_size <= 0)
+    {
+        return NULL;
+    }
+
+    struct block* block = NULL;
+    unsigned int site = 0;
+    unsigned long born = 0;
+    size_t size = round_size(chunk_size);
+
+    cache_sync();
+
+    if(__atomic_load_n(&lifetime_prediction, __ATOMIC_RELAXED) && 
+        !(flags & ALLOC_CACHELINE_ISOLATED))
+    {
+        site = lifetime_lookup(caller);
+        born = __atomic_add_fetch(&lifetime_clock, 1, __ATOMIC_RELAXED);
+
+        /* Thread pages keep chunks of different threads apart, which the
+         * shared regions wouldnt */
+        if(site != 0 && chunk_size <= SHORT_CHUNK_MAX && 
+            !__atomic_load_n(&thread_pages, __ATOMIC_RELAXED) && 
+            lifetime_short(site))
+        {
+            search_start(size);
+            block = short_alloc(size);
+            if(block != NULL)
+            {
+                count_alloc(block);
+            }
+        }
+    }
+
+    if(block == NULL)
+    {
+        block = (flags & ALLOC_CACHELINE_ISOLATED) ? 
+            alloc_isolated(size) : alloc_block(size);
+    }
+    block->site = site;
+    block->born = born;
+
+    /* Only tagged chunks are counted, the tag is cleared as it is freed */
+    if(tag != 0)
+    {
+        block->tag = tag;
+        tag_count_alloc(block);
+    }
+
+    /* The caller is free to write to the chunk from here on */
+    block->flags &= ~BLOCK_ZEROED;
+
+    /* Only once this thread has allocated enough bytes since its last sample
+     * does the profiler need to look at the chunk */
+    if((profile_countdown -= chunk_size) < 0 && 
+        profile_sample(block->data, chunk_size))
+    {
+        block->flags |= BLOCK_SAMPLED;
+    }
+
+    if(trace_enabled)
+    {
+        trace_event(TRACE_ALLOC, block->data, chunk_size);
+    }
+
+    return block->data;
+}
+
+/* 
+ * Attempt to allocate the given size using the set algorithm, once alloc()
+ * has found nothing in the thread's cache
+ */
+void* alloc_slow(size_t chunk_size)
+{  
+    return alloc_site(chunk_size, 0, __builtin_return_address(0), 0);
+}
+
+/*
+ * Allocate the given size, placing it as the flags ask
+ */
+void* alloc_flags(size_t chunk_size, unsigned int flags)
+{
+    return alloc_site(chunk_size, flags, __builtin_return_address(0), 0);
+}
+
+/*
+ * Allocate the given size, counting it against the tag
+ */
+void* alloc_tagged(size_t chunk_size, uint16_t tag)
+{
+    if(tag != 0)
+    {
+        pthread_once(&tag_states_once, map_tag_states);
+    }
+    return alloc_site(chunk_size, 0, __builtin_return_address(0), tag);
+}
+
+/*
+ * Attempt to allocate an array of 'n' elements of 'size' bytes with every
+ * byte set to zero, only zeroing the chunk if it has been used before
+ */
+void* zalloc(size_t n, size_t size)
+{
+    #ifdef DEBUG
+    printf("\n\n-->Allocating %ld zeroed elements of %ld bytes\n", n, size);
+    #endif
+
+    /* If the total size overflows or is <= 0 bytes we just return null */
+    if(size != 0 && n > SIZE_MAX / size)
+    {
+        return NULL;
+    }
+    if((signed long long int)(n * size) <= 0)
+    {
+        return NULL;
+    }
+
+    struct block* block = alloc_block(round_size(n * size));
+    block->site = 0;
+
+    /* Only recycled chunks need zeroing, fresh memory is already zero */
+    if(!(block->flags & BLOCK_ZEROED))
+    {
+        zero_block(block);
+    }
+    #ifdef DEBUG
+    else
+    {
+        printf("-->Chunk is known to be zero, skipped zeroing\n");
+    }
+    #endif
+
+    block->flags &= ~BLOCK_ZEROED;
+
+    if((profile_countdown -= n * size) < 0 && 
+        profile_sample(block->data, n * size))
+    {
+        block->flags |= BLOCK_SAMPLED;
+    }
+
+    if(trace_enabled)
+    {
+        trace_event(TRACE_ZALLOC, block->data, n * size);
+    }
+
+    return block->data;
+}
+
+/*
+ * Look up the block holding the pointer equal to 'chunk' in the chunk table
+ * of the passed in alloc list, returning NULL if it isnt in this list.
+ */
+static struct block* alloc_list_find(int index, void* chunk)
+{
+    struct linked_list* list = &alloc_lists[index];
+
+    r_lock(&list->rw_lock);
+
+    struct block* block = chunk_table_find(&chunk_tables[index], chunk);
+
+    r_unlock(&list->rw_lock);
+
+    return block;
+}
+
+/*
+ * Move an allocated block to the alloc list for the rounded size it is now
+ * asked for, as ralloc() resizes it in place.
+ */
+static void alloc_list_move(struct block* block, size_t asked)
+{
+    int old_index = alloc_index(block->asked);
+    int index = alloc_index(asked);
+
+    if(index != old_index)
+    {
+        w_lock(&alloc_lists[old_index].rw_lock);
+        alloc_delete(old_index, block);
+        w_unlock(&alloc_lists[old_index].rw_lock);
+
+        w_lock(&alloc_lists[index].rw_lock);
+        block->asked = asked;
+        alloc_append(index, block);
+        w_unlock(&alloc_lists[index].rw_lock);
+    }
+    else
+    {
+        block->asked = asked;
+    }
+}
+
+/*
+ * Remove the passed in block from the alloc list at 'index' and add it to the
+ * freed list for its size.
+ */
+static void release_block(int index, struct block* block)
+{
+    struct linked_list* list = &alloc_lists[index];
+
+    #ifdef DEBUG
+    r_lock(&list->rw_lock);
+    printf("-->Found the block (Block: %p, Next: %p, Prev: %p, Size: %ld, Data: %p)\n", 
+    (void*) block, (void*) block->next, (void*) block->prev, 
+    block->size, block->data);
+    r_unlock(&list->rw_lock);
+    #endif
+
+    w_lock(&list->rw_lock);
+
+    alloc_delete(index, block);
+
+    w_unlock(&list->rw_lock);
+
+    if(block->flags & BLOCK_SAMPLED)
+    {
+        block->flags &= ~BLOCK_SAMPLED;
+        profile_drop(block->data);
+    }
+
+    struct thread_stats* stats = get_thread_stats();
+    count(&stats->deallocs, 1);
+    count(&stats->dealloc_bytes, block->size);
+    count(&stats->class_deallocs[alloc_index(block->size)], 1);
+
+    if(block->site != 0)
+    {
+        lifetime_learn(block);
+    }
+    if(block->tag != 0)
+    {
+        struct tag_counters* counters = get_tag_counters(block->tag);
+        count(&counters->deallocs, 1);
+        count(&counters->dealloc_bytes, block->size);
+        block->tag = 0;
+    }
+
+    /* A short lived chunk goes back to its region rather than a freed list */
+    if(block->flags & BLOCK_SHORT)
+    {
+        short_release(block);
+    }
+    else
+    {
+        freed_list_insert(block);
+    }
+}
+
+/*
+ * Attempt to dealloc the block containing the pointer equal to 'chunk'
+ */
+void dealloc(void* chunk)
+{
+    /* If we attempt to dealloc NULL then we just return */
+    if(chunk == NULL)
+    {
+        #ifdef DEBUG
+        printf("\n\n-->Attempting to dealloc NULL, did nothing\n");
+        #endif
+
+        return;
+    }
+
+    #ifdef DEBUG
+    printf("\n\n-->Attempting to dealloc block with data %p...\n", chunk);
+    #endif
+
+    /* We dont know the size of the chunk, so every alloc list is searched
+     * until we find the block. If we found the block then we move it to the
+     * freed list. 
+     * 
+     * However if we couldnt find it, we need to abort the program */
+    for(int i = 0; i < ALLOC_LIST_BINS; ++i)
+    {
+        struct block* block = alloc_list_find(i, chunk);
+        if(block != NULL)
+        {
+            /* The dealloc is recorded before the chunk can be reused, so it
+             * always comes before the chunk's next alloc in the trace */
+            if(trace_enabled)
+            {
+                trace_event(TRACE_DEALLOC, chunk, 0);
+            }
+
+            cache_sync();
+            if(!cache_push(block))
+            {
+                release_block(i, block);
+            }
+            return;
+        }
+    }
+
+    printf("Attempted to deallocate an invalid pointer: %p\n", chunk);
+    abort();
+}
+
+/*
+ * Attempt to dealloc the block containing the pointer equal to 'chunk', only
+ * searching the alloc list that 'chunk_size' belongs to
+ */
+void dealloc_sized(void* chunk, size_t chunk_size)
+{
+    /* If we attempt to dealloc NULL then we just return */
+    if(chunk == NULL)
+    {
+        #ifdef DEBUG
+        printf("\n\n-->Attempting to dealloc NULL, did nothing\n");
+        #endif
+
+        return;
+    }
+
+    #ifdef DEBUG
+    printf("\n\n-->Attempting to dealloc block with data %p and size "
+        "%ld...\n", chunk, chunk_size);
+    #endif
+
+    /* A size of 0 can never have been allocated, so cant have a list */
+    int index = chunk_size > 0 ? alloc_index(round_size(chunk_size)) : -1;
+    struct block* block = index >= 0 ? alloc_list_find(index, chunk) : NULL;
+
+    if(block == NULL)
+    {
+        printf("Attempted to deallocate an invalid pointer or size: %p, %ld\n",
+            chunk, chunk_size);
+        abort();
+    }
+
+    #ifdef DEBUG
+    /* Make sure the caller passed in a size of the class the chunk was
+     * allocated (or last resized) with */
+    if(block->asked != round_size(chunk_size))
+    {
+        printf("Attempted to deallocate %p with size %ld, but it was "
+            "allocated with size %ld\n", chunk, chunk_size, block->asked);
+        abort();
+    }
+    #endif
+
+    if(trace_enabled)
+    {
+        trace_event(TRACE_DEALLOC, chunk, chunk_size);
+    }
+
+    cache_sync();
+    if(!cache_push(block))
+    {
+        release_block(index, block);
+    }
+}
+
+/*
+ * Resize the chunk to 'chunk_size' bytes. The chunk is kept where it is if its
+ * block is already large enough, otherwise it is moved to a new block
+ */
+void* ralloc(void* chunk, size_t chunk_size)
+{
+    struct block* block = NULL;
+
+    #ifdef DEBUG
+    printf("\n\n-->Attempting to realloc block with data %p to %ld bytes...\n",
+        chunk, chunk_size);
+    #endif
+
+    /* A NULL chunk is just an alloc, and a size of 0 is just a dealloc */
+    if(chunk == NULL)
+    {
+        return alloc(chunk_size);
+    }
+    if(chunk_size == 0)
+    {
+        dealloc(chunk);
+        return NULL;
+    }
+
+    for(int i = 0; i < ALLOC_LIST_BINS && block == NULL; ++i)
+    {
+        block = alloc_list_find(i, chunk);
+    }
+    if(block == NULL)
+    {
+        printf("Attempted to reallocate an invalid pointer: %p\n", chunk);
+        abort();
+    }
+
+    /* The block belongs to the caller, so its size cant change under us. It
+     * is listed under its new size, so dealloc_sized() finds it by that */
+    size_t size = round_size(chunk_size);
+    if(block->size >= size)
+    {
+        alloc_list_move(block, size);
+        return chunk;
+    }
+
+    void* new_chunk = block->tag != 0 ? alloc_tagged(chunk_size, block->tag) : 
+        alloc(chunk_size);
+    memcpy(new_chunk, chunk, block->size);
+    dealloc_sized(chunk, block->asked);
+
+    return new_chunk;
+}
+
+/*
+ * Map the table of handles. Its pages are only touched as handles are used.
+ */
+static void map_handles()
+{
+    struct handle_entry* table = mmap(NULL, 
+        HANDLE_MAX * sizeof(struct handle_entry), PROT_READ | PROT_WRITE, 
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(table == MAP_FAILED)
+    {
+        perror("'mmap()' failed unexpectedly");
+        abort();
+    }
+    __atomic_store_n(&handles, table, __ATOMIC_RELEASE);
+}
+
+/*
+ * Returns the entry of the handle, aborting if it was never given out
+ */
+static struct handle_entry* find_handle(handle_t handle)
+{
+    if(handle == 0 || handle > __atomic_load_n(&handle_count, __ATOMIC_ACQUIRE))
+    {
+        printf("Attempted to use an invalid handle: %u\n", handle);
+        abort();
+    }
+    return &handles[handle - 1];
+}
+
+/*
+ * Allocate a relocatable chunk and give it a handle
+ */
+handle_t halloc(size_t chunk_size)
+{
+    unsigned int index;
+
+    #ifdef DEBUG
+    printf("\n\n-->Allocating %ld bytes behind a handle\n", chunk_size);
+    #endif
+
+    if((signed long long int)chunk_size <= 0)
+    {
+        return 0;
+    }
+
+    pthread_once(&handles_once, map_handles);
+
+    /* The entry is held as moving until it has a chunk, so compaction
+     * leaves it alone */
+    pthread_mutex_lock(&handle_lock);
+
+    if(handle_free_list != 0)
+    {
+        index = handle_free_list - 1;
+        handle_free_list = handles[index].next_free;
+        __atomic_store_n(&handles[index].state, HANDLE_MOVING, 
+            __ATOMIC_RELAXED);
+    }
+    else if(handle_count < HANDLE_MAX)
+    {
+        index = handle_count;
+        handles[index].state = HANDLE_MOVING;
+        __atomic_store_n(&handle_count, handle_count + 1, __ATOMIC_RELEASE);
+    }
+    else
+    {
+        pthread_mutex_unlock(&handle_lock);
+        return 0;
+    }
+
+    pthread_mutex_unlock(&handle_lock);
+
+    struct block* block = alloc_block(round_size(chunk_size));
+    block->site = 0;
+    block->flags &= ~BLOCK_ZEROED;
+
+    if(trace_enabled)
+    {
+        trace_event(TRACE_ALLOC, block->data, chunk_size);
+    }
+
+    handles[index].chunk = block->data;
+    handles[index].block = block;
+    __atomic_store_n(&handles[index].state, 0, __ATOMIC_RELEASE);
+
+    return index + 1;
+}
+
+/*
+ * Pin the handle's chunk where it is, waiting out a move if one is under way
+ */
+void* hderef(handle_t handle)
+{
+    struct handle_entry* entry = find_handle(handle);
+    unsigned int state = __atomic_load_n(&entry->state, __ATOMIC_RELAXED);
+
+    for(;;)
+    {
+        if(state & HANDLE_FREE)
+        {
+            printf("Attempted to use a freed handle: %u\n", handle);
+            abort();
+        }
+        if(state & HANDLE_MOVING)
+        {
+            sched_yield();
+            state = __atomic_load_n(&entry->state, __ATOMIC_RELAXED);
+        }
+        else if(__atomic_compare_exchange_n(&entry->state, &state, state + 1, 
+            0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            break;
+        }
+    }
+
+    return entry->chunk;
+}
+
+/*
+ * Drop a pin on the handle's chunk
+ */
+void hunpin(handle_t handle)
+{
+    struct handle_entry* entry = find_handle(handle);
+    unsigned int state = 
+        __atomic_fetch_sub(&entry->state, 1, __ATOMIC_RELEASE);
+
+    if((state & ~(HANDLE_MOVING | HANDLE_FREE)) == 0)
+    {
+        printf("Attempted to unpin a handle that isnt pinned: %u\n", handle);
+        abort();
+    }
+}
+
+/*
+ * Deallocate the handle's chunk and give the handle up for reuse
+ */
+void hfree(handle_t handle)
+{
+    if(handle == 0)
+    {
+        return;
+    }
+
+    struct handle_entry* entry = find_handle(handle);
+    unsigned int state = 0;
+
+    /* Hold the entry as moving so compaction cant move the chunk as it is
+     * freed */
+    while(!__atomic_compare_exchange_n(&entry->state, &state, HANDLE_MOVING,
+        0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    {
+        if(state & HANDLE_FREE || (state & ~HANDLE_MOVING) != 0)
+        {
+            printf("Attempted to free a pinned or freed handle: %u\n", 
+                handle);
+            abort();
+        }
+        sched_yield();
+        state = 0;
+    }
+
+    void* chunk = entry->chunk;
+    size_t size = entry->block->asked;
+    entry->chunk = NULL;
+    entry->block = NULL;
+
+    dealloc_sized(chunk, size);
+
+    pthread_mutex_lock(&handle_lock);
+
+    entry->next_free = handle_free_list;
+    handle_free_list = handle;
+    __atomic_store_n(&entry->state, HANDLE_FREE, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&handle_lock);
+}
+
+/*
+ * Fault in every page of the 'size' bytes at 'start', with
+ * MADV_POPULATE_WRITE where the kernel has it, otherwise by writing a zero to
+ * each page, which leaves memory fresh from the OS zeroed.
+ */
+static void prefault(void* start, size_t size)
+{
+    uintptr_t page_size = (uintptr_t) sysconf(_SC_PAGESIZE);
+    char* page = (char*) ((uintptr_t) start & ~(page_size - 1));
+    char* end = (char*) start + size;
+
+    #ifdef MADV_POPULATE_WRITE
+    if(madvise(page, end - page, MADV_POPULATE_WRITE) == 0)
+    {
+        return;
+    }
+    #endif
+
+    for(char* byte = (char*) start; byte < end; 
+        byte = (char*) (((uintptr_t) byte + page_size) & ~(page_size - 1)))
+    {
+        *(volatile char*) byte = 0;
+    }
+}
+
+/*
+ * Returns the chunks of the histogram class to split the reserve into, given
+ * the scale of the histogram to the reserve and the bytes of it already
+ * split into chunks. The count is cut down if rounding would overrun it.
+ */
+static size_t reserve_count(const struct reserve_class* class, double scale, 
+    size_t split_bytes, size_t bytes)
+{
+    size_t count = (size_t) (class->count * scale);
+    if(split_bytes + count * class->size > bytes)
+    {
+        count = (bytes - split_bytes) / class->size;
+    }
+    return count;
+}
+
+/*
+ * Reserve the heap up front as a single free chunk.
+ */
+int alloc_reserve(size_t bytes, int flags)
+{
+    return alloc_reserve_split(bytes, flags, NULL, 0);
+}
+
+/*
+ * Grow the heap once for the metadata and once for the data of every chunk
+ * of the reserve, then add the chunks to the freed lists (the histogram's
+ * first, so they are found before the left over chunk) and the spare
+ * metadata to the spare list.
+ */
+int alloc_reserve_split(size_t bytes, int flags, 
+    const struct reserve_class* classes, int class_count)
+{
+    size_t weight = 0;
+
+    if(class_count < 0 || (class_count > 0 && classes == NULL))
+    {
+        return -1;
+    }
+    for(int i = 0; i < class_count; ++i)
+    {
+        if(classes[i].size == 0)
+        {
+            return -1;
+        }
+        weight += classes[i].size * classes[i].count;
+    }
+    if(class_count > 0 && weight == 0)
+    {
+        return -1;
+    }
+    if(bytes == 0)
+    {
+        bytes = weight;
+    }
+    if(bytes == 0)
+    {
+        return -1;
+    }
+
+    /* Scale the histogram to the reserve, counting the chunks it splits
+     * into */
+    double scale = weight > 0 ? (double) bytes / weight : 0.0;
+    size_t chunk_count = 0;
+    size_t split_bytes = 0;
+    for(int i = 0; i < class_count; ++i)
+    {
+        size_t count = reserve_count(&classes[i], scale, split_bytes, bytes);
+        chunk_count += count;
+        split_bytes += count * classes[i].size;
+    }
+    size_t left_over = bytes - split_bytes;
+    size_t spare_count = left_over / RESERVE_SPLIT_BYTES;
+    size_t block_count = chunk_count + (left_over > 0) + spare_count;
+
+    /* The counters are mapped now so the first allocation doesnt have to */
+    struct thread_stats* stats = get_thread_stats();
+    count(&stats->created_blocks, chunk_count + (left_over > 0));
+    count(&stats->created_bytes, bytes);
+
+    struct block* blocks = 
+        (struct block*) change_break(block_count * sizeof(struct block));
+    char* data = (char*) change_break(bytes);
+
+    if(flags & RESERVE_PREFAULT)
+    {
+        prefault(blocks, block_count * sizeof(struct block));
+        prefault(data, bytes);
+    }
+
+    #ifdef DEBUG
+    printf("-->Reserved %ld bytes at %p as %ld chunks and %ld spare blocks\n",
+        bytes, (void*) data, chunk_count + (left_over > 0), spare_count);
+    #endif
+
+    size_t block_index = 0;
+    split_bytes = 0;
+    for(int i = 0; i < class_count; ++i)
+    {
+        size_t count = reserve_count(&classes[i], scale, split_bytes, bytes);
+        split_bytes += count * classes[i].size;
+        for(size_t j = 0; j < count; ++j)
+        {
+            struct block* block = &blocks[block_index++];
+            pthread_mutex_init(&block->lock, NULL);
+            block->size = classes[i].size;
+            block->flags = BLOCK_ZEROED;
+            block->data = data;
+            data += block->size;
+            freed_list_insert(block);
+        }
+    }
+    if(left_over > 0)
+    {
+        struct block* block = &blocks[block_index++];
+        pthread_mutex_init(&block->lock, NULL);
+        block->size = left_over;
+        block->flags = BLOCK_ZEROED;
+        block->data = data;
+        freed_list_insert(block);
+    }
+
+    /* The spare metadata is initialised as it is taken, so none of it is
+     * touched until then. Whatever an earlier reserve left unused is moved to
+     * the spare list */
+    if(spare_count > 0)
+    {
+        pthread_mutex_lock(&spare_lock);
+
+        while(reserve_blocks < reserve_blocks_end)
+        {
+            reserve_blocks->next = spare_blocks;
+            spare_blocks = reserve_blocks++;
+        }
+        reserve_blocks = &blocks[block_index];
+        reserve_blocks_end = &blocks[block_count];
+
+        pthread_mutex_unlock(&spare_lock);
+    }
+
+    return 0;
+}
+
+/*
+ * Compare two maintenance snapshot entries by address for qsort.
+ */
+static int compare_start(const void* a, const void* b)
+{
+    uintptr_t x = ((const struct maint_entry*) a)->start;
+    uintptr_t y = ((const struct maint_entry*) b)->start;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Copy up to MAINT_SNAPSHOT free blocks into 'entries', holding each freed
+ * list's read lock only while it is copied, and sort them by address.
+ * Returns the number of entries.
+ */
+static size_t maint_snapshot(struct maint_entry* entries)
+{
+    size_t count = 0;
+
+    for(int i = 0; i <= POLICY_MAX_RANGES && count < MAINT_SNAPSHOT; ++i)
+    {
+        r_lock(&freed_lists[i].rw_lock);
+
+        for(struct block* block = freed_lists[i].head; 
+            block != NULL && count < MAINT_SNAPSHOT; block = block->next)
+        {
+            entries[count].block = block;
+            entries[count].start = (uintptr_t) block->data;
+            entries[count].size = block->size;
+            ++count;
+        }
+
+        r_unlock(&freed_lists[i].rw_lock);
+    }
+
+    qsort(entries, count, sizeof(struct maint_entry), compare_start);
+    return count;
+}
+
+/*
+ * Merge the free block 'right' into the free block 'left' whose data it
+ * directly follows. Both blocks are checked to still be free and next to each
+ * other under the write locks of their lists, and left alone if either is
+ * locked by a searching thread. The merged block is put back into the list
+ * for its new size and the metadata of 'right' kept for reuse. Returns 1 if
+ * they were merged.
+ */
+static int merge_blocks(struct block* left, struct block* right)
+{
+    int left_index = policy_index(left->size);
+    int right_index = policy_index(right->size);
+    int first = left_index < right_index ? left_index : right_index;
+    int second = left_index < right_index ? right_index : left_index;
+    int merged = 0;
+
+    /* The lists are always locked in order, as set_policy() does */
+    w_lock(&freed_lists[first].rw_lock);
+    if(second != first)
+    {
+        w_lock(&freed_lists[second].rw_lock);
+    }
+
+    if((left->flags & BLOCK_FREE) && (right->flags & BLOCK_FREE) && 
+        policy_index(left->size) == left_index && 
+        policy_index(right->size) == right_index &&
+        (char*) left->data + left->size == (char*) right->data &&
+        left->owner == right->owner &&
+        pthread_mutex_trylock(&left->lock) == 0)
+    {
+        if(pthread_mutex_trylock(&right->lock) == 0)
+        {
+            freed_delete(left_index, left);
+            freed_delete(right_index, right);
+            left->flags &= ~BLOCK_FREE;
+            right->flags &= ~BLOCK_FREE;
+            merged = 1;
+        }
+        else
+        {
+            pthread_mutex_unlock(&left->lock);
+        }
+    }
+
+    if(second != first)
+    {
+        w_unlock(&freed_lists[second].rw_lock);
+    }
+    w_unlock(&freed_lists[first].rw_lock);
+
+    if(!merged)
+    {
+        return 0;
+    }
+
+    #ifdef DEBUG
+    printf("-->Merged block (Block: %p, Size: %ld) into (Block: %p, Size: "
+        "%ld)\n", (void*) right, right->size, (void*) left, left->size);
+    #endif
+
+    /* Both halves have to be zero for the merged block to be. Putting it
+     * back stamps it as freed now, so it waits a whole decay time before it
+     * is purged */
+    left->size += right->size;
+    left->flags &= right->flags | ~BLOCK_ZEROED;
+    right->flags = 0;
+
+    pthread_mutex_unlock(&right->lock);
+
+    pthread_mutex_lock(&spare_lock);
+
+    right->next = spare_blocks;
+    spare_blocks = right;
+
+    pthread_mutex_unlock(&spare_lock);
+
+    freed_list_insert(left);
+    pthread_mutex_unlock(&left->lock);
+
+    return 1;
+}
+
+/*
+ * Hand the pages of a free block that has been idle for 'decay_ticks' back
+ * to the OS, marking it as zeroed. The block is checked to still be free and
+ * idle under its list's read lock, and left alone if a searching thread has
+ * it locked. Returns the bytes handed back.
+ */
+static size_t purge_block(struct block* block, unsigned long decay_ticks)
+{
+    int index = policy_index(block->size);
+    int locked = 0;
+
+    r_lock(&freed_lists[index].rw_lock);
+
+    if((block->flags & (BLOCK_FREE | BLOCK_ZEROED)) == BLOCK_FREE &&
+        policy_index(block->size) == index &&
+        maint_tick - block->freed_at >= decay_ticks &&
+        pthread_mutex_trylock(&block->lock) == 0)
+    {
+        locked = 1;
+    }
+
+    r_unlock(&freed_lists[index].rw_lock);
+
+    if(!locked)
+    {
+        return 0;
+    }
+
+    /* Holding the block's lock stops any thread allocating it, so its pages
+     * can be handed back without holding up the list */
+    size_t purged = remap_block(block);
+    if(purged > 0)
+    {
+        block->flags |= BLOCK_ZEROED;
+    }
+
+    pthread_mutex_unlock(&block->lock);
+
+    return purged;
+}
+
+/*
+ * Take a snapshot of the free blocks and merge the runs of adjacent ones, in
+ * bounded slices. Returns the entries in the snapshot, where a block merged
+ * into the one before it is left NULL.
+ */
+static size_t maint_merge(struct maint_entry* entries)
+{
+    struct thread_stats* stats = get_thread_stats();
+    int done = 0;
+
+    size_t entry_count = maint_snapshot(entries);
+
+    /* Runs of adjacent blocks are merged into the first block of the run */
+    size_t left = 0;
+    for(size_t i = 1; i < entry_count; ++i)
+    {
+        if(entries[left].start + entries[left].size == entries[i].start &&
+            merge_blocks(entries[left].block, entries[i].block))
+        {
+            entries[left].size += entries[i].size;
+            entries[i].block = NULL;
+            count(&stats->merges, 1);
+
+            if(++done % MAINT_SLICE == 0)
+            {
+                sched_yield();
+            }
+        }
+        else
+        {
+            left = i;
+        }
+    }
+
+    return entry_count;
+}
+
+/*
+ * A single tick of maintenance. Free blocks next to each other are merged,
+ * then those idle for at least 'decay_ticks' are purged, yielding every
+ * MAINT_SLICE merges or purges so no list is held up for long. Returns the
+ * bytes purged, and the entries left in the merged snapshot through
+ * 'entry_count'.
+ */
+static size_t maint_pass(struct maint_entry* entries, 
+    unsigned long decay_ticks, size_t* entry_count)
+{
+    struct thread_stats* stats = get_thread_stats();
+    size_t total_purged = 0;
+    int done = 0;
+
+    *entry_count = maint_merge(entries);
+
+    for(size_t i = 0; i < *entry_count; ++i)
+    {
+        if(entries[i].block == NULL)
+        {
+            continue;
+        }
+
+        size_t purged = purge_block(entries[i].block, decay_ticks);
+        if(purged > 0)
+        {
+            count(&stats->purges, 1);
+            count(&stats->purged_bytes, purged);
+            total_purged += purged;
+
+            if(++done % MAINT_SLICE == 0)
+            {
+                sched_yield();
+            }
+        }
+    }
+
+    return total_purged;
+}
+
+/*
+ * Hand the free blocks at the very end of the heap back to the top chunk,
+ * zeroing them as fresh memory from the top is expected to be, then move the
+ * program break back if that leaves at least TOP_MIN_GROW bytes of whole
+ * pages in the top chunk. The blocks are found from the end of the merged
+ * snapshot, so the freed lists are never searched. Returns the bytes trimmed.
+ */
+static size_t trim_top(struct maint_entry* entries, size_t entry_count)
+{
+    struct thread_stats* stats = get_thread_stats();
+    size_t trimmed = 0;
+
+    if(current_hugepage_mode != HUGEPAGE_OFF)
+    {
+        return 0;
+    }
+
+    size_t i = entry_count;
+    for(int n = 0; n < TRIM_BLOCKS; ++n)
+    {
+        struct block* block = NULL;
+
+        /* The snapshot is sorted by address, so the block ending the heap
+         * (if it is free) is its last entry still holding one */
+        while(i > 0 && entries[i - 1].block == NULL)
+        {
+            --i;
+        }
+        if(i == 0)
+        {
+            break;
+        }
+        struct maint_entry* entry = &entries[--i];
+
+        pthread_mutex_lock(&sbrk_lock);
+        char* top = top_cur;
+        pthread_mutex_unlock(&sbrk_lock);
+
+        if((char*) entry->start + entry->size != top)
+        {
+            break;
+        }
+
+        /* The block may have been allocated or merged since the snapshot */
+        int index = policy_index(entry->size);
+        w_lock(&freed_lists[index].rw_lock);
+
+        if((entry->block->flags & BLOCK_FREE) && entry->block->owner == 0 &&
+            (uintptr_t) entry->block->data == entry->start &&
+            entry->block->size == entry->size &&
+            pthread_mutex_trylock(&entry->block->lock) == 0)
+        {
+            block = entry->block;
+            freed_delete(index, block);
+            block->flags &= ~BLOCK_FREE;
+        }
+
+        w_unlock(&freed_lists[index].rw_lock);
+
+        entry->block = NULL;
+        if(block == NULL)
+        {
+            break;
+        }
+
+        if(!(block->flags & BLOCK_ZEROED))
+        {
+            zero_block(block);
+            block->flags |= BLOCK_ZEROED;
+        }
+
+        /* If a chunk has been carved from the top meanwhile, the block no
+         * longer ends the heap */
+        pthread_mutex_lock(&sbrk_lock);
+
+        int moved = top_cur == top;
+        if(moved)
+        {
+            top_cur = (char*) block->data;
+            __atomic_store_n(&heap_size, heap_size - block->size, 
+                __ATOMIC_RELAXED);
+        }
+
+        pthread_mutex_unlock(&sbrk_lock);
+
+        if(!moved)
+        {
+            freed_list_insert(block);
+            pthread_mutex_unlock(&block->lock);
+            break;
+        }
+
+        #ifdef DEBUG
+        printf("-->Trimmed block (Block: %p, Size: %ld) off the heap\n", 
+            (void*) block, block->size);
+        #endif
+
+        count(&stats->trimmed_blocks, 1);
+        count(&stats->trimmed_bytes, block->size);
+        trimmed += block->size;
+
+        block->flags = 0;
+        pthread_mutex_unlock(&block->lock);
+
+        pthread_mutex_lock(&spare_lock);
+
+        block->next = spare_blocks;
+        spare_blocks = block;
+
+        pthread_mutex_unlock(&spare_lock);
+    }
+
+    if(trimmed == 0)
+    {
+        return 0;
+    }
+
+    pthread_mutex_lock(&sbrk_lock);
+
+    uintptr_t page_size = (uintptr_t) sysconf(_SC_PAGESIZE);
+    char* keep = (char*) (((uintptr_t) top_cur + page_size - 1) & 
+        ~(page_size - 1));
+    if(keep < top_end && (size_t) (top_end - keep) >= TOP_MIN_GROW && 
+        sbrk(0) == top_end && sbrk(-(top_end - keep)) != (void*) -1)
+    {
+        #ifdef DEBUG
+        printf("-->Moved program break %ld bytes back\n", 
+            (long) (top_end - keep));
+        #endif
+
+        __atomic_store_n(&os_calls, os_calls + 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&os_bytes, os_bytes - (top_end - keep), 
+            __ATOMIC_RELAXED);
+        top_end = keep;
+    }
+
+    pthread_mutex_unlock(&sbrk_lock);
+
+    return trimmed;
+}
+
+/*
+ * Find the lowest free block in the merged snapshot that sits below the
+ * block and is large enough to move it to, returning it locked or NULL if
+ * there isnt one. The block is checked to still be free under its list's
+ * read lock, and taken out of the snapshot.
+ */
+static struct block* compact_target(struct maint_entry* entries, 
+    size_t entry_count, struct block* block)
+{
+    for(size_t i = 0; i < entry_count && 
+        entries[i].start < (uintptr_t) block->data; ++i)
+    {
+        struct block* target = entries[i].block;
+        if(target == NULL || entries[i].size < block->size)
+        {
+            continue;
+        }
+
+        int index = policy_index(entries[i].size);
+        int locked = 0;
+
+        r_lock(&freed_lists[index].rw_lock);
+
+        if((target->flags & BLOCK_FREE) && target->owner == 0 &&
+            (uintptr_t) target->data == entries[i].start &&
+            target->size == entries[i].size &&
+            pthread_mutex_trylock(&target->lock) == 0)
+        {
+            locked = 1;
+        }
+
+        r_unlock(&freed_lists[index].rw_lock);
+
+        entries[i].block = NULL;
+        if(locked)
+        {
+            return target;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * A step of compaction. Up to COMPACT_STEP_HANDLES handles from where the
+ * last step stopped are looked at, and the chunks of those that arent pinned
+ * are moved down into the lowest free block that fits them, until
+ * 'max_bytes' have been moved. The blocks left behind are merged and the end
+ * of the heap trimmed. Nothing is moved while tracing, as the trace would
+ * lose track of the chunks. Returns the bytes moved.
+ */
+static size_t compact(struct maint_entry* entries, size_t max_bytes)
+{
+    struct thread_stats* stats = get_thread_stats();
+    unsigned int count_used = __atomic_load_n(&handle_count, __ATOMIC_ACQUIRE);
+    unsigned int cursor = __atomic_load_n(&compact_cursor, __ATOMIC_RELAXED);
+    size_t moved = 0;
+    unsigned int step = 0;
+
+    size_t entry_count = maint_merge(entries);
+
+    for(; step < COMPACT_STEP_HANDLES && step < count_used && 
+        moved < max_bytes && !trace_enabled; ++step)
+    {
+        struct handle_entry* handle = &handles[(cursor + step) % count_used];
+        unsigned int state = 0;
+
+        if(!__atomic_compare_exchange_n(&handle->state, &state, 
+            HANDLE_MOVING, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            continue;
+        }
+
+        struct block* old = handle->block;
+        struct block* target = NULL;
+        if(!(old->flags & (BLOCK_SAMPLED | BLOCK_SHORT)) && old->owner == 0)
+        {
+            target = compact_target(entries, entry_count, old);
+        }
+
+        if(target != NULL)
+        {
+            search_start(old->size);
+            struct block* block = aquire_block(target, old->size, 
+                old->asked);
+            count_alloc(block);
+            block->site = 0;
+            block->born = 0;
+            block->flags &= ~BLOCK_ZEROED;
+
+            memcpy(block->data, old->data, old->size);
+
+            #ifdef DEBUG
+            printf("-->Moved chunk of handle %u (Size: %ld) from %p to %p\n",
+                (cursor + step) % count_used + 1, old->size, old->data, 
+                block->data);
+            #endif
+
+            handle->chunk = block->data;
+            handle->block = block;
+
+            count(&stats->moves, 1);
+            count(&stats->moved_bytes, old->size);
+            moved += old->size;
+
+            release_block(alloc_index(old->asked), old);
+        }
+
+        __atomic_store_n(&handle->state, 0, __ATOMIC_RELEASE);
+    }
+
+    if(count_used > 0)
+    {
+        __atomic_store_n(&compact_cursor, (cursor + step) % count_used, 
+            __ATOMIC_RELAXED);
+    }
+
+    if(moved > 0)
+    {
+        entry_count = maint_merge(entries);
+    }
+    trim_top(entries, entry_count);
+
+    return moved;
+}
+
+/*
+ * The maintenance thread, which does a pass every interval (if it has one),
+ * and reclaims whenever soft_limit_check() asks it to, until it is told to
+ * stop.
+ */
+static void* maint_thread_func(void* arg)
+{
+    struct maint_entry* entries = arg;
+    struct timespec wake;
+    int ticked = 1;
+
+    pthread_mutex_lock(&maint_lock);
+
+    while(!maint_stop)
+    {
+        /* A reclaim doesnt put the next tick back */
+        if(ticked && maint_interval_ms > 0)
+        {
+            clock_gettime(CLOCK_REALTIME, &wake);
+            wake.tv_sec += maint_interval_ms / 1000;
+            wake.tv_nsec += (long) (maint_interval_ms % 1000) * 1000000;
+            if(wake.tv_nsec >= 1000000000)
+            {
+                ++wake.tv_sec;
+                wake.tv_nsec -= 1000000000;
+            }
+        }
+
+        ticked = 0;
+        while(!maint_stop && maint_reclaim == 0 && !ticked)
+        {
+            if(maint_interval_ms == 0)
+            {
+                pthread_cond_wait(&maint_wake, &maint_lock);
+            }
+            else
+            {
+                ticked = pthread_cond_timedwait(&maint_wake, &maint_lock, 
+                    &wake) == ETIMEDOUT;
+            }
+        }
+        if(maint_stop)
+        {
+            break;
+        }
+
+        if(maint_reclaim != 0)
+        {
+            size_t chunk_size = maint_reclaim;
+            maint_reclaim = 0;
+
+            pthread_mutex_unlock(&maint_lock);
+            soft_limit_reclaim(entries, chunk_size);
+            pthread_mutex_lock(&maint_lock);
+        }
+        if(!ticked)
+        {
+            continue;
+        }
+
+        /* Blocks are purged once they have been idle for the decay time,
+         * rounded up to whole ticks */
+        unsigned long decay_ticks = 
+            (maint_decay_ms + maint_interval_ms - 1) / maint_interval_ms;
+
+        pthread_mutex_unlock(&maint_lock);
+
+        __atomic_add_fetch(&maint_tick, 1, __ATOMIC_RELAXED);
+        size_t entry_count;
+        maint_pass(entries, decay_ticks, &entry_count);
+
+        /* Relocatable chunks are moved down a step at a time */
+        if(__atomic_load_n(&handle_count, __ATOMIC_RELAXED) > 0)
+        {
+            compact(entries, COMPACT_STEP_BYTES);
+        }
+
+        pthread_mutex_lock(&maint_lock);
+    }
+
+    pthread_mutex_unlock(&maint_lock);
+
+    munmap(entries, MAINT_SNAPSHOT * sizeof(struct maint_entry));
+    return 0;
+}
+
+/*
+ * Stop the maintenance thread if it is running. maint_lock must be held, and
+ * is let go of while waiting for the thread.
+ */
+static void maint_halt()
+{
+    if(maint_running)
+    {
+        maint_stop = 1;
+        pthread_cond_signal(&maint_wake);
+
+        pthread_mutex_unlock(&maint_lock);
+        pthread_join(maint_thread, NULL);
+        pthread_mutex_lock(&maint_lock);
+
+        maint_running = 0;
+        maint_reclaim = 0;
+    }
+}
+
+/*
+ * Start the maintenance thread with the settings passed in, returning 0 on
+ * success or -1 if it couldnt be. maint_lock must be held.
+ */
+static int maint_start(unsigned int interval_ms, unsigned int decay_ms)
+{
+    /* The snapshot is mapped directly so maintenance never calls back into
+     * the allocator */
+    struct maint_entry* entries = mmap(NULL, 
+        MAINT_SNAPSHOT * sizeof(struct maint_entry), 
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    maint_interval_ms = interval_ms;
+    maint_decay_ms = decay_ms;
+    maint_stop = 0;
+
+    if(entries == MAP_FAILED)
+    {
+        return -1;
+    }
+    if(pthread_create(&maint_thread, NULL, maint_thread_func, entries) != 0)
+    {
+        munmap(entries, MAINT_SNAPSHOT * sizeof(struct maint_entry));
+        return -1;
+    }
+
+    maint_running = 1;
+    return 0;
+}
+
+/*
+ * Read a single number from a file of the cgroup directory, where "max" reads
+ * as SOFT_LIMIT_OFF. Returns -1 if it couldnt be read.
+ */
+static int read_cgroup_value(const char* dir, const char* name, size_t* value)
+{
+    char path[320];
+    char text[64];
+    unsigned long long number;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    FILE* file = fopen(path, "r");
+    if(file == NULL)
+    {
+        return -1;
+    }
+
+    int result = -1;
+    if(fgets(text, sizeof(text), file) != NULL)
+    {
+        if(strncmp(text, "max", 3) == 0)
+        {
+            *value = SOFT_LIMIT_OFF;
+            result = 0;
+        }
+        else if(sscanf(text, "%llu", &number) == 1)
+        {
+            *value = (size_t) number;
+            result = 0;
+        }
+    }
+
+    fclose(file);
+    return result;
+}
+
+/*
+ * Read the share of the last 10 seconds some task in the cgroup was stalled
+ * waiting for memory, or 0 if it couldnt be read.
+ */
+static double read_cgroup_pressure(const char* dir)
+{
+    char path[320];
+    double pressure = 0.0;
+
+    snprintf(path, sizeof(path), "%s/memory.pressure", dir);
+    FILE* file = fopen(path, "r");
+    if(file != NULL)
+    {
+        if(fscanf(file, "some avg10=%lf", &pressure) != 1)
+        {
+            pressure = 0.0;
+        }
+        fclose(file);
+    }
+    return pressure;
+}
+
+/*
+ * Once the heap has grown by SOFT_LIMIT_CHECK_BYTES since the last check,
+ * wake the maintenance thread to check the soft limit before the heap grows
+ * by 'chunk_size'. The allocating thread does nothing more, so it is never
+ * held up by the cgroup being read or the heap being reclaimed.
+ */
+static void soft_limit_check(size_t chunk_size)
+{
+    size_t mapped = __atomic_load_n(&os_bytes, __ATOMIC_RELAXED);
+    size_t next_check = 
+        __atomic_load_n(&soft_limit_next_check, __ATOMIC_RELAXED);
+    if(mapped < next_check || !__atomic_compare_exchange_n(
+        &soft_limit_next_check, &next_check, 
+        mapped + SOFT_LIMIT_CHECK_BYTES, 0, __ATOMIC_RELAXED, 
+        __ATOMIC_RELAXED))
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&maint_lock);
 
-    return new_block;
+    maint_reclaim = chunk_size;
+    pthread_cond_signal(&maint_wake);
+
+    pthread_mutex_unlock(&maint_lock);
 }
 
 /*
- * Append a block pointer to the back of alloc_list
+ * See if the memory in use is near the soft limit or the cgroup is under
+ * pressure, and if so merge and purge every free block and trim the end of
+ * the heap. Run by the maintenance thread with its snapshot.
  */
-static void alloc_list_append(struct block* block)
+static void soft_limit_reclaim(struct maint_entry* entries, size_t chunk_size)
 {
-    /* If this is the first ever block we need to set it as the head */
-    if(alloc_list.head == NULL)
+    struct alloc_event event;
+    char dir[sizeof(soft_limit_dir)];
+
+    pthread_mutex_lock(&soft_limit_lock);
+
+    event.limit = soft_limit;
+    memcpy(dir, soft_limit_dir, sizeof(dir));
+
+    pthread_mutex_unlock(&soft_limit_lock);
+
+    event.type = EVENT_SOFT_LIMIT;
+    event.usage = __atomic_load_n(&os_bytes, __ATOMIC_RELAXED);
+    event.pressure = 0.0;
+    if(dir[0] != '\0')
     {
-        alloc_list.head = block;
+        read_cgroup_value(dir, "memory.current", &event.usage);
+        event.pressure = read_cgroup_pressure(dir);
     }
 
-    /* Set the current tail's next block to this block and this blocks previous
-     * to the current tail (if there is a tail) */
-    if(alloc_list.tail != NULL)
+    if(event.limit == SOFT_LIMIT_OFF || 
+        ((double) (event.usage + chunk_size) < event.limit * SOFT_LIMIT_HIGH &&
+        event.pressure < SOFT_LIMIT_PRESSURE))
     {
-        alloc_list.tail->next = block;
-        block->prev = alloc_list.tail;
+        return;
     }
 
-    /* This block will always become the new tail */
-    alloc_list.tail = block;
+    /* Every thread empties its cache at its next slow path, so its chunks
+     * can be reclaimed by the next pass */
+    __atomic_add_fetch(&alloc_cache_generation, 1, __ATOMIC_RELEASE);
+
+    /* The free blocks left at the end of the heap are then trimmed, which
+     * moves the program break back when enough of them are */
+    size_t entry_count;
+    event.reclaimed = maint_pass(entries, 0, &entry_count);
+    event.reclaimed += trim_top(entries, entry_count);
 
     #ifdef DEBUG
-    printf("-->Appended block (Block: %p, Next: %p, Prev: %p, Size: %ld,"
-        "Data: %p) to back of alloc_list.\n", 
-        (void*) block, (void*) block->next, (void*) block->prev,
-        block->size, block->data);
+    printf("-->Soft limit neared (usage %ld of %ld, pressure %.2f), "
+        "reclaimed %ld bytes\n", event.usage, event.limit, event.pressure, 
+        event.reclaimed);
     #endif
+
+    /* Only passes that handed memory back are reported, as a heap stuck at
+     * its limit would otherwise report every check */
+    alloc_event_callback callback = event_callback;
+    if(callback != NULL && event.reclaimed > 0)
+    {
+        callback(&event);
+    }
 }
 
 /*
- * Append a block pointer to the back of freed_list
+ * Find the cgroup to watch and set the limit, reading it from the cgroup if
+ * asked to
  */
-static void freed_list_append(struct block* block)
+int set_soft_limit(size_t limit, const char* cgroup_dir)
 {
-    /* If this is the first ever block we need to set it as the head */
-    if(freed_list.head == NULL)
+    const char* dir = cgroup_dir != NULL ? cgroup_dir : 
+        SOFT_LIMIT_DEFAULT_CGROUP;
+    size_t value;
+
+    if(limit == SOFT_LIMIT_OFF)
     {
-        freed_list.head = block;
+        __atomic_store_n(&soft_limit, SOFT_LIMIT_OFF, __ATOMIC_RELAXED);
+
+        /* A thread only started to reclaim isnt needed any more */
+        pthread_mutex_lock(&maint_lock);
+        if(maint_interval_ms == 0)
+        {
+            maint_halt();
+        }
+        pthread_mutex_unlock(&maint_lock);
+
+        return 0;
     }
 
-    /* Set the current tail's next block to this block and this blocks previous
-     * to the current tail (if there is a tail) */
-    if(freed_list.tail != NULL)
+    /* The directory is only watched if it looks like a cgroup */
+    int found = read_cgroup_value(dir, "memory.current", &value) == 0 ||
+        read_cgroup_value(dir, "memory.max", &value) == 0;
+    if(limit == SOFT_LIMIT_CGROUP && 
+        (read_cgroup_value(dir, "memory.max", &limit) != 0 || 
+        limit == SOFT_LIMIT_OFF))
     {
-        freed_list.tail->next = block;
-        block->prev = freed_list.tail;
+        return -1;
     }
 
-    /* This block will always become the new tail */
-    freed_list.tail = block;
+    /* The reclaiming is done by the maintenance thread, which is started
+     * without an interval if it isnt running */
+    pthread_mutex_lock(&maint_lock);
+    int result = maint_running ? 0 : maint_start(0, 0);
+    pthread_mutex_unlock(&maint_lock);
+
+    if(result != 0)
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&soft_limit_lock);
+
+    snprintf(soft_limit_dir, sizeof(soft_limit_dir), "%s", found ? dir : "");
+    __atomic_store_n(&soft_limit_next_check, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&soft_limit, limit, __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&soft_limit_lock);
 
     #ifdef DEBUG
-    printf("-->Appended block (Block: %p, Next: %p, Prev: %p, Size: %ld,"
-        "Data: %p) to back of freed_list.\n", 
-        (void*) block, (void*) block->next, (void*) block->prev,
-        block->size, block->data);
+    printf("-->Soft limit set to %ld bytes (cgroup: %s)\n", limit, 
+        found ? dir : "none");
     #endif
+
+    return 0;
 }
 
 /*
- * Delete the specified block from whichever list it is in
+ * Take a step of compaction with a snapshot mapped on first use
  */
-static void list_delete(struct block* block)
+size_t hcompact(size_t max_bytes)
 {
-    #ifdef DEBUG
-    printf("-->Removing block (Block: %p, Next: %p, Prev: %p, Size: %ld,"
-        "Data: %p)\n", 
-        (void*) block, (void*) block->next, (void*) block->prev,
-        block->size, block->data);
-    #endif
+    /* Cached chunks would sit between the free blocks, so this thread's
+     * cache is emptied, and every other thread's at its next slow path */
+    __atomic_add_fetch(&alloc_cache_generation, 1, __ATOMIC_RELEASE);
+    cache_sync();
 
-    /* If the block is a head of either list we need to set the new head as the
-     * next block (the next block could be NULL in this case, which is fine) */
-    if(block == alloc_list.head)
-    {
-        alloc_list.head = block->next;
-    } 
-    else if(block == freed_list.head)
-    {
-        freed_list.head = block->next;
-    }
+    pthread_mutex_lock(&compact_lock);
 
-    /* If the block is a tail of either list we need to set the new tail as the
-     * prev block (the prev block could be NULL in this case, which is fine) */
-    if(block == alloc_list.tail)
-    {
-        alloc_list.tail = block->prev;
-    } 
-    else if(block == freed_list.tail)
+    if(compact_entries == NULL)
     {
-        freed_list.tail = block->prev;
+        struct maint_entry* entries = mmap(NULL, 
+            MAINT_SNAPSHOT * sizeof(struct maint_entry), 
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        compact_entries = entries != MAP_FAILED ? entries : NULL;
     }
 
-    /* If the block has either a next or prev block, then we rebuild the list
-     * by linking the prev node with the next node */
-    if(block->next != NULL)
-    {
-        block->next->prev = block->prev;
-    }
-    if(block->prev != NULL)
+    size_t moved = compact_entries != NULL ? 
+        compact(compact_entries, max_bytes) : 0;
+
+    pthread_mutex_unlock(&compact_lock);
+
+    return moved;
+}
+
+/*
+ * Stop any running maintenance thread, then start a new one if asked to, or
+ * one without an interval if the soft limit needs it
+ */
+int set_maintenance(unsigned int interval_ms, unsigned int decay_ms)
+{
+    pthread_mutex_lock(&maint_lock);
+
+    maint_halt();
+
+    int result = 0;
+    if(interval_ms > 0 || 
+        __atomic_load_n(&soft_limit, __ATOMIC_RELAXED) != SOFT_LIMIT_OFF)
     {
-        block->prev->next = block->next;
+        result = maint_start(interval_ms, decay_ms);
     }
 
-    /* Remove the references to the prev and next so that it is completely
-     * unrelated either list */
-    block->next = NULL;
-    block->prev = NULL;
+    pthread_mutex_unlock(&maint_lock);
+
+    return result;
 }
 
-/* 
- * Allocate the passed in block and split it down to the passed in chunk size
- * if the block is larger. It is assumed that the blocks mutex lock is owned by
- * this thread, as it will be unlocked before exiting this function.
- * 
- * If NULL is passed in as the block, we create a new block of the chunk_size
- * and allocate it.
+/*
+ * Set the stratergy to be used in allocation
  */
-static void* aquire_block(struct block* block, size_t chunk_size)
+void set_stratergy(enum stratergy stratergy)
 {
-    void* chunk = NULL; // The ptr to the chunk we are returning at the end
+    current_stratergy = stratergy;
+    
+    #ifdef DEBUG
+    printf("-->Stratergy changed: %d\n", current_stratergy);
+    #endif
+}
 
-    /* If we have found and locked a valid block, we remove it from the freed
-     * list (splitting the block if need be) and add it to the alloc list.
-     * We also release the lock on the block, so if it gets deallocated at a 
-     * later date, another thread is able to lock it for themselves. 
-     * 
-     * If the block is NULL, we create a new block and add it to the alloc
-     * list.
-     * 
-     * In both cases, write locks are used on the lists, as we are altering the
-     * data and need to maintain thread safety */
-    if(block != NULL)
-    {
-        w_lock(&freed_list.rw_lock);
+/*
+ * Set the policy table, moving any blocks already in the freed lists into the
+ * list of the range they belong to under the new table.
+ */
+int set_policy(const struct policy_range* ranges, int count)
+{
+    struct linked_list pending = LIST_INIT; // Blocks waiting to be re-listed
 
-        if(block->size > chunk_size)
+    /* Validate the table before touching anything */
+    if(count < 0 || count > POLICY_MAX_RANGES || (count > 0 && ranges == NULL))
+    {
+        return -1;
+    }
+    for(int i = 1; i < count; ++i)
+    {
+        if(ranges[i].max_size <= ranges[i - 1].max_size)
         {
-            freed_list_append(split_block(block, chunk_size));
+            return -1;
         }
-        list_delete(block);
-
-        w_unlock(&freed_list.rw_lock);
+    }
 
-        w_lock(&alloc_list.rw_lock);
+    /* Lock every freed list in order, so nothing can be searching them while
+     * the ranges change underneath */
+    for(int i = 0; i <= POLICY_MAX_RANGES; ++i)
+    {
+        w_lock(&freed_lists[i].rw_lock);
+    }
 
-        alloc_list_append(block);
-        pthread_mutex_unlock(&block->lock);
-        chunk = alloc_list.tail->data;
+    /* Empty every list into the pending list */
+    for(int i = 0; i <= policy_count; ++i)
+    {
+        while(freed_lists[i].head != NULL)
+        {
+            struct block* block = freed_lists[i].head;
+            freed_delete(i, block);
+            list_append(&pending, block);
+        }
+    }
 
-        w_unlock(&alloc_list.rw_lock);
+    for(int i = 0; i < count; ++i)
+    {
+        policy[i] = ranges[i];
     }
-    else
-    {       
-        w_lock(&alloc_list.rw_lock);
+    policy_count = count;
 
-        alloc_list_append(create_block(chunk_size));
-        chunk = alloc_list.tail->data;
+    /* Put every block back into the list for its range under the new table */
+    while(pending.head != NULL)
+    {
+        struct block* block = pending.head;
+        list_delete(&pending, block);
+        freed_append(policy_index(block->size), block);
+    }
 
-        w_unlock(&alloc_list.rw_lock);
+    for(int i = POLICY_MAX_RANGES; i >= 0; --i)
+    {
+        w_unlock(&freed_lists[i].rw_lock);
     }
 
-    return chunk;
+    #ifdef DEBUG
+    printf("-->Policy changed: %d ranges\n", policy_count);
+    #endif
+
+    return 0;
 }
 
 /*
- * Attempt to find a suitable block in the freed list for the size passed
- * into the function using the first algorithm, if no suitable block is 
- * found, we create a new block.
+ * Set where the heap memory comes from, sbrk or huge page regions
  */
-static void* alloc_first(size_t chunk_size)
+void set_hugepages(enum hugepage_mode mode)
 {
-    struct block* current_block = NULL; // Our temporary block pointer
-    
-    /* Here we lock down the list for reading and attempt to find a
-     * valid block */
-    r_lock(&freed_list.rw_lock);
-
-    current_block = freed_list.head;
-    while(current_block != NULL)
-    {
-        if(current_block->size >= chunk_size)
-        {   
-            /* We've found a valid block! Now we attempt to lock the block's
-             * mutex. If we are able to then we can keep the block and break
-             * out of the loop. If another thread has already locked this block
-             * then we simply go back to searching */
-            if(pthread_mutex_trylock(&current_block->lock) == 0)
-            {        
-                break;
-            }
-        }
-        current_block = current_block->next;
-    }
+    pthread_mutex_lock(&sbrk_lock);
 
-    r_unlock(&freed_list.rw_lock);
+    current_hugepage_mode = mode;
 
-    return aquire_block(current_block, chunk_size);
+    pthread_mutex_unlock(&sbrk_lock);
+
+    #ifdef DEBUG
+    printf("-->Huge page mode changed: %d\n", current_hugepage_mode);
+    #endif
 }
 
 /*
- * Attempt to find a suitable block in the freed list for the size passed
- * into the function using the best algorithm, if no suitable block is 
- * found, we create a new block
+ * Fill in the huge page counters. The transparent huge page regions are only
+ * a request to the kernel, so how much of them is really backed by huge pages
+ * is read from the AnonHugePages fields of /proc/self/smaps.
  */
-static void* alloc_best(size_t chunk_size)
+void get_hugepage_stats(struct hugepage_stats* stats)
 {
-    struct block* current_block = NULL; // Our temporary block pointer
-    struct block* best_block = NULL; // The currently best suited block
+    char line[256];
+    size_t thp_backed = 0;
+    int in_region = 0;
 
-    /* Here we lock down the list for reading and attempt to find the best
-     * fitting block */
-    r_lock(&freed_list.rw_lock);
-
-    current_block = freed_list.head;
-    while(current_block != NULL)
-    {
-        if(current_block->size >= chunk_size)
-        {   
-            /* We found a valid block! There are now 3 things that can happen: 
-             *
-             * 1. The block is of equal size to the size we are requesting.
-             * This means we can terminate early as it is the best possible
-             * size we will ever find.
-             * 
-             * 2. The block is not equal and the first valid block we have
-             * found. In this case we attempt to lock it and set it as our
-             * best block.
-             * 
-             * 3. The block is not equal, not our first valid block and 
-             * is smaller in size than our previous best. In this case we
-             * again attempt to aquire the block lock and then relinquish
-             * the lock on the previous best block (so another thread can
-             * aquire it). Setting the block as our new best.
-             * 
-             * In all cases, if the lock is not able to be aquired, we simply
-             * ignore the block and go back to searching, as this means another
-             * thread is currently wanting to use the block*/
-            if(current_block->size == chunk_size)
+    pthread_mutex_lock(&sbrk_lock);
+
+    stats->regions = huge_region_count;
+    stats->bytes_reserved = huge_bytes_reserved;
+    stats->bytes_used = huge_bytes_used;
+    stats->bytes_hugetlb = huge_bytes_hugetlb;
+    stats->bytes_thp_advised = huge_bytes_thp;
+
+    FILE* smaps = huge_regions != NULL ? fopen("/proc/self/smaps", "r") : NULL;
+    while(smaps != NULL && fgets(line, sizeof(line), smaps) != NULL)
+    {
+        unsigned long start, end, kb;
+
+        /* Mapping header lines start with the address range, every other line
+         * is a field of the last mapping */
+        if(sscanf(line, "%lx-%lx ", &start, &end) == 2)
+        {
+            in_region = 0;
+            for(struct huge_region* region = huge_regions; region != NULL;
+                region = region->next)
             {
-                if(pthread_mutex_trylock(&current_block->lock) == 0)
+                if((uintptr_t) region < end && 
+                    (uintptr_t) region + region->size > start)
                 {
-                    if(best_block != NULL)
-                    {
-                        pthread_mutex_unlock(&best_block->lock);
-                    }
-                    best_block = current_block;
+                    in_region = 1;
                     break;
                 }
             }
-            else if(best_block == NULL)
-            {
-                if(pthread_mutex_trylock(&current_block->lock) == 0)
-                {
-                    best_block = current_block;
-                }
-            }
-            else if(current_block->size < best_block->size)
-            {
-                if(pthread_mutex_trylock(&current_block->lock) == 0)
-                {
-                    pthread_mutex_unlock(&best_block->lock);
-                    best_block = current_block;
-                }
-            }
         }
-        current_block = current_block->next;
+        else if(in_region && sscanf(line, "AnonHugePages: %lu kB", &kb) == 1)
+        {
+            thp_backed += kb * 1024;
+        }
     }
 
-    r_unlock(&freed_list.rw_lock);
+    pthread_mutex_unlock(&sbrk_lock);
+
+    if(smaps != NULL)
+    {
+        fclose(smaps);
+    }
 
-    return aquire_block(best_block, chunk_size);
+    stats->bytes_thp_backed = thp_backed;
 }
 
 /*
- * Attempt to find a suitable block in the freed list for the size passed
- * into the function using the worst algorithm, if no suitable block is 
- * found, we create a new block
+ * Turn thread pages on or off
  */
-static void* alloc_worst(size_t chunk_size)
+void set_thread_pages(int enabled)
 {
-    struct block* current_block = NULL; // Our temporary block pointer
-    struct block* worst_block = NULL; // The currently best suited block
-
-    /* Here we lock down the list for reading and attempt to find the worst
-     * fitting block */
-    r_lock(&freed_list.rw_lock);
-
-    current_block = freed_list.head;
-    while(current_block != NULL)
-    {
-        if(current_block->size >= chunk_size)
-        {   
-            /* We found a valid block! There are now 2 things that can happen: 
-             *
-             * 1. The block is the first valid block we have found. In this
-             * case we attempt to lock it and set it as our worst block.
-             * 
-             * 2. The block is not our first valid block and is larger in size
-             * than our previous worst. In this case we again attempt to aquire
-             * the block lock and then relinquish the lock on the previous
-             * worst block (so another thread can aquire it). Setting the block
-             * as our new worst.
-             * 
-             * In both cases, if the lock is not able to be aquired, we simply
-             * ignore the block and go back to searching, as this means another
-             * thread is currently wanting to use the block */
-            if(worst_block == NULL)
-            {
-                if(pthread_mutex_trylock(&current_block->lock) == 0)
-                {
-                    worst_block = current_block;
-                }
-            }
-            else if(current_block->size > worst_block->size)
-            {
-                if(pthread_mutex_trylock(&current_block->lock) == 0)
-                {
-                    pthread_mutex_unlock(&worst_block->lock);
-                    worst_block = current_block;
-                }
-            }
-        }
-        current_block = current_block->next;
-    }
+    __atomic_store_n(&thread_pages, enabled != 0, __ATOMIC_RELAXED);
 
-    r_unlock(&freed_list.rw_lock);
-
-    return aquire_block(worst_block, chunk_size);
-}
-
-/* 
- * Attempt to allocate the given size using the set algorithm
- */
-void* alloc(size_t chunk_size)
-{  
     #ifdef DEBUG
-    printf("\n\n-->Allocating %ld bytes\n", chunk_size);
+    printf("-->Thread pages %s\n", enabled ? "on" : "off");
     #endif
-
-    /* If we attempt to allocate <= 0 bytes we just return null */
-    if((signed long long int)chunk_size <= 0)
-    {
-        return NULL;
-    }
-
-    /* Pass off the allocation to whichever algorithm is selected */
-    switch(current_stratergy)
-    {
-        case FIRST:
-            #ifdef DEBUG
-            printf("-->Allocating using first fit...\n");
-            #endif
-            return alloc_first(chunk_size);
-        case BEST:
-            #ifdef DEBUG
-            printf("-->Allocating using best fit...\n");
-            #endif
-            return alloc_best(chunk_size);
-        case WORST:
-            #ifdef DEBUG
-            printf("-->Allocating using worst fit...\n");
-            #endif
-            return alloc_worst(chunk_size);
-        default:
-            #ifdef DEBUG
-            printf("-->Reached default case of alloc...\n");
-            #endif
-            abort();
-    }
 }
 
 /*
- * Attempt to dealloc the block containing the pointer equal to 'chunk'
+ * Turn lifetime prediction on or off, mapping the call site table the first
+ * time it is turned on
  */
-void dealloc(void* chunk)
+int set_lifetime_prediction(int enabled)
 {
-    struct block* current_block; // Current block we are looking at
-    
-    /* If we attempt to dealloc NULL then we just return */
-    if(chunk == NULL)
+    if(enabled)
     {
-        #ifdef DEBUG
-        printf("\n\n-->Attempting to dealloc NULL, did nothing\n");
-        #endif
-
-        return;
-    }
+        pthread_mutex_lock(&short_lock);
 
-    #ifdef DEBUG
-    printf("\n\n-->Attempting to dealloc block with data %p...\n", chunk);
-    #endif
+        if(lifetime_sites == NULL)
+        {
+            struct lifetime_site* sites = mmap(NULL, 
+                LIFETIME_SITES * sizeof(struct lifetime_site), 
+                PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            lifetime_sites = sites != MAP_FAILED ? sites : NULL;
+        }
 
-    /* Here we aquire the read lock for the alloc list and go through the list
-     * in search of the block we wish to deallocate. */
-    r_lock(&alloc_list.rw_lock);
+        pthread_mutex_unlock(&short_lock);
 
-    current_block = alloc_list.head;
-    while(current_block != NULL)
-    { 
-        if(current_block->data == chunk)
-        {  
-            /* We've found the block! So we break out of the loop */
-            break;
+        if(lifetime_sites == NULL)
+        {
+            return -1;
         }
-        current_block = current_block->next;
     }
 
-    r_unlock(&alloc_list.rw_lock);
+    __atomic_store_n(&lifetime_prediction, enabled != 0, __ATOMIC_RELAXED);
 
-    /* If we found the block then we attempt to remove it from the alloc list
-     * and add it to the freed list. 
-     * 
-     * However if we couldnt find it, we need to abort the program */
-    if(current_block != NULL)
+    /* Every chunk has to be seen from now on, so the budgets threads were
+     * given for their caches are taken back */
+    if(enabled)
     {
-        #ifdef DEBUG
-        r_lock(&alloc_list.rw_lock);
-        printf("-->Found the block (Block: %p, Next: %p, Prev: %p, Size: %ld, Data: %p)\n", 
-        (void*) current_block, (void*) current_block->next, (void*) current_block->prev, 
-        current_block->size, current_block->data);
-        r_unlock(&alloc_list.rw_lock);
-        #endif
-
-        w_lock(&alloc_list.rw_lock);
+        __atomic_add_fetch(&alloc_cache_generation, 1, __ATOMIC_RELEASE);
+    }
 
-        list_delete(current_block);
+    #ifdef DEBUG
+    printf("-->Lifetime prediction %s\n", enabled ? "on" : "off");
+    #endif
 
-        w_unlock(&alloc_list.rw_lock);
+    return 0;
+}
 
-        w_lock(&freed_list.rw_lock);
+/*
+ * Sum the tag's counters, raising its peak to its live bytes
+ */
+void tag_stats(uint16_t tag, struct tag_stats* stats)
+{
+    pthread_once(&tag_states_once, map_tag_states);
+    tag_check(tag);
 
-        freed_list_append(current_block);
+    sum_tag_counters(tag, stats);
+    stats->peak_bytes = __atomic_load_n(&tag_states[tag].peak, 
+        __ATOMIC_RELAXED);
+    stats->quota = __atomic_load_n(&tag_states[tag].quota, __ATOMIC_RELAXED);
+}
 
-        w_unlock(&freed_list.rw_lock);        
-    }
-    else
-    {
-        printf("Attempted to deallocate an invalid pointer: %p\n", chunk);
-        abort();
-    }
+/*
+ * Set the soft quota of the tag
+ */
+void set_tag_quota(uint16_t tag, size_t quota)
+{
+    pthread_once(&tag_states_once, map_tag_states);
+    __atomic_store_n(&tag_states[tag].quota, quota, __ATOMIC_RELAXED);
 }
 
 /*
- * Set the stratergy to be used in allocation
+ * Set the callback notified of allocator events
  */
-void set_stratergy(enum stratergy stratergy)
+void set_stats_callback(alloc_event_callback callback)
 {
-    current_stratergy = stratergy;
-    
-    #ifdef DEBUG
-    printf("-->Stratergy changed: %d\n", current_stratergy);
-    #endif
+    event_callback = callback;
 }
@@ -8,6 +8,7 @@
  * Aug 2019
  */
 #include <stddef.h>
+#include <stdint.h>
 
 /*
  * Searching stratergy's used when allocating memory.
@@ -18,32 +19,516 @@
  *         and adds any remaining memory to the free list.
  * worst - Finds the largest chunk and adds the remaining memory to the free
  *         list.
+ * adaptive - Samples the average search length, split rate and fragmentation
+ *            of the free list while allocating, and switches between first,
+ *            best and worst to whichever suits the workload.
  */
-enum stratergy{FIRST, BEST, WORST};
+enum stratergy{FIRST, BEST, WORST, ADAPTIVE};
+
+/* The maximum amount of size ranges that can be passed to set_policy() */
+#define POLICY_MAX_RANGES 8
 
 /*
- * Sets the search stratergy for the memory allocator.
+ * A single entry of the policy table. Any request of 'max_size' bytes or less
+ * (and larger than the previous entry's max_size) is allocated using
+ * 'stratergy'.
+ */
+struct policy_range
+{
+    size_t max_size;
+    enum stratergy stratergy;
+};
+
+/*
+ * Sets the search stratergy for the memory allocator. When a policy table is
+ * in use, this is the stratergy used for requests larger than every range.
  */
 void set_stratergy(enum stratergy stratergy);
 
+/*
+ * Sets a policy table that maps size ranges to stratergys, eg.
+ *
+ *     {{64, FIRST}, {4096, BEST}} with set_stratergy(WORST)
+ *
+ * allocates requests of up to 64 bytes with first fit, up to 4096 bytes with
+ * best fit and anything larger with worst fit. The freed list is split into
+ * one list per range, so each search only looks at blocks that are large
+ * enough to be relevant to its range.
+ *
+ * The ranges must be sorted by ascending max_size. Passing a count of 0 clears
+ * the table. This should be called before any other threads are allocating.
+ * Returns 0 on success or -1 if the table is invalid.
+ */
+int set_policy(const struct policy_range* ranges, int count);
+
+/*
+ * Where the allocator gets its heap memory from.
+ *
+ * off     - The program break is moved with sbrk (the default).
+ * thp     - Memory is reserved in 2 MiB aligned regions that are advised to be
+ *           backed by transparent huge pages.
+ * hugetlb - As thp, but explicit MAP_HUGETLB pages are tried first, falling
+ *           back to transparent huge pages if none are available.
+ */
+enum hugepage_mode{HUGEPAGE_OFF, HUGEPAGE_THP, HUGEPAGE_HUGETLB};
+
+/*
+ * Counters for how much of the heap lives in huge page regions.
+ */
+struct hugepage_stats
+{
+    size_t regions;           /* Regions mapped */
+    size_t bytes_reserved;    /* Bytes mapped across all regions */
+    size_t bytes_used;        /* Bytes of the regions handed to the heap */
+    size_t bytes_hugetlb;     /* Bytes mapped with explicit huge pages */
+    size_t bytes_thp_advised; /* Bytes advised with MADV_HUGEPAGE */
+    size_t bytes_thp_backed;  /* Bytes the kernel has backed with THP */
+};
+
+/*
+ * Sets where new heap memory comes from. Small allocations are packed into the
+ * huge page region currently being filled, while large ones get a region to
+ * themselves. Blocks already on the heap are unaffected.
+ */
+void set_hugepages(enum hugepage_mode mode);
+
+/*
+ * Fills in the passed in struct with the current huge page counters.
+ */
+void get_hugepage_stats(struct hugepage_stats* stats);
+
+/*
+ * Starts a background thread that tidies up the freed lists every
+ * 'interval_ms' milliseconds. It merges free chunks that sit next to each
+ * other in memory, putting the merged chunk in the list for its new size, and
+ * hands the pages of free chunks that have been idle for at least 'decay_ms'
+ * milliseconds back to the OS with madvise (so they are known to be zero for
+ * zalloc()). The work is done a few chunks at a time, and a chunk a searching
+ * thread has locked is simply left until the next pass.
+ *
+ * Any thread already running is stopped first, and an interval of 0 just
+ * stops it (leaving a thread that only reclaims while a soft limit is set).
+ * Returns 0 on success or -1 if the thread couldnt be started.
+ */
+int set_maintenance(unsigned int interval_ms, unsigned int decay_ms);
+
+/*
+ * Turns thread pages on or off. While on, each thread carves the chunks of up
+ * to 1 KiB it allocates from 16 KiB spans of the heap of its own that start on
+ * a cache line, and only reuses free blocks from its own spans for them. Other
+ * threads never use them, so small chunks handed to different threads never
+ * share a cache line. A thread's spans are handed on to the next new thread
+ * once it exits. Blocks already on the heap are unaffected.
+ */
+void set_thread_pages(int enabled);
+
+/*
+ * Turns lifetime prediction on or off. While on, alloc() learns the average
+ * lifetime (in allocations made while it was live) of the chunks allocated
+ * from each call site. Chunks of up to 4 KiB from a site whose chunks are
+ * predicted to be short lived are placed in 256 KiB short lived regions,
+ * apart from the rest of the heap, so long lived chunks arent left scattered
+ * between them. Once every chunk of a region is freed it is reused whole, or
+ * unmapped if a few empty regions are kept already. It isnt used while thread
+ * pages are on.
+ *
+ * Returns 0 on success or -1 if the table of call sites couldnt be mapped.
+ */
+int set_lifetime_prediction(int enabled);
+
+/* Pass as the limit to set_soft_limit() to read it from the cgroup's
+ * memory.max, or to turn the soft limit off */
+#define SOFT_LIMIT_CGROUP 0
+#define SOFT_LIMIT_OFF ((size_t) -1)
+
+/*
+ * Sets a soft limit on the memory the allocator should use. As the heap
+ * grows, the maintenance thread is woken to check the memory in use, and if
+ * it is within 10% of the limit (or the cgroup reports memory pressure) every
+ * free chunk is merged with its neighbours and its pages handed back to the
+ * OS. The maintenance thread is started without an interval if it isnt
+ * running, and the allocating thread never waits for the reclaim.
+ *
+ * The memory in use is read from memory.current, and the pressure from
+ * memory.pressure, of the cgroup directory 'cgroup_dir' (or /sys/fs/cgroup if
+ * NULL), falling back to the bytes mapped from the OS when there is no
+ * cgroup. A directory of stand-in files can be passed to test it.
+ *
+ * Returns 0 on success or -1 if the limit was to be read from the cgroup and
+ * it doesnt have one, or the maintenance thread couldnt be started.
+ */
+int set_soft_limit(size_t limit, const char* cgroup_dir);
+
+/*
+ * Types of events reported to the stats callback.
+ *
+ * stratergy_switch - The adaptive stratergy switched its fit policy.
+ * soft_limit       - The memory in use neared the soft limit, so free memory
+ *                    was handed back to the OS.
+ * tag_quota        - The live bytes of a tag went over its quota.
+ */
+enum alloc_event_type{EVENT_STRATERGY_SWITCH, EVENT_SOFT_LIMIT, 
+    EVENT_TAG_QUOTA};
+
+/*
+ * An event passed to the stats callback, along with the metrics that caused
+ * it. Only the fields for the type of event are set.
+ */
+struct alloc_event
+{
+    enum alloc_event_type type;
+    enum stratergy from;
+    enum stratergy to;
+    double avg_search_length; /* Blocks looked at per allocation */
+    double split_rate;        /* Splits per allocation */
+    double fragmentation;     /* 1 - largest free block / total free bytes */
+    size_t usage;             /* Bytes in use when the soft limit was neared,
+                               * or live bytes of the tag */
+    size_t limit;             /* The soft limit, or the tag's quota */
+    unsigned int tag;         /* Tag over its quota */
+    double pressure;          /* Cgroup memory pressure (some avg10) */
+    size_t reclaimed;         /* Bytes handed back to the OS */
+};
+
+/*
+ * Signature of the stats callback. It is called from whichever thread caused
+ * the event (the maintenance thread for a soft limit), without any allocator
+ * locks held.
+ */
+typedef void (*alloc_event_callback)(const struct alloc_event* event);
+
+/*
+ * Sets the callback to notify of allocator events, or NULL for none.
+ */
+void set_stats_callback(alloc_event_callback callback);
+
 /*
  * Prints out the current free and alloc lists
  */
 void list();
 
+/*
+ * Totals of the free and alloc lists, as printed at the end of list().
+ */
+struct list_summary
+{
+    size_t alloc_count;   /* Blocks in the alloc list */
+    size_t alloc_bytes;   /* Bytes held by blocks in the alloc list */
+    size_t freed_count;   /* Blocks in the freed list or a thread's cache */
+    size_t freed_bytes;   /* Bytes held by the blocks counted as freed */
+    size_t largest_freed; /* Size of the largest block in the freed list */
+    size_t heap_size;     /* Bytes the heap has been grown by */
+};
+
+/*
+ * Fills in the passed in struct with the totals of the free and alloc lists,
+ * without printing every block. Chunks kept in a thread's cache are counted
+ * as freed, as alloc_stats() counts them as deallocated. A chunk alloc() has
+ * taken from a cache is counted as freed until its thread next takes the
+ * slow path.
+ */
+void list_summary(struct list_summary* summary);
+
+/*
+ * Writes a snapshot of every chunk in the alloc and freed lists to the file
+ * descriptor 'fd', in order of address, in the format of heapdump.h. Each list
+ * is copied under its read lock in turn, so allocating threads are only held
+ * up for as long as one list takes to copy, but chunks that move lists during
+ * the dump may appear twice or not at all. Chunks in a thread's cache are
+ * written as free, the same as list_summary() counts them. Returns 0 on
+ * success or -1 if it couldnt be written.
+ */
+int heap_dump(int fd);
+
+/* Amount of power of two size classes counted by alloc_stats() */
+#define ALLOC_SIZE_CLASSES 64
+
+/*
+ * A snapshot of the allocator's counters. Size class i holds the blocks of
+ * 2^i to 2^(i+1) - 1 bytes.
+ */
+struct alloc_stats
+{
+    size_t bytes_in_use;   /* Bytes held by allocated chunks */
+    size_t blocks_in_use;  /* Allocated chunks */
+    size_t bytes_free;     /* Bytes held by free blocks */
+    size_t blocks_free;    /* Free blocks */
+    size_t heap_size;      /* Bytes the heap has been grown by */
+    size_t heap_peak;      /* Most heap_size has been, before any trimming */
+    size_t os_bytes;       /* Bytes mapped from the OS */
+    unsigned long grow_calls;   /* Times the heap was asked to grow */
+    unsigned long os_calls;     /* Calls to sbrk or mmap to grow it */
+    unsigned long short_allocs; /* Chunks placed in short lived regions */
+    size_t short_regions;       /* Short lived regions mapped */
+    unsigned long region_recycles; /* Regions that emptied and were kept */
+    unsigned long region_unmaps;   /* Regions that emptied and were unmapped */
+    unsigned long allocs;       /* Allocations made */
+    unsigned long deallocs;     /* Deallocations made */
+    unsigned long splits;       /* Free blocks split to fit an allocation */
+    unsigned long merges;       /* Free blocks merged into their neighbour */
+    unsigned long purges;       /* Idle free blocks handed back to the OS */
+    unsigned long purged_bytes; /* Bytes handed back by the purges */
+    unsigned long cache_allocs; /* Allocations taken from a thread cache */
+    unsigned long moves;        /* Chunks moved down by compaction */
+    unsigned long moved_bytes;  /* Bytes of the chunks moved */
+    unsigned long trimmed_bytes; /* Free bytes handed back to the top chunk */
+    unsigned long searches;     /* Searches of the freed lists */
+    unsigned long search_steps; /* Free blocks looked at by every search */
+    unsigned long class_allocs[ALLOC_SIZE_CLASSES]; /* Allocations made */
+    size_t class_in_use[ALLOC_SIZE_CLASSES];        /* Allocated chunks */
+};
+
+/*
+ * Fills in the passed in struct with a snapshot of the allocator's counters.
+ * Each thread keeps its own counters, which are summed here without taking
+ * any locks, so it is cheap enough to call while other threads allocate. The
+ * counters are read one at a time, so a snapshot taken while other threads
+ * are allocating may be off by their last few operations.
+ */
+void alloc_stats(struct alloc_stats* stats);
+
+/*
+ * Chunks of up to ALLOC_CACHE_MAX bytes are rounded up to one of the size
+ * classes in sizeclass.h, generated by classopt.out from the sizes a workload
+ * allocates, and each thread keeps up to ALLOC_CACHE_DEPTH deallocated chunks
+ * of each class to hand straight back out. Every other chunk is rounded up to
+ * ALLOC_CACHE_ALIGN bytes.
+ */
+#include "sizeclass.h"
+#define ALLOC_CACHE_ALIGN SIZE_CLASS_ALIGN
+#define ALLOC_CACHE_CLASSES SIZE_CLASSES
+#define ALLOC_CACHE_MAX SIZE_CLASS_MAX
+#define ALLOC_CACHE_DEPTH 32
+
+/*
+ * A thread's cached chunks of one size class. The chunks are still in the
+ * alloc lists, alloc() simply hands them back out.
+ */
+struct alloc_cache_bin
+{
+    unsigned int count;
+    unsigned long allocs;                /* Taken since alloc.c last looked */
+    void* chunks[ALLOC_CACHE_DEPTH];
+    void* blocks[ALLOC_CACHE_DEPTH];     /* Their blocks, for alloc.c */
+};
+
+/*
+ * A thread's cache of small chunks. Only alloc.c fills it and sets its
+ * budget, the bytes alloc() may take from it before going to the slow path.
+ * The budget runs out at the thread's next heap profile sample and is 0
+ * while tracing or lifetime prediction need to see every allocation. Turning
+ * either on moves alloc_cache_generation on, which takes back the budget of
+ * every thread whose generation no longer matches.
+ */
+struct alloc_cache
+{
+    size_t budget;
+    size_t granted;
+    unsigned long generation;
+    struct alloc_cache_bin bins[ALLOC_CACHE_CLASSES];
+};
+
+/* This thread's cache of small chunks */
+extern __thread struct alloc_cache alloc_thread_cache;
+
+/* Moved on to revoke every thread's cache budget */
+extern unsigned long alloc_cache_generation;
+
+/*
+ * Allocates the same as alloc without looking in the thread's cache. This is
+ * the part of alloc kept out of line.
+ */
+void* alloc_slow(size_t chunk_size);
+
 /*
  * Given the passed in size of memory that needs to be allocated, the free list
  * is traversed to see if it can fit it anywhere. If there is a chunk that can
  * hold the required data, it is added to the allocated list. If there is no
  * valid chunk found, then the memory is aquired using sbrk and added to the
  * allocation list.
+ *
+ * A small chunk is first taken from the thread's cache if there is one of its
+ * size class. This part is inlined into the caller, and the class is looked
+ * up in a constant table, so with a constant size it is a few instructions
+ * and no call.
+ */
+static inline void* alloc(size_t chunk_size)
+{
+    /* A size of 0 wraps around and misses the cache too */
+    if(chunk_size - 1 < ALLOC_CACHE_MAX)
+    {
+        unsigned int class = size_class_index[(chunk_size + 
+            ALLOC_CACHE_ALIGN - 1) / ALLOC_CACHE_ALIGN];
+        size_t size = size_class_sizes[class];
+        struct alloc_cache_bin* bin = &alloc_thread_cache.bins[class];
+
+        if(bin->count != 0 && alloc_thread_cache.budget >= size && 
+            alloc_thread_cache.generation == 
+            __atomic_load_n(&alloc_cache_generation, __ATOMIC_RELAXED))
+        {
+            alloc_thread_cache.budget -= size;
+            ++bin->allocs;
+            return bin->chunks[--bin->count];
+        }
+    }
+
+    return alloc_slow(chunk_size);
+}
+
+/*
+ * Allocates the same as alloc, counting the chunk against 'tag' until it is
+ * deallocated. A tag of 0 is the same as alloc. Each thread keeps its own
+ * counters for the tags it uses, so tagging costs the untagged chunks
+ * nothing. A chunk moved by ralloc keeps its tag.
  */
-void* alloc(size_t chunk_size);
+void* alloc_tagged(size_t chunk_size, uint16_t tag);
 
 /*
- * The allocated list is traversed to find the chunk that holds the pointer to
- * the data that needs to be free'd. If found, the chunk is moved to the free
- * list. If the chunk doesn't exist, the program terminates.
+ * A snapshot of the counters of a tag.
+ */
+struct tag_stats
+{
+    size_t bytes_live;      /* Bytes held by the tag's live chunks */
+    size_t peak_bytes;      /* Most bytes seen live (see set_tag_quota()) */
+    unsigned long allocs;   /* Chunks allocated with the tag */
+    unsigned long deallocs; /* Of those, chunks deallocated */
+    size_t quota;           /* The tag's soft quota, or 0 */
+};
+
+/*
+ * Fills in the passed in struct with a snapshot of the tag's counters, summed
+ * over every thread without taking any locks.
+ */
+void tag_stats(uint16_t tag, struct tag_stats* stats);
+
+/*
+ * Sets a soft quota on the live bytes of a tag, or 0 for none. Each time a
+ * thread has allocated another 64 KiB with the tag, the tag's live bytes are
+ * summed to update its peak and check its quota. Going over the quota is
+ * reported to the stats callback as an EVENT_TAG_QUOTA, once until it falls
+ * back under it, but the allocations still succeed.
+ */
+void set_tag_quota(uint16_t tag, size_t quota);
+
+/* Flags for alloc_flags() */
+#define ALLOC_CACHELINE_ISOLATED 0x1 /* Chunk sits alone on its cache lines */
+
+/*
+ * Allocates the same as alloc, placing the chunk as the flags ask. An
+ * isolated chunk starts on a cache line and is rounded up to whole lines, so
+ * nothing else is ever allocated on its lines. It stays isolated until it is
+ * moved by ralloc. It can be freed by dealloc_sized with the size asked for
+ * here, which its chunk stays listed under.
+ */
+void* alloc_flags(size_t chunk_size, unsigned int flags);
+
+/*
+ * Allocates an array of 'n' elements of 'size' bytes with every byte set to
+ * zero, returning NULL if the total size overflows. Memory that has come
+ * straight from the OS is already zero, so only recycled chunks are zeroed.
+ */
+void* zalloc(size_t n, size_t size);
+
+/*
+ * Each part of the allocated list is looked up to find the chunk that holds
+ * the pointer to the data that needs to be free'd. If found, the chunk is
+ * moved to the free list. If the chunk doesn't exist, the program terminates.
  */
 void dealloc(void* chunk);
 
+/*
+ * Deallocates a chunk the same as dealloc, but the caller passes in the size
+ * the chunk was allocated with (or last resized to by ralloc). Only the part
+ * of the allocated list holding chunks of that size is looked in, which is
+ * much faster, and the program terminates if the chunk isnt there. In debug
+ * builds the size is checked to be of the same size class (or multiple of 16)
+ * as the chunk was allocated with.
+ */
+void dealloc_sized(void* chunk, size_t chunk_size);
+
+/*
+ * Resizes the chunk to 'chunk_size' bytes, returning the chunk's new location.
+ * If the chunk's block is already large enough it is left where it is,
+ * otherwise its data is copied to a new chunk and the old one deallocated. A
+ * NULL chunk is allocated and a size of 0 deallocates the chunk.
+ */
+void* ralloc(void* chunk, size_t chunk_size);
+
+
+/* Flags for alloc_reserve() */
+#define RESERVE_PREFAULT 0x1 /* Fault in every page of the reserve up front */
+
+/*
+ * A bin of the size histogram passed to alloc_reserve_split(), 'count' chunks
+ * of 'size' bytes.
+ */
+struct reserve_class
+{
+    size_t size;
+    size_t count;
+};
+
+/*
+ * Grows the heap by 'bytes' up front and adds it to the freed list as a
+ * single chunk, along with spare metadata for the blocks split from it, so
+ * the allocations that follow are served from it without moving the program
+ * break. With RESERVE_PREFAULT the pages are faulted in too, so they dont
+ * page fault either. Returns 0 on success or -1 if 'bytes' is 0.
+ */
+int alloc_reserve(size_t bytes, int flags);
+
+/*
+ * As alloc_reserve(), but the reserve is split up front into chunks of the
+ * sizes in the histogram, with the counts scaled to fill 'bytes' while
+ * keeping their proportions. An allocation of exactly one of those sizes then
+ * takes a chunk without splitting. A 'bytes' of 0 reserves exactly the
+ * histogram, and anything left over goes into a single chunk after the rest.
+ *
+ * eg. {{32, 900}, {256, 100}} with 1 MiB splits it into 17347 chunks of 32
+ *     bytes and 1927 of 256 bytes.
+ *
+ * Returns 0 on success or -1 if the histogram is empty or invalid.
+ */
+int alloc_reserve_split(size_t bytes, int flags, 
+    const struct reserve_class* classes, int class_count);
+
+/*
+ * A handle to a relocatable chunk, or 0 for none.
+ */
+typedef unsigned int handle_t;
+
+/*
+ * Allocates a chunk the same as alloc, but behind a handle so compaction can
+ * move it while it isnt pinned. Returns 0 if the size is 0 or the handle
+ * table is full.
+ */
+handle_t halloc(size_t chunk_size);
+
+/*
+ * Pins the handle's chunk where it is and returns it. The chunk isnt moved
+ * until every pin is dropped with hunpin, and it can be pinned any number of
+ * times by any thread.
+ */
+void* hderef(handle_t handle);
+
+/*
+ * Drops a pin taken by hderef. The pointer it returned must not be used
+ * afterwards, as the chunk may have moved.
+ */
+void hunpin(handle_t handle);
+
+/*
+ * Deallocates the handle's chunk, which must not be pinned, and gives up the
+ * handle for reuse.
+ */
+void hfree(handle_t handle);
+
+/*
+ * Takes a step of compaction, moving the chunks of up to 4096 unpinned
+ * handles (and 'max_bytes' bytes) down into the lowest free block that fits
+ * them. The free blocks left behind are merged and those at the end of the
+ * heap handed back to the top chunk, moving the program break back once
+ * enough is free. Returns the bytes moved. While set_maintenance is running,
+ * the maintenance thread takes a step of 256 KiB every tick.
+ */
+size_t hcompact(size_t max_bytes);
@@ -0,0 +1,225 @@
+/*
+ * Implementation of backend.h
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include "alloc.h"
+#include "backend.h"
+
+/*
+ * The init functions of the malloc2 backends, which pick their stratergy.
+ */
+static void init_first()
+{
+    set_stratergy(FIRST);
+}
+
+static void init_best()
+{
+    set_stratergy(BEST);
+}
+
+static void init_worst()
+{
+    set_stratergy(WORST);
+}
+
+static void init_adaptive()
+{
+    set_stratergy(ADAPTIVE);
+}
+
+/*
+ * Stats of the malloc2 backends, taken from the totals of its lists and its
+ * counters.
+ */
+static void malloc2_stats(struct backend_stats* stats)
+{
+    struct list_summary summary;
+    struct alloc_stats counters;
+
+    list_summary(&summary);
+    alloc_stats(&counters);
+    stats->heap_bytes = summary.heap_size;
+    stats->peak_heap_bytes = counters.heap_peak;
+    stats->alloc_bytes = summary.alloc_bytes;
+    stats->freed_bytes = summary.freed_bytes;
+    stats->largest_freed = summary.largest_freed;
+    stats->grow_calls = counters.grow_calls;
+    stats->os_calls = counters.os_calls;
+}
+
+/*
+ * The system malloc has nothing to set up.
+ */
+static void init_system()
+{
+}
+
+/*
+ * The system malloc doesnt take a size when freeing.
+ */
+static void system_free_sized(void* chunk, size_t size)
+{
+    free(chunk);
+}
+
+/*
+ * Stats of the system malloc, taken from glibc's mallinfo when available.
+ */
+static void system_stats(struct backend_stats* stats)
+{
+    memset(stats, 0, sizeof(struct backend_stats));
+
+    #if defined(__GLIBC__) && __GLIBC_PREREQ(2, 33)
+    struct mallinfo2 info = mallinfo2();
+    stats->heap_bytes = info.arena + info.hblkhd;
+    stats->alloc_bytes = info.uordblks + info.hblkhd;
+    stats->freed_bytes = info.fordblks;
+    #endif
+}
+
+const struct backend backends[] = {
+    {"malloc2-first", init_first, alloc, zalloc, dealloc, dealloc_sized,
+        ralloc, malloc2_stats},
+    {"malloc2-best", init_best, alloc, zalloc, dealloc, dealloc_sized,
+        ralloc, malloc2_stats},
+    {"malloc2-worst", init_worst, alloc, zalloc, dealloc, dealloc_sized,
+        ralloc, malloc2_stats},
+    {"malloc2-adaptive", init_adaptive, alloc, zalloc, dealloc, dealloc_sized,
+        ralloc, malloc2_stats},
+    {"system", init_system, malloc, calloc, free, system_free_sized,
+        realloc, system_stats}
+};
+const int backend_count = sizeof(backends) / sizeof(backends[0]);
+
+/*
+ * Look through the table for the backend's name
+ */
+const struct backend* find_backend(const char* name)
+{
+    for(int i = 0; i < backend_count; ++i)
+    {
+        if(strcmp(backends[i].name, name) == 0)
+        {
+            return &backends[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Fork a child to do the run, reading its result back through a pipe
+ */
+int run_isolated(const struct backend* backend,
+    void (*run)(const struct backend* backend, struct backend_result* result),
+    struct backend_result* result)
+{
+    int fds[2];
+    int status;
+
+    if(pipe(fds) != 0)
+    {
+        return -1;
+    }
+
+    /* Anything still buffered would otherwise be printed by both processes */
+    fflush(stdout);
+
+    pid_t child = fork();
+    if(child < 0)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if(child == 0)
+    {
+        struct rusage usage;
+
+        close(fds[0]);
+        backend->init();
+        run(backend, result);
+
+        getrusage(RUSAGE_SELF, &usage);
+        result->max_rss_kb = usage.ru_maxrss;
+
+        int written = write(fds[1], result, sizeof(struct backend_result)) ==
+            sizeof(struct backend_result);
+        close(fds[1]);
+        _exit(written ? 0 : 1);
+    }
+
+    close(fds[1]);
+    ssize_t got = read(fds[0], result, sizeof(struct backend_result));
+    close(fds[0]);
+    waitpid(child, &status, 0);
+
+    if(got != sizeof(struct backend_result) || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Compare two latencies for qsort.
+ */
+static int compare_latency(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Latency at the passed in percentile of a sorted array.
+ */
+static uint64_t percentile(const uint64_t* sorted, size_t count, double pct)
+{
+    size_t index = (size_t) (pct / 100.0 * (count - 1) + 0.5);
+    return sorted[index < count ? index : count - 1];
+}
+
+/*
+ * Sort the latencies and read off the percentiles
+ */
+void fill_latencies(struct backend_result* result, uint64_t* latencies,
+    size_t count)
+{
+    if(count == 0)
+    {
+        result->p50 = result->p99 = result->p999 = result->max = 0;
+        return;
+    }
+
+    qsort(latencies, count, sizeof(uint64_t), compare_latency);
+
+    result->p50 = percentile(latencies, count, 50.0);
+    result->p99 = percentile(latencies, count, 99.0);
+    result->p999 = percentile(latencies, count, 99.9);
+    result->max = latencies[count - 1];
+}
+
+/*
+ * Print one row per backend
+ */
+void print_comparison(const struct backend** run_backends,
+    const struct backend_result* results, int count, const char* unit)
+{
+    printf("%-18s %12s %10s %10s %10s %12s %14s %12s\n", "backend", "ops/sec",
+        "p50", "p99", "p99.9", "max", "heap_bytes", "max_rss_kb");
+    for(int i = 0; i < count; ++i)
+    {
+        printf("%-18s %12.1f %10llu %10llu %10llu %12llu %14zu %12ld\n",
+            run_backends[i]->name, results[i].ops_per_sec, results[i].p50,
+            results[i].p99, results[i].p999, results[i].max,
+            results[i].heap_bytes, results[i].max_rss_kb);
+    }
+    printf("(latencies in %s)\n", unit);
+}
@@ -0,0 +1,109 @@
+/*
+ * Header file for backend.c - A table of allocators the benchmark and replay
+ * tools can run against, so malloc2's stratergys can be compared with each
+ * other and with the system malloc.
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/* Units of the per operation latencies */
+#if defined(__x86_64__) || defined(__i386__)
+#define LATENCY_UNIT "cycles"
+#else
+#define LATENCY_UNIT "ns"
+#endif
+
+/*
+ * Figures a backend can report about its heap. Any figure the backend cant
+ * provide is left as 0.
+ */
+struct backend_stats
+{
+    size_t heap_bytes;    /* Bytes the heap has been grown by */
+    size_t peak_heap_bytes; /* Most heap_bytes has been */
+    size_t alloc_bytes;   /* Bytes held by allocated chunks */
+    size_t freed_bytes;   /* Bytes free for reuse */
+    size_t largest_freed; /* Largest chunk free for reuse */
+    unsigned long grow_calls; /* Times the heap was asked to grow */
+    unsigned long os_calls;   /* Calls to sbrk or mmap to grow it */
+};
+
+/*
+ * An allocator that can be benchmarked.
+ */
+struct backend
+{
+    const char* name;
+    void (*init)();
+    void* (*alloc)(size_t size);
+    void* (*calloc)(size_t n, size_t size);
+    void (*free)(void* chunk);
+    void (*free_sized)(void* chunk, size_t size);
+    void* (*realloc)(void* chunk, size_t size);
+    void (*stats)(struct backend_stats* stats);
+};
+
+/*
+ * The results of a run, as passed back from run_isolated().
+ */
+struct backend_result
+{
+    double seconds;
+    double ops_per_sec;
+    unsigned long long p50;
+    unsigned long long p99;
+    unsigned long long p999;
+    unsigned long long max;
+    size_t heap_bytes;
+    long max_rss_kb;
+};
+
+/*
+ * Read the cycle counter, or a nanosecond clock when there isnt one.
+ */
+static inline uint64_t read_cycles()
+{
+    #if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+    #else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+    #endif
+}
+
+/* Every backend, with the malloc2 stratergys first and the system malloc last */
+extern const struct backend backends[];
+extern const int backend_count;
+
+/*
+ * Find a backend by name, returning NULL if there isnt one.
+ */
+const struct backend* find_backend(const char* name);
+
+/*
+ * Run 'run' against the backend in a child process, so every backend starts
+ * with a fresh heap and its peak RSS (read with getrusage) is its own. The
+ * result filled in by 'run' is passed back through a pipe, with max_rss_kb set
+ * after 'run' returns. Returns 0 on success or -1 if the child failed.
+ */
+int run_isolated(const struct backend* backend,
+    void (*run)(const struct backend* backend, struct backend_result* result),
+    struct backend_result* result);
+
+/*
+ * Sort the latencies of every operation in a run and fill in the percentiles
+ * of the result from them.
+ */
+void fill_latencies(struct backend_result* result, uint64_t* latencies,
+    size_t count);
+
+/*
+ * Print the results of every backend side by side.
+ */
+void print_comparison(const struct backend** run_backends,
+    const struct backend_result* results, int count, const char* unit);
@@ -0,0 +1,1273 @@
+/*
+ * Multi-threaded benchmark harness for the allocator.
+ *
+ * Each thread runs a workload of allocations and deallocations, timing every
+ * operation with the cycle counter. Once all of the threads are done, the
+ * throughput, latency percentiles, peak heap size and fragmentation of the
+ * lists are printed as JSON. The workloads are:
+ *
+ * random   - A mix of allocations and frees of random live chunks.
+ * larson   - Server churn, where each thread replaces random chunks of its
+ *            pool and hands the pool on to a new thread every round, so
+ *            chunks are freed by threads other than the one that made them.
+ * prodcons - Pairs of threads, one allocating chunks and passing them to the
+ *            other to free.
+ * realloc  - Buffers that keep growing with realloc until they are freed.
+ * strings  - Many short lived strings copied from the names file.
+ * frag     - Short lived chunks interleaved with long lived ones, leaving
+ *            holes the growing short lived chunks no longer fit.
+ * falseshare - Every thread allocates 'live' small chunks at the same time as
+ *              the others, then writes to them over and over. The chunks that
+ *              share a cache line with another thread's are counted, and -A
+ *              turns on thread pages to keep them apart.
+ *
+ * With -b, each of the listed backends (or all of them) is run in turn and
+ * their results are printed side by side, as is every workload with -w all.
+ *
+ * usage: bench.out [-w workload] [-t threads] [-n ops] [-m alloc%] [-d dist]
+ *                  [-s stratergy] [-b backends] [-l live] [-r seed] [-z]
+ *                  [-T trace] [-p profile] [-H dump] [-M interval[:decay]]
+ *                  [-R reserve] [-A] [-L]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include "alloc.h"
+#include "trace.h"
+#include "profile.h"
+#include "backend.h"
+
+/* Default values of the command line options */
+#define DEFAULT_THREADS 1
+#define DEFAULT_OPS 100000
+#define DEFAULT_MIX 50
+#define DEFAULT_LIVE 1024
+#define DEFAULT_DIST "uniform:8:512"
+#define DEFAULT_NAMES "data/first-names.txt"
+
+/* Most threads that can be asked for */
+#define MAX_THREADS 256
+
+/* Most backends that can be compared in one run */
+#define MAX_BACKENDS 16
+
+/* Times the pool of a larson thread is handed on to a new thread */
+#define LARSON_ROUNDS 8
+
+/* Most a realloc buffer grows to before it is freed and started again */
+#define REALLOC_MAX (64 * 1024)
+
+/* Strings each strings thread keeps before freeing the oldest */
+#define STRINGS_LIVE 16
+
+/* Pairs of short and long lived chunks allocated by each frag batch */
+#define FRAG_BATCH 64
+
+/* Chunks each falseshare thread allocates before letting the other threads
+ * run, and the writes to its chunks timed as one operation */
+#define SHARE_BURST 4
+#define SHARE_WRITES 64
+
+/* Size of a cache line, as counted by falseshare */
+#define CACHE_LINE 64
+
+/*
+ * The ways the size of each allocation can be picked.
+ *
+ * fixed   - Every allocation is the same size.
+ * uniform - Sizes are spread evenly between a min and max.
+ * names   - Sizes are the line lengths of a names file, as in main.c.
+ */
+enum dist_type{DIST_FIXED, DIST_UNIFORM, DIST_NAMES};
+
+/*
+ * A parsed size distribution.
+ */
+struct size_dist
+{
+    enum dist_type type;
+    size_t min;
+    size_t max;
+    size_t* sizes;  /* Sizes to pick from for DIST_NAMES */
+    char** lines;   /* Text of each line of the names file */
+    size_t count;
+};
+
+struct bench_thread;
+
+/*
+ * A workload, run by every benchmark thread until it has done 'ops'
+ * operations.
+ */
+struct workload
+{
+    const char* name;
+    void (*run)(struct bench_thread* thread);
+};
+
+/*
+ * Everything set on the command line.
+ */
+struct bench_config
+{
+    int threads;
+    long ops;
+    int mix;
+    long live;
+    unsigned int seed;
+    int sized;
+    const char* dist_name;
+    const char* stratergy_name;
+    const char* trace_path;
+    const char* profile_path;
+    const char* dump_path;
+    unsigned int maint_interval;
+    unsigned int maint_decay;
+    size_t reserve;
+    int thread_pages;
+    int lifetimes;
+    const struct workload* workload;
+    struct size_dist dist;
+    struct size_dist names;
+};
+
+/*
+ * State of a single benchmark thread. The chunks it is holding are kept in
+ * 'chunks' and 'sizes', and the latency of every operation it does is kept in
+ * 'latencies'.
+ *
+ * The ring holds the chunks a prodcons producer has passed to its consumer.
+ * The producer only writes 'ring_tail' and the consumer only 'ring_head'.
+ */
+struct bench_thread
+{
+    pthread_t id;
+    int index;
+    uint64_t rng;
+    void** chunks;
+    size_t* sizes;
+    long live_count;
+    uint64_t* latencies;
+    long ops_done;
+    double seconds;
+    void** ring;
+    size_t* ring_sizes;
+    size_t ring_head;
+    size_t ring_tail;
+};
+
+static struct bench_config config;
+
+/* Backend being benchmarked, and the threads running against it */
+static const struct backend* backend;
+static struct bench_thread* threads;
+
+/* Lets every thread start at the same time */
+static pthread_barrier_t start_barrier;
+
+/* Holds the falseshare threads until every chunk is allocated and counted,
+ * and the chunks it found sharing a cache line with another thread's (or -1
+ * if it wasnt run) */
+static pthread_barrier_t share_barrier;
+static long shared_chunks = -1;
+
+/*
+ * Seconds on the monotonic clock.
+ */
+static double now_seconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+ * Xorshift random number generator, so each thread has its own sequence
+ * without sharing any state.
+ */
+static uint64_t next_random(uint64_t* state)
+{
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+/*
+ * Pick the size of the next allocation from the distribution.
+ */
+static size_t pick_size(const struct size_dist* dist, uint64_t* rng)
+{
+    switch(dist->type)
+    {
+        case DIST_FIXED:
+            return dist->min;
+        case DIST_UNIFORM:
+            return dist->min + next_random(rng) % (dist->max - dist->min + 1);
+        case DIST_NAMES:
+            return dist->sizes[next_random(rng) % dist->count];
+    }
+    return dist->min;
+}
+
+/*
+ * Read the line lengths of the names file into the distribution, the same way
+ * main.c sizes its strings.
+ */
+static int load_names(struct size_dist* dist, const char* path)
+{
+    FILE* names = fopen(path, "r");
+    char* line = NULL;
+    size_t len = 0, capacity = 1024;
+    ssize_t read;
+
+    if(names == NULL)
+    {
+        return -1;
+    }
+
+    dist->sizes = malloc(capacity * sizeof(size_t));
+    dist->lines = malloc(capacity * sizeof(char*));
+    dist->count = 0;
+    while((read = getline(&line, &len, names)) > 0)
+    {
+        if(dist->count == capacity)
+        {
+            capacity *= 2;
+            dist->sizes = realloc(dist->sizes, capacity * sizeof(size_t));
+            dist->lines = realloc(dist->lines, capacity * sizeof(char*));
+        }
+        dist->lines[dist->count] = strdup(line);
+        dist->sizes[dist->count++] = read;
+    }
+
+    free(line);
+    fclose(names);
+    return dist->count > 0 ? 0 : -1;
+}
+
+/*
+ * Parse a distribution given as fixed:N, uniform:MIN:MAX or names[:PATH].
+ */
+static int parse_dist(struct size_dist* dist, const char* text)
+{
+    unsigned long min, max;
+
+    if(sscanf(text, "fixed:%lu", &min) == 1 && min > 0)
+    {
+        dist->type = DIST_FIXED;
+        dist->min = dist->max = min;
+        return 0;
+    }
+    if(sscanf(text, "uniform:%lu:%lu", &min, &max) == 2 && min > 0 &&
+        max >= min)
+    {
+        dist->type = DIST_UNIFORM;
+        dist->min = min;
+        dist->max = max;
+        return 0;
+    }
+    if(strncmp(text, "names", 5) == 0)
+    {
+        dist->type = DIST_NAMES;
+        return load_names(dist, text[5] == ':' ? text + 6 : DEFAULT_NAMES);
+    }
+    return -1;
+}
+
+/*
+ * Parse the name of a stratergy, returning -1 if it isnt one.
+ */
+static int parse_stratergy(const char* name, enum stratergy* stratergy)
+{
+    if(strcmp(name, "FIRST") == 0)
+    {
+        *stratergy = FIRST;
+    }
+    else if(strcmp(name, "BEST") == 0)
+    {
+        *stratergy = BEST;
+    }
+    else if(strcmp(name, "WORST") == 0)
+    {
+        *stratergy = WORST;
+    }
+    else if(strcmp(name, "ADAPTIVE") == 0)
+    {
+        *stratergy = ADAPTIVE;
+    }
+    else
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Parse a comma separated list of backend names (or 'all') into 'list',
+ * returning -1 if any of them isnt a backend.
+ */
+static int parse_backends(const char* names, const struct backend** list,
+    int* count)
+{
+    char buffer[256];
+
+    *count = 0;
+    if(strcmp(names, "all") == 0)
+    {
+        for(int i = 0; i < backend_count && i < MAX_BACKENDS; ++i)
+        {
+            list[(*count)++] = &backends[i];
+        }
+        return 0;
+    }
+
+    snprintf(buffer, sizeof(buffer), "%s", names);
+    for(char* name = strtok(buffer, ","); name != NULL;
+        name = strtok(NULL, ","))
+    {
+        const struct backend* found = find_backend(name);
+        if(found == NULL || *count == MAX_BACKENDS)
+        {
+            return -1;
+        }
+        list[(*count)++] = found;
+    }
+    return *count > 0 ? 0 : -1;
+}
+
+/*
+ * Record the latency of the thread's next operation.
+ */
+static void record_latency(struct bench_thread* thread, uint64_t before,
+    uint64_t after)
+{
+    thread->latencies[thread->ops_done++] = after - before;
+}
+
+/*
+ * Allocate a chunk from the backend, timing it as one operation. It is
+ * always inlined so every place a workload allocates is a call site of its
+ * own to lifetime prediction.
+ */
+static inline __attribute__((always_inline)) void* timed_alloc(
+    struct bench_thread* thread, size_t size)
+{
+    uint64_t before = read_cycles();
+    void* chunk = backend->alloc(size);
+    record_latency(thread, before, read_cycles());
+    return chunk;
+}
+
+/*
+ * Resize a chunk with the backend, timing it as one operation.
+ */
+static void* timed_realloc(struct bench_thread* thread, void* chunk,
+    size_t size)
+{
+    uint64_t before = read_cycles();
+    chunk = backend->realloc(chunk, size);
+    record_latency(thread, before, read_cycles());
+    return chunk;
+}
+
+/*
+ * Free a chunk to the backend, with its size if -z was passed, timing it as
+ * one operation.
+ */
+static void timed_free(struct bench_thread* thread, void* chunk, size_t size)
+{
+    uint64_t before = read_cycles();
+    if(config.sized)
+    {
+        backend->free_sized(chunk, size);
+    }
+    else
+    {
+        backend->free(chunk);
+    }
+    record_latency(thread, before, read_cycles());
+}
+
+/*
+ * Each operation is an allocation 'mix' percent of the time (or whenever
+ * nothing is live), and otherwise frees a random live chunk. An allocation is
+ * never made once 'live' chunks are held.
+ */
+static void workload_random(struct bench_thread* thread)
+{
+    while(thread->ops_done < config.ops)
+    {
+        uint64_t roll = next_random(&thread->rng);
+
+        if(thread->live_count == 0 || (thread->live_count < config.live &&
+            (long) (roll % 100) < config.mix))
+        {
+            size_t size = pick_size(&config.dist, &thread->rng);
+            thread->chunks[thread->live_count] = timed_alloc(thread, size);
+            thread->sizes[thread->live_count] = size;
+            ++thread->live_count;
+        }
+        else
+        {
+            /* Free a random chunk, moving the last chunk into its place */
+            long victim = (roll >> 8) % thread->live_count;
+            void* chunk = thread->chunks[victim];
+            size_t size = thread->sizes[victim];
+
+            --thread->live_count;
+            thread->chunks[victim] = thread->chunks[thread->live_count];
+            thread->sizes[victim] = thread->sizes[thread->live_count];
+
+            timed_free(thread, chunk, size);
+        }
+    }
+}
+
+/*
+ * A single round of larson, run on a thread of its own. It frees a random
+ * chunk of the pool and allocates a new one in its place until the round's
+ * share of the operations is done.
+ */
+static void* larson_round(void* arg)
+{
+    struct bench_thread* thread = arg;
+    long round_end = thread->ops_done + config.ops / LARSON_ROUNDS + 2;
+
+    if(round_end > config.ops - 1)
+    {
+        round_end = config.ops - 1;
+    }
+
+    while(thread->ops_done < round_end)
+    {
+        long victim = next_random(&thread->rng) % thread->live_count;
+
+        timed_free(thread, thread->chunks[victim], thread->sizes[victim]);
+        thread->sizes[victim] = pick_size(&config.dist, &thread->rng);
+        thread->chunks[victim] = timed_alloc(thread, thread->sizes[victim]);
+    }
+
+    return 0;
+}
+
+/*
+ * Fill the pool with 'live' chunks, then hand it on to a new thread for each
+ * of LARSON_ROUNDS rounds.
+ */
+static void workload_larson(struct bench_thread* thread)
+{
+    while(thread->live_count < config.live && thread->ops_done < config.ops)
+    {
+        size_t size = pick_size(&config.dist, &thread->rng);
+        thread->chunks[thread->live_count] = timed_alloc(thread, size);
+        thread->sizes[thread->live_count] = size;
+        ++thread->live_count;
+    }
+
+    while(thread->ops_done < config.ops - 1)
+    {
+        pthread_t round;
+        if(pthread_create(&round, NULL, larson_round, thread) != 0 ||
+            pthread_join(round, NULL) != 0)
+        {
+            perror("Can not run larson round");
+            exit(1);
+        }
+    }
+}
+
+/*
+ * Pass a chunk to the ring, returning 0 if it is full.
+ */
+static int ring_push(struct bench_thread* ring, void* chunk, size_t size)
+{
+    size_t tail = ring->ring_tail;
+    if(tail - __atomic_load_n(&ring->ring_head, __ATOMIC_ACQUIRE) ==
+        (size_t) config.live)
+    {
+        return 0;
+    }
+
+    ring->ring[tail % config.live] = chunk;
+    ring->ring_sizes[tail % config.live] = size;
+    __atomic_store_n(&ring->ring_tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/*
+ * Take the oldest chunk from the ring, returning 0 if it is empty.
+ */
+static int ring_pop(struct bench_thread* ring, void** chunk, size_t* size)
+{
+    size_t head = ring->ring_head;
+    if(head == __atomic_load_n(&ring->ring_tail, __ATOMIC_ACQUIRE))
+    {
+        return 0;
+    }
+
+    *chunk = ring->ring[head % config.live];
+    *size = ring->ring_sizes[head % config.live];
+    __atomic_store_n(&ring->ring_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/*
+ * Even threads produce chunks into their ring and the odd thread after them
+ * consumes and frees them. Both do 'ops' operations, waiting whenever the
+ * ring is full or empty. Without a partner, a thread consumes its own chunks
+ * whenever its ring fills up.
+ */
+static void workload_prodcons(struct bench_thread* thread)
+{
+    void* chunk;
+    size_t size;
+
+    if(thread->index % 2 == 1)
+    {
+        struct bench_thread* producer = &threads[thread->index - 1];
+        while(thread->ops_done < config.ops)
+        {
+            if(ring_pop(producer, &chunk, &size))
+            {
+                timed_free(thread, chunk, size);
+            }
+            else
+            {
+                sched_yield();
+            }
+        }
+        return;
+    }
+
+    int solo = thread->index + 1 == config.threads;
+    while(thread->ops_done < config.ops)
+    {
+        size = pick_size(&config.dist, &thread->rng);
+        chunk = timed_alloc(thread, size);
+
+        while(!ring_push(thread, chunk, size))
+        {
+            void* oldest;
+            size_t oldest_size;
+
+            if(!solo)
+            {
+                sched_yield();
+            }
+            else if(ring_pop(thread, &oldest, &oldest_size))
+            {
+                if(thread->ops_done < config.ops)
+                {
+                    timed_free(thread, oldest, oldest_size);
+                }
+                else
+                {
+                    backend->free(oldest);
+                }
+            }
+        }
+    }
+
+    /* Without a partner, nothing else will free what is left in the ring */
+    while(solo && ring_pop(thread, &chunk, &size))
+    {
+        backend->free(chunk);
+    }
+}
+
+/*
+ * Each operation grows a random buffer by half again with realloc, or frees
+ * it once it would grow past REALLOC_MAX so it starts again from the
+ * distribution. The last byte of each buffer is written to, as a buffer being
+ * filled would be.
+ */
+static void workload_realloc(struct bench_thread* thread)
+{
+    while(thread->ops_done < config.ops)
+    {
+        long slot = next_random(&thread->rng) % config.live;
+
+        if(slot >= thread->live_count)
+        {
+            slot = thread->live_count++;
+            thread->sizes[slot] = pick_size(&config.dist, &thread->rng);
+            thread->chunks[slot] = timed_alloc(thread, thread->sizes[slot]);
+        }
+        else if(thread->sizes[slot] + thread->sizes[slot] / 2 > REALLOC_MAX)
+        {
+            timed_free(thread, thread->chunks[slot], thread->sizes[slot]);
+
+            --thread->live_count;
+            thread->chunks[slot] = thread->chunks[thread->live_count];
+            thread->sizes[slot] = thread->sizes[thread->live_count];
+            continue;
+        }
+        else
+        {
+            thread->sizes[slot] += thread->sizes[slot] / 2 + 1;
+            thread->chunks[slot] = timed_realloc(thread, thread->chunks[slot],
+                thread->sizes[slot]);
+        }
+
+        ((char*) thread->chunks[slot])[thread->sizes[slot] - 1] = 0;
+    }
+}
+
+/*
+ * Each string is a random line of the names file copied into a chunk of its
+ * length, as main.c does. Only the last STRINGS_LIVE strings are kept, with
+ * the oldest freed as each new one is made.
+ */
+static void workload_strings(struct bench_thread* thread)
+{
+    const struct size_dist* names = &config.names;
+    long oldest = 0;
+
+    while(thread->ops_done < config.ops)
+    {
+        long slot = thread->live_count % STRINGS_LIVE;
+
+        if(thread->live_count - oldest == STRINGS_LIVE)
+        {
+            timed_free(thread, thread->chunks[slot], thread->sizes[slot]);
+            ++oldest;
+            continue;
+        }
+
+        size_t line = next_random(&thread->rng) % names->count;
+        thread->sizes[slot] = names->sizes[line];
+        thread->chunks[slot] = timed_alloc(thread, thread->sizes[slot]);
+        memcpy(thread->chunks[slot], names->lines[line], thread->sizes[slot]);
+        ++thread->live_count;
+    }
+}
+
+/*
+ * Each batch allocates FRAG_BATCH pairs of a short lived chunk and a small
+ * long lived chunk, then frees the short lived ones. The short lived chunks
+ * get bigger every batch, so the holes they leave between the long lived
+ * chunks are too small to reuse. Once 'live' long lived chunks are held, a
+ * random one is freed to make room for each new one.
+ */
+static void workload_frag(struct bench_thread* thread)
+{
+    void* batch[FRAG_BATCH];
+    size_t batch_sizes[FRAG_BATCH];
+
+    for(long round = 0; thread->ops_done < config.ops; ++round)
+    {
+        int count = 0;
+
+        while(count < FRAG_BATCH && thread->ops_done < config.ops)
+        {
+            batch_sizes[count] = pick_size(&config.dist, &thread->rng) *
+                (1 + round % 4);
+            batch[count] = timed_alloc(thread, batch_sizes[count]);
+            ++count;
+
+            if(thread->live_count == config.live)
+            {
+                long victim = next_random(&thread->rng) % thread->live_count;
+
+                --thread->live_count;
+                if(thread->ops_done < config.ops)
+                {
+                    timed_free(thread, thread->chunks[victim],
+                        thread->sizes[victim]);
+                }
+                else
+                {
+                    backend->free(thread->chunks[victim]);
+                }
+                thread->chunks[victim] = thread->chunks[thread->live_count];
+                thread->sizes[victim] = thread->sizes[thread->live_count];
+            }
+            if(thread->ops_done < config.ops)
+            {
+                size_t size = 16 + next_random(&thread->rng) % 49;
+                thread->chunks[thread->live_count] = timed_alloc(thread, size);
+                thread->sizes[thread->live_count] = size;
+                ++thread->live_count;
+            }
+        }
+
+        for(int i = 0; i < count; ++i)
+        {
+            if(thread->ops_done < config.ops)
+            {
+                timed_free(thread, batch[i], batch_sizes[i]);
+            }
+            else
+            {
+                backend->free(batch[i]);
+            }
+        }
+    }
+}
+
+/*
+ * A chunk of a falseshare thread, as sorted by count_shared().
+ */
+struct share_chunk
+{
+    uintptr_t start;
+    uintptr_t end;
+    int thread;
+    int shared;
+};
+
+/*
+ * Order falseshare chunks by address.
+ */
+static int compare_share_chunk(const void* a, const void* b)
+{
+    uintptr_t left = ((const struct share_chunk*) a)->start;
+    uintptr_t right = ((const struct share_chunk*) b)->start;
+    return (left > right) - (left < right);
+}
+
+/*
+ * Count the chunks of every thread that share a cache line with a chunk of
+ * another thread.
+ */
+static long count_shared()
+{
+    long total = 0, shared = 0;
+    for(int i = 0; i < config.threads; ++i)
+    {
+        total += threads[i].live_count;
+    }
+
+    struct share_chunk* chunks = malloc(total * sizeof(struct share_chunk));
+    long count = 0;
+    for(int i = 0; i < config.threads; ++i)
+    {
+        for(long j = 0; j < threads[i].live_count; ++j)
+        {
+            chunks[count].start = (uintptr_t) threads[i].chunks[j];
+            chunks[count].end = chunks[count].start + threads[i].sizes[j];
+            chunks[count].thread = i;
+            chunks[count].shared = 0;
+            ++count;
+        }
+    }
+    qsort(chunks, count, sizeof(struct share_chunk), compare_share_chunk);
+
+    /* Only the chunks starting on or before a chunk's last line can share it */
+    for(long i = 0; i < count; ++i)
+    {
+        uintptr_t last_line = (chunks[i].end - 1) / CACHE_LINE;
+        for(long j = i + 1; j < count && 
+            chunks[j].start / CACHE_LINE <= last_line; ++j)
+        {
+            if(chunks[j].thread != chunks[i].thread)
+            {
+                chunks[i].shared = chunks[j].shared = 1;
+            }
+        }
+        shared += chunks[i].shared;
+    }
+
+    free(chunks);
+    return shared;
+}
+
+/*
+ * Allocate 'live' chunks, a few at a time so the threads' allocations are
+ * interleaved, freeing a random one of them as every other chunk is made so
+ * the threads reuse each other's memory. Once every thread is done (and the
+ * shared chunks are counted) write to a byte of each chunk in turn,
+ * SHARE_WRITES writes at a time.
+ */
+static void workload_falseshare(struct bench_thread* thread)
+{
+    for(long made = 1; thread->live_count < config.live; ++made)
+    {
+        size_t size = pick_size(&config.dist, &thread->rng);
+        thread->chunks[thread->live_count] = backend->alloc(size);
+        thread->sizes[thread->live_count] = size;
+        ++thread->live_count;
+
+        if(made % 2 == 0)
+        {
+            long victim = next_random(&thread->rng) % thread->live_count;
+
+            --thread->live_count;
+            backend->free(thread->chunks[victim]);
+            thread->chunks[victim] = thread->chunks[thread->live_count];
+            thread->sizes[victim] = thread->sizes[thread->live_count];
+        }
+        if(made % SHARE_BURST == 0)
+        {
+            sched_yield();
+        }
+    }
+
+    pthread_barrier_wait(&share_barrier);
+    if(thread->index == 0)
+    {
+        shared_chunks = count_shared();
+    }
+    pthread_barrier_wait(&share_barrier);
+
+    long next = 0;
+    while(thread->ops_done < config.ops)
+    {
+        uint64_t before = read_cycles();
+        for(int i = 0; i < SHARE_WRITES; ++i)
+        {
+            ++*(volatile char*) thread->chunks[next];
+            next = next + 1 < thread->live_count ? next + 1 : 0;
+        }
+        record_latency(thread, before, read_cycles());
+    }
+}
+
+/* Every workload, in the order -w all runs them */
+static const struct workload workloads[] = {
+    {"random", workload_random},
+    {"larson", workload_larson},
+    {"prodcons", workload_prodcons},
+    {"realloc", workload_realloc},
+    {"strings", workload_strings},
+    {"frag", workload_frag},
+    {"falseshare", workload_falseshare}
+};
+static const int workload_count = sizeof(workloads) / sizeof(workloads[0]);
+
+/*
+ * The benchmark thread, which waits for every other thread to be ready and
+ * then runs the workload.
+ */
+static void* bench_thread_func(void* arg)
+{
+    struct bench_thread* thread = arg;
+
+    pthread_barrier_wait(&start_barrier);
+
+    double start = now_seconds();
+    config.workload->run(thread);
+    thread->seconds = now_seconds() - start;
+
+    return 0;
+}
+
+/*
+ * Run the benchmark threads against the backend and fill in the result.
+ */
+static void run_bench(const struct backend* run_backend,
+    struct backend_result* result)
+{
+    struct backend_stats stats;
+
+    backend = run_backend;
+
+    /* The harness's own memory comes from the system allocator, so it doesnt
+     * show up in the figures of the allocator being measured */
+    threads = calloc(config.threads, sizeof(struct bench_thread));
+    for(int i = 0; i < config.threads; ++i)
+    {
+        threads[i].index = i;
+        threads[i].rng = ((uint64_t) config.seed << 16) ^ (i + 1) *
+            0x9E3779B97F4A7C15ULL;
+        threads[i].chunks = malloc(config.live * sizeof(void*));
+        threads[i].sizes = malloc(config.live * sizeof(size_t));
+        threads[i].latencies = malloc(config.ops * sizeof(uint64_t));
+        threads[i].ring = malloc(config.live * sizeof(void*));
+        threads[i].ring_sizes = malloc(config.live * sizeof(size_t));
+    }
+
+    pthread_barrier_init(&start_barrier, NULL, config.threads);
+    pthread_barrier_init(&share_barrier, NULL, config.threads);
+
+    if(config.trace_path != NULL && trace_start(config.trace_path) != 0)
+    {
+        perror("Can't start trace");
+        exit(1);
+    }
+    if(config.profile_path != NULL)
+    {
+        set_heap_profile_rate(PROFILE_DEFAULT_RATE);
+    }
+    if(config.maint_interval > 0 && 
+        set_maintenance(config.maint_interval, config.maint_decay) != 0)
+    {
+        perror("Can't start maintenance thread");
+        exit(1);
+    }
+    if(config.reserve > 0 && alloc_reserve(config.reserve, RESERVE_PREFAULT))
+    {
+        perror("Can't reserve heap");
+        exit(1);
+    }
+    set_thread_pages(config.thread_pages);
+    if(config.lifetimes && set_lifetime_prediction(1) != 0)
+    {
+        perror("Can't start lifetime prediction");
+        exit(1);
+    }
+
+    double start = now_seconds();
+    for(int i = 0; i < config.threads; ++i)
+    {
+        if(pthread_create(&threads[i].id, NULL, bench_thread_func,
+            &threads[i]) != 0)
+        {
+            perror("Can not create thread");
+            exit(1);
+        }
+    }
+    for(int i = 0; i < config.threads; ++i)
+    {
+        if(pthread_join(threads[i].id, NULL) != 0)
+        {
+            perror("Can not join thread");
+        }
+    }
+    result->seconds = now_seconds() - start;
+
+    if(config.trace_path != NULL && trace_stop() != 0)
+    {
+        perror("Can't write trace");
+        exit(1);
+    }
+    if(config.profile_path != NULL && heap_profile_dump(config.profile_path))
+    {
+        perror("Can't write heap profile");
+        exit(1);
+    }
+    if(config.dump_path != NULL)
+    {
+        int fd = open(config.dump_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd < 0 || heap_dump(fd) != 0)
+        {
+            perror("Can't write heap dump");
+            exit(1);
+        }
+        close(fd);
+    }
+
+    /* Merge every thread's latencies so the percentiles cover all of them */
+    size_t total_ops = 0;
+    uint64_t* latencies = malloc(config.threads * config.ops *
+        sizeof(uint64_t));
+    for(int i = 0; i < config.threads; ++i)
+    {
+        memcpy(latencies + total_ops, threads[i].latencies,
+            threads[i].ops_done * sizeof(uint64_t));
+        total_ops += threads[i].ops_done;
+    }
+    fill_latencies(result, latencies, total_ops);
+
+    backend->stats(&stats);
+
+    result->ops_per_sec = total_ops / result->seconds;
+    result->heap_bytes = stats.heap_bytes;
+    result->max_rss_kb = 0;
+
+    free(latencies);
+}
+
+/*
+ * Print the results of a single run as JSON.
+ */
+static void print_json(const struct backend_result* result)
+{
+    struct backend_stats stats;
+    struct rusage usage;
+
+    backend->stats(&stats);
+    getrusage(RUSAGE_SELF, &usage);
+
+    printf("{\n");
+    printf("  \"workload\": \"%s\",\n", config.workload->name);
+    printf("  \"backend\": \"%s\",\n", backend->name);
+    printf("  \"threads\": %d,\n", config.threads);
+    printf("  \"ops_per_thread\": %ld,\n", config.ops);
+    printf("  \"alloc_percent\": %d,\n", config.mix);
+    printf("  \"distribution\": \"%s\",\n", config.dist_name);
+    printf("  \"dealloc\": \"%s\",\n", config.sized ? "sized" : "unsized");
+    printf("  \"seed\": %u,\n", config.seed);
+    printf("  \"wall_seconds\": %.6f,\n", result->seconds);
+    printf("  \"ops_per_sec\": %.1f,\n", result->ops_per_sec);
+    printf("  \"per_thread\": [\n");
+    for(int i = 0; i < config.threads; ++i)
+    {
+        printf("    {\"thread\": %d, \"ops\": %ld, \"seconds\": %.6f, "
+            "\"ops_per_sec\": %.1f}%s\n", i, threads[i].ops_done,
+            threads[i].seconds, threads[i].ops_done / threads[i].seconds,
+            i + 1 < config.threads ? "," : "");
+    }
+    printf("  ],\n");
+    printf("  \"latency\": {\"unit\": \"%s\", \"p50\": %llu, \"p99\": %llu, "
+        "\"p99.9\": %llu, \"max\": %llu},\n", LATENCY_UNIT, result->p50,
+        result->p99, result->p999, result->max);
+    if(shared_chunks >= 0)
+    {
+        printf("  \"shared_line_chunks\": %ld,\n", shared_chunks);
+    }
+    printf("  \"heap_bytes\": %zu,\n", stats.heap_bytes);
+    printf("  \"peak_heap_bytes\": %zu,\n", stats.peak_heap_bytes);
+    printf("  \"max_rss_kb\": %ld,\n", usage.ru_maxrss);
+    printf("  \"heap_grows\": {\"calls\": %lu, \"os_calls\": %lu},\n",
+        stats.grow_calls, stats.os_calls);
+    printf("  \"fragmentation\": {\"alloc_bytes\": %zu, \"freed_bytes\": %zu, "
+        "\"largest_freed\": %zu, \"external\": %.6f}\n",
+        stats.alloc_bytes, stats.freed_bytes, stats.largest_freed,
+        stats.freed_bytes && stats.largest_freed ? 1.0 -
+            (double) stats.largest_freed / stats.freed_bytes : 0.0);
+    printf("}\n");
+}
+
+/*
+ * Print the usage message and exit.
+ */
+static void usage(const char* name)
+{
+    printf("usage: %s [-w workload] [-t threads] [-n ops] [-m alloc%%] "
+        "[-d dist]\n"
+        "       [-s stratergy] [-b backends] [-l live] [-r seed] [-z] "
+        "[-T trace] [-p profile] [-H dump]\n"
+        "       [-M interval[:decay]] [-R reserve] [-A] [-L]\n"
+        "  -w  workload to run, or 'all' (default random)\n"
+        "  -t  threads to run (default %d)\n"
+        "  -n  operations per thread (default %d)\n"
+        "  -m  percentage of operations that allocate, for random "
+        "(default %d)\n"
+        "  -d  size distribution: fixed:N, uniform:MIN:MAX or names[:PATH]\n"
+        "      (default %s)\n"
+        "  -s  FIRST, BEST, WORST or ADAPTIVE (default FIRST)\n"
+        "  -b  comma separated backends to compare, or 'all'\n"
+        "  -l  most chunks each thread holds at once (default %d)\n"
+        "  -r  random seed (default time based)\n"
+        "  -z  free with the size of the chunk (dealloc_sized)\n"
+        "  -T  record a trace of the run to this file\n"
+        "  -p  write a sampled heap profile of the run to this file\n"
+        "  -H  write a heap dump to this file at the end of the run\n"
+        "  -M  run the maintenance thread every interval ms, purging chunks\n"
+        "      idle for decay ms (default 10 intervals)\n"
+        "  -R  reserve and prefault this many bytes of heap before the run\n"
+        "  -A  carve each thread's small chunks from thread pages of its own\n"
+        "  -L  place chunks predicted to be short lived in regions of their "
+        "own\n",
+        name, DEFAULT_THREADS, DEFAULT_OPS, DEFAULT_MIX, DEFAULT_DIST,
+        DEFAULT_LIVE);
+    printf("workloads:");
+    for(int i = 0; i < workload_count; ++i)
+    {
+        printf(" %s", workloads[i].name);
+    }
+    printf("\nbackends:");
+    for(int i = 0; i < backend_count; ++i)
+    {
+        printf(" %s", backends[i].name);
+    }
+    printf("\n");
+    exit(1);
+}
+
+/*
+ * Main.
+ */
+int main(int argc, char* argv[])
+{
+    const struct backend* run_backends[MAX_BACKENDS];
+    struct backend_result results[MAX_BACKENDS];
+    int run_count = 0;
+    const char* backend_names = NULL;
+    const char* workload_name = "random";
+    const struct workload* run_workloads[sizeof(workloads) /
+        sizeof(workloads[0])];
+    int workload_run_count = 0;
+    int opt;
+
+    config.threads = DEFAULT_THREADS;
+    config.ops = DEFAULT_OPS;
+    config.mix = DEFAULT_MIX;
+    config.live = DEFAULT_LIVE;
+    config.seed = time(0);
+    config.sized = 0;
+    config.dist_name = DEFAULT_DIST;
+    config.stratergy_name = "FIRST";
+    config.trace_path = NULL;
+    config.profile_path = NULL;
+    config.dump_path = NULL;
+    config.maint_interval = 0;
+    config.reserve = 0;
+    config.thread_pages = 0;
+    config.lifetimes = 0;
+
+    while((opt = getopt(argc, argv, "w:t:n:m:d:s:b:l:r:zT:p:H:M:R:ALh")) != -1)
+    {
+        switch(opt)
+        {
+            case 'w':
+                workload_name = optarg;
+                break;
+            case 't':
+                config.threads = atoi(optarg);
+                break;
+            case 'n':
+                config.ops = atol(optarg);
+                break;
+            case 'm':
+                config.mix = atoi(optarg);
+                break;
+            case 'd':
+                config.dist_name = optarg;
+                break;
+            case 's':
+                config.stratergy_name = optarg;
+                break;
+            case 'b':
+                backend_names = optarg;
+                break;
+            case 'l':
+                config.live = atol(optarg);
+                break;
+            case 'r':
+                config.seed = strtoul(optarg, NULL, 10);
+                break;
+            case 'z':
+                config.sized = 1;
+                break;
+            case 'T':
+                config.trace_path = optarg;
+                break;
+            case 'p':
+                config.profile_path = optarg;
+                break;
+            case 'H':
+                config.dump_path = optarg;
+                break;
+            case 'M':
+                if(sscanf(optarg, "%u:%u", &config.maint_interval,
+                    &config.maint_decay) == 1)
+                {
+                    config.maint_decay = config.maint_interval * 10;
+                }
+                break;
+            case 'R':
+                config.reserve = strtoul(optarg, NULL, 10);
+                break;
+            case 'A':
+                config.thread_pages = 1;
+                break;
+            case 'L':
+                config.lifetimes = 1;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    if(config.threads < 1 || config.threads > MAX_THREADS || config.ops < 1 ||
+        config.mix < 0 || config.mix > 100 || config.live < 1)
+    {
+        usage(argv[0]);
+    }
+    if(parse_dist(&config.dist, config.dist_name) != 0)
+    {
+        printf("Error: distribution '%s' not valid.\n", config.dist_name);
+        exit(1);
+    }
+
+    for(int i = 0; i < workload_count; ++i)
+    {
+        if(strcmp(workload_name, "all") == 0 ||
+            strcmp(workload_name, workloads[i].name) == 0)
+        {
+            run_workloads[workload_run_count++] = &workloads[i];
+        }
+    }
+    if(workload_run_count == 0)
+    {
+        printf("Error: workload '%s' not valid.\n", workload_name);
+        exit(1);
+    }
+
+    /* The strings workload copies the text of the names file, whatever the
+     * size distribution is */
+    if(parse_dist(&config.names, "names") != 0)
+    {
+        config.names.count = 0;
+        for(int i = 0; i < workload_run_count; ++i)
+        {
+            if(run_workloads[i]->run == workload_strings)
+            {
+                printf("Error: can't read %s.\n", DEFAULT_NAMES);
+                exit(1);
+            }
+        }
+    }
+
+    /* Without -b, the malloc2 backend for the -s stratergy is run (the malloc2
+     * backends are in the same order as the stratergys) */
+    if(backend_names == NULL)
+    {
+        enum stratergy stratergy;
+        if(parse_stratergy(config.stratergy_name, &stratergy) != 0)
+        {
+            printf("Error: stratergy '%s' not valid.\n", config.stratergy_name);
+            exit(1);
+        }
+        run_backends[run_count++] = &backends[stratergy];
+    }
+    else if(parse_backends(backend_names, run_backends, &run_count) != 0)
+    {
+        printf("Error: backends '%s' not valid.\n", backend_names);
+        exit(1);
+    }
+
+    /* A single backend and workload is run in process and reported in full,
+     * while anything more is each run in a child of its own and compared side
+     * by side */
+    if(run_count == 1 && workload_run_count == 1)
+    {
+        struct backend_result result;
+
+        config.workload = run_workloads[0];
+        run_backends[0]->init();
+        run_bench(run_backends[0], &result);
+        print_json(&result);
+        return 0;
+    }
+
+    if(config.trace_path != NULL || config.profile_path != NULL ||
+        config.dump_path != NULL)
+    {
+        printf("Error: a trace, profile or heap dump can only be recorded of "
+            "a single backend.\n");
+        exit(1);
+    }
+    for(int w = 0; w < workload_run_count; ++w)
+    {
+        config.workload = run_workloads[w];
+        for(int i = 0; i < run_count; ++i)
+        {
+            if(run_isolated(run_backends[i], run_bench, &results[i]) != 0)
+            {
+                printf("Error: backend '%s' failed.\n",
+                    run_backends[i]->name);
+                exit(1);
+            }
+        }
+
+        printf("%sworkload: %s (%d threads)\n", w > 0 ? "\n" : "",
+            config.workload->name, config.threads);
+        print_comparison(run_backends, results, run_count, LATENCY_UNIT);
+    }
+
+    return 0;
+}
@@ -0,0 +1,421 @@
+/*
+ * Chooses the size classes of the thread cache from a histogram of the sizes
+ * a program allocates, and writes them out as the sizeclass.h the allocator
+ * is compiled with.
+ *
+ * Each input is either a trace recorded by trace.c, whose allocations are
+ * counted, or a text histogram with a size and optionally a count (1 if it is
+ * left out) on each line. The sizes of up to the largest class are put in
+ * buckets of SIZE_ALIGN bytes, and the classes that waste the fewest bytes
+ * rounding up every counted allocation are found by dynamic programming over
+ * the buckets. The largest class is always the -m size, so every size up to
+ * it has a class.
+ *
+ * usage: classopt.out [-k classes] [-m max] [-o header] input...
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <float.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "trace.h"
+
+/* Every chunk is a multiple of this many bytes, so classes are as well */
+#define SIZE_ALIGN 16
+
+/* Default and most classes, and default and largest size of the last class.
+ * The class of a size is kept in an unsigned char and the sizes of the
+ * classes in unsigned shorts */
+#define DEFAULT_CLASSES 16
+#define MAX_CLASSES 64
+#define DEFAULT_MAX 512
+#define MAX_MAX 4096
+#define BUCKETS (MAX_MAX / SIZE_ALIGN + 1)
+
+/* Weight given to each bucket as well as its counted allocations, so classes
+ * left over once the counted sizes are covered are spread over the sizes
+ * that werent seen rather than bunched together */
+#define PRIOR_WEIGHT 0.001
+
+/* Numbers in a row of the generated tables */
+#define TABLE_ROW 12
+
+/*
+ * Allocations counted in one bucket. 'bytes' is the sum of their sizes, so
+ * the bytes wasted rounding them up to a class can be worked out without
+ * keeping each size.
+ */
+struct bucket
+{
+    double count;
+    double bytes;
+};
+
+static struct bucket buckets[BUCKETS];
+
+/* Allocations counted, and of those the ones too big for any class */
+static uint64_t total_count = 0;
+static uint64_t over_count = 0;
+
+/*
+ * Count 'count' allocations of 'size' bytes.
+ */
+static void add_size(uint64_t size, uint64_t count, int max)
+{
+    if(size == 0 || count == 0)
+    {
+        return;
+    }
+
+    total_count += count;
+    if(size > (uint64_t) max)
+    {
+        over_count += count;
+        return;
+    }
+
+    struct bucket* bucket = &buckets[(size + SIZE_ALIGN - 1) / SIZE_ALIGN];
+    bucket->count += count;
+    bucket->bytes += (double) size * count;
+}
+
+/*
+ * Count the allocations of a trace file. Returns 0 if it isnt a trace, or -1
+ * if it is one that cant be read.
+ */
+static int read_trace(const char* path, int max)
+{
+    struct stat info;
+    int fd = open(path, O_RDONLY);
+    if(fd < 0 || fstat(fd, &info) != 0)
+    {
+        perror("Can't open input");
+        exit(1);
+    }
+
+    struct trace_header header;
+    if((size_t) info.st_size < sizeof(header) ||
+        read(fd, &header, sizeof(header)) != sizeof(header) ||
+        memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0)
+    {
+        close(fd);
+        return 0;
+    }
+    if(header.version != TRACE_VERSION ||
+        header.record_size != sizeof(struct trace_record))
+    {
+        close(fd);
+        return -1;
+    }
+
+    const char* map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(map == MAP_FAILED)
+    {
+        perror("Can't map trace");
+        exit(1);
+    }
+    const struct trace_record* records =
+        (const struct trace_record*) (map + sizeof(struct trace_header));
+    size_t count = (info.st_size - sizeof(struct trace_header)) /
+        sizeof(struct trace_record);
+
+    for(size_t i = 0; i < count; ++i)
+    {
+        if(records[i].op == TRACE_ALLOC || records[i].op == TRACE_ZALLOC)
+        {
+            add_size(records[i].size, 1, max);
+        }
+    }
+
+    munmap((void*) map, info.st_size);
+    close(fd);
+    return 1;
+}
+
+/*
+ * Count the allocations of a text histogram, one size and count to a line.
+ * Blank lines and lines starting with a '#' are skipped. Returns -1 if a
+ * line couldnt be read.
+ */
+static int read_histogram(const char* path, int max)
+{
+    FILE* file = fopen(path, "r");
+    char line[256];
+    int number = 0;
+
+    if(file == NULL)
+    {
+        perror("Can't open input");
+        exit(1);
+    }
+
+    while(fgets(line, sizeof(line), file) != NULL)
+    {
+        unsigned long long size, count = 1;
+        char* start = line + strspn(line, " \t");
+
+        ++number;
+        if(*start == '#' || *start == '\n' || *start == '\0')
+        {
+            continue;
+        }
+        if(sscanf(start, "%llu %llu", &size, &count) < 1)
+        {
+            printf("Error: line %d of '%s' isnt a size and count.\n", number,
+                path);
+            fclose(file);
+            return -1;
+        }
+        add_size(size, count, max);
+    }
+
+    fclose(file);
+    return 0;
+}
+
+/*
+ * Bytes wasted rounding the allocations of buckets 'from' to 'to' up to the
+ * class of bucket 'to', using the prefix sums of their counts and bytes.
+ */
+static inline double class_waste(const double* counts, const double* bytes,
+    int from, int to)
+{
+    return (counts[to] - counts[from - 1]) * to * SIZE_ALIGN -
+        (bytes[to] - bytes[from - 1]);
+}
+
+/*
+ * Choose 'classes' classes with the largest of 'max' bytes, storing the last
+ * bucket of each in 'ends'. Returns the bytes wasted by the counted sizes.
+ *
+ * waste[k][j] is the least waste covering buckets 1 to j with k classes, the
+ * last ending at bucket j, and from[k][j] the bucket the class before it
+ * ended at.
+ */
+static double choose_classes(int classes, int max, int* ends)
+{
+    int last = max / SIZE_ALIGN;
+    static double counts[BUCKETS], bytes[BUCKETS];
+    static double waste[MAX_CLASSES + 1][BUCKETS];
+    static int from[MAX_CLASSES + 1][BUCKETS];
+
+    counts[0] = bytes[0] = 0;
+    for(int i = 1; i <= last; ++i)
+    {
+        double prior_size = i * SIZE_ALIGN - SIZE_ALIGN / 2;
+        counts[i] = counts[i - 1] + buckets[i].count + PRIOR_WEIGHT;
+        bytes[i] = bytes[i - 1] + buckets[i].bytes + PRIOR_WEIGHT * prior_size;
+    }
+
+    for(int j = 0; j <= last; ++j)
+    {
+        waste[0][j] = j == 0 ? 0 : DBL_MAX;
+    }
+    for(int k = 1; k <= classes; ++k)
+    {
+        for(int j = 0; j <= last; ++j)
+        {
+            waste[k][j] = DBL_MAX;
+            for(int i = k - 1; i < j; ++i)
+            {
+                if(waste[k - 1][i] == DBL_MAX)
+                {
+                    continue;
+                }
+                double total = waste[k - 1][i] +
+                    class_waste(counts, bytes, i + 1, j);
+                if(total < waste[k][j])
+                {
+                    waste[k][j] = total;
+                    from[k][j] = i;
+                }
+            }
+        }
+    }
+
+    for(int k = classes, j = last; k > 0; --k)
+    {
+        ends[k - 1] = j;
+        j = from[k][j];
+    }
+
+    /* Work out the waste again without the prior weights */
+    double total = 0;
+    for(int k = 0, i = 1; k < classes; ++k)
+    {
+        for(; i <= ends[k]; ++i)
+        {
+            total += buckets[i].count * ends[k] * SIZE_ALIGN - buckets[i].bytes;
+        }
+    }
+    return total;
+}
+
+/*
+ * Bytes wasted by the counted sizes with the classes rounded up to a power
+ * of two (of at least SIZE_ALIGN) and to a multiple of SIZE_ALIGN.
+ */
+static void fixed_waste(int max, double* power, double* aligned)
+{
+    *power = *aligned = 0;
+    for(int i = 1; i <= max / SIZE_ALIGN; ++i)
+    {
+        uint64_t size = SIZE_ALIGN;
+        while(size < (uint64_t) i * SIZE_ALIGN)
+        {
+            size *= 2;
+        }
+        *power += buckets[i].count * size - buckets[i].bytes;
+        *aligned += buckets[i].count * i * SIZE_ALIGN - buckets[i].bytes;
+    }
+}
+
+/*
+ * Print the usage message and exit.
+ */
+static void usage(const char* name)
+{
+    printf("usage: %s [-k classes] [-m max] [-o header] input...\n"
+        "  -k  size classes to choose (default %d, at most %d)\n"
+        "  -m  bytes of the largest class, a multiple of %d (default %d, at "
+        "most %d)\n"
+        "  -o  header to write (default stdout)\n"
+        "inputs are traces or text histograms of 'size [count]' lines\n",
+        name, DEFAULT_CLASSES, MAX_CLASSES, SIZE_ALIGN, DEFAULT_MAX, MAX_MAX);
+    exit(1);
+}
+
+/*
+ * Main.
+ */
+int main(int argc, char* argv[])
+{
+    int classes = DEFAULT_CLASSES;
+    int max = DEFAULT_MAX;
+    const char* output = NULL;
+    int ends[MAX_CLASSES];
+    int opt;
+
+    while((opt = getopt(argc, argv, "k:m:o:h")) != -1)
+    {
+        switch(opt)
+        {
+            case 'k':
+                classes = atoi(optarg);
+                break;
+            case 'm':
+                max = atoi(optarg);
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if(optind == argc || classes < 1 || classes > MAX_CLASSES ||
+        max < SIZE_ALIGN || max > MAX_MAX || max % SIZE_ALIGN != 0)
+    {
+        usage(argv[0]);
+    }
+    if(classes > max / SIZE_ALIGN)
+    {
+        classes = max / SIZE_ALIGN;
+    }
+
+    for(int i = optind; i < argc; ++i)
+    {
+        int trace = read_trace(argv[i], max);
+        if(trace < 0)
+        {
+            printf("Error: '%s' is not a version %d trace.\n", argv[i],
+                TRACE_VERSION);
+            exit(1);
+        }
+        if(trace == 0 && read_histogram(argv[i], max) != 0)
+        {
+            exit(1);
+        }
+    }
+
+    double waste = choose_classes(classes, max, ends);
+    double power, aligned;
+    fixed_waste(max, &power, &aligned);
+    uint64_t counted = total_count - over_count;
+
+    /* The header goes to stdout without -o, so the summary goes to stderr */
+    FILE* summary = output == NULL ? stderr : stdout;
+    FILE* header = output == NULL ? stdout : fopen(output, "w");
+    if(header == NULL)
+    {
+        perror("Can't open header");
+        exit(1);
+    }
+
+    fprintf(summary, "allocations: %llu (%llu over %d bytes)\n",
+        (unsigned long long) total_count, (unsigned long long) over_count, max);
+    fprintf(summary, "%-20s %16s %16s\n", "classes", "bytes wasted",
+        "per allocation");
+    fprintf(summary, "%-20s %16.0f %16.2f\n", "power of two", power,
+        counted ? power / counted : 0.0);
+    fprintf(summary, "%-20s %16.0f %16.2f\n", "16 byte", aligned,
+        counted ? aligned / counted : 0.0);
+    fprintf(summary, "%-20s %16.0f %16.2f\n", "chosen", waste,
+        counted ? waste / counted : 0.0);
+
+    fprintf(header, "/*\n"
+        " * Generated by classopt.out, run it again rather than editing this.\n"
+        " *\n"
+        " * Size classes of the thread cache, chosen to waste the fewest bytes\n"
+        " * rounding up the %llu allocations of up to %d bytes read from:\n",
+        (unsigned long long) counted, max);
+    for(int i = optind; i < argc; ++i)
+    {
+        fprintf(header, " *     %s\n", argv[i]);
+    }
+    fprintf(header, " *\n"
+        " * bytes wasted per allocation: %.2f (%.2f with 16 byte classes, %.2f "
+        "with\n"
+        " * power of two classes)\n"
+        " */\n", counted ? waste / counted : 0.0,
+        counted ? aligned / counted : 0.0, counted ? power / counted : 0.0);
+    fprintf(header, "#define SIZE_CLASSES %d\n", classes);
+    fprintf(header, "#define SIZE_CLASS_ALIGN %d\n", SIZE_ALIGN);
+    fprintf(header, "#define SIZE_CLASS_MAX %d\n", max);
+
+    fprintf(header, "\n/* Bytes of each size class, smallest first */\n"
+        "static const unsigned short size_class_sizes[SIZE_CLASSES] =\n{");
+    for(int k = 0; k < classes; ++k)
+    {
+        fprintf(header, "%s%d%s", k % TABLE_ROW ? " " : "\n    ",
+            ends[k] * SIZE_ALIGN, k + 1 < classes ? "," : "\n");
+    }
+    fprintf(header, "};\n");
+
+    fprintf(header, "\n/* Size class of a chunk of up to SIZE_CLASS_MAX bytes, "
+        "indexed by its size\n * rounded up to SIZE_CLASS_ALIGN and divided "
+        "by it */\n"
+        "static const unsigned char\n"
+        "    size_class_index[SIZE_CLASS_MAX / SIZE_CLASS_ALIGN + 1] =\n{");
+    for(int i = 0, k = 0; i <= max / SIZE_ALIGN; ++i)
+    {
+        if(i > ends[k])
+        {
+            ++k;
+        }
+        fprintf(header, "%s%d%s", i % TABLE_ROW ? " " : "\n    ", k,
+            i < max / SIZE_ALIGN ? "," : "\n");
+    }
+    fprintf(header, "};\n");
+
+    if(output != NULL && fclose(header) != 0)
+    {
+        perror("Can't write header");
+        exit(1);
+    }
+    return 0;
+}
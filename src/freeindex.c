@@ -0,0 +1,487 @@
+/*
+ * Implementation of freeindex.h
+ *
+ * The keys and blocks are kept in two arrays mapped from the OS, which are
+ * moved with mremap() as they grow. Each block records its position in the
+ * index in its slot, so it can be deleted without a search. The searches
+ * come in a scalar, an SSE2 and an AVX2 version, the vector versions
+ * comparing 4 or 8 keys at once and finishing the last few with the scalar
+ * version.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "locks.h"
+#include "list.h"
+#include "freeindex.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FREE_INDEX_X86
+#endif
+
+/* Blocks an index has room for when it is first mapped */
+#define FREE_INDEX_INITIAL 1024
+
+/* Holes an index can have before it is packed, as long as they are also over
+ * half of it */
+#define FREE_INDEX_PACK_MIN 64
+
+/*
+ * A version of each search.
+ */
+struct free_index_ops
+{
+    const char* name;
+    size_t (*next)(const uint32_t* keys, size_t from, size_t count,
+        uint32_t low, uint32_t high);
+    uint32_t (*min)(const uint32_t* keys, size_t count, uint32_t low,
+        uint32_t high);
+    uint32_t (*max)(const uint32_t* keys, size_t count, uint32_t low,
+        uint32_t high);
+};
+
+/*
+ * Scalar searches, used when the CPU has no vector compares and to finish
+ * the keys left over after the last whole vector.
+ */
+static size_t next_scalar(const uint32_t* keys, size_t from, size_t count,
+    uint32_t low, uint32_t high)
+{
+    for(size_t i = from; i < count; ++i)
+    {
+        if(keys[i] >= low && keys[i] <= high)
+        {
+            return i;
+        }
+    }
+    return count;
+}
+
+static uint32_t min_scalar(const uint32_t* keys, size_t count, uint32_t low,
+    uint32_t high)
+{
+    uint32_t min = 0;
+    for(size_t i = 0; i < count; ++i)
+    {
+        if(keys[i] >= low && keys[i] <= high && (min == 0 || keys[i] < min))
+        {
+            min = keys[i];
+        }
+    }
+    return min;
+}
+
+static uint32_t max_scalar(const uint32_t* keys, size_t count, uint32_t low,
+    uint32_t high)
+{
+    uint32_t max = 0;
+    for(size_t i = 0; i < count; ++i)
+    {
+        if(keys[i] >= low && keys[i] <= high && keys[i] > max)
+        {
+            max = keys[i];
+        }
+    }
+    return max;
+}
+
+static const struct free_index_ops scalar_ops =
+    {"scalar", next_scalar, min_scalar, max_scalar};
+
+#ifdef FREE_INDEX_X86
+
+/*
+ * SSE2 searches. SSE2 has no 32 bit min or max, so they are made from a
+ * compare and a select. A key in range is one greater than low - 1 and not
+ * greater than high, which works as every key fits in a signed int.
+ */
+__attribute__((target("sse2")))
+static size_t next_sse2(const uint32_t* keys, size_t from, size_t count,
+    uint32_t low, uint32_t high)
+{
+    __m128i below = _mm_set1_epi32((int) (low - 1));
+    __m128i above = _mm_set1_epi32((int) high);
+    size_t i = from;
+
+    for(; i + 4 <= count; i += 4)
+    {
+        __m128i key = _mm_loadu_si128((const __m128i*) &keys[i]);
+        __m128i in = _mm_andnot_si128(_mm_cmpgt_epi32(key, above),
+            _mm_cmpgt_epi32(key, below));
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(in));
+        if(mask != 0)
+        {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return next_scalar(keys, i, count, low, high);
+}
+
+__attribute__((target("sse2")))
+static uint32_t min_sse2(const uint32_t* keys, size_t count, uint32_t low,
+    uint32_t high)
+{
+    __m128i below = _mm_set1_epi32((int) (low - 1));
+    __m128i above = _mm_set1_epi32((int) high);
+    __m128i min = _mm_set1_epi32((int) FREE_INDEX_KEY_MAX);
+    __m128i found = _mm_setzero_si128();
+    size_t i = 0;
+
+    for(; i + 4 <= count; i += 4)
+    {
+        __m128i key = _mm_loadu_si128((const __m128i*) &keys[i]);
+        __m128i in = _mm_andnot_si128(_mm_cmpgt_epi32(key, above),
+            _mm_cmpgt_epi32(key, below));
+        __m128i less = _mm_and_si128(in, _mm_cmpgt_epi32(min, key));
+        min = _mm_or_si128(_mm_and_si128(less, key),
+            _mm_andnot_si128(less, min));
+        found = _mm_or_si128(found, in);
+    }
+
+    uint32_t lanes[4];
+    uint32_t result = min_scalar(keys + i, count - i, low, high);
+    _mm_storeu_si128((__m128i*) lanes, min);
+    if(_mm_movemask_epi8(found) != 0)
+    {
+        for(int j = 0; j < 4; ++j)
+        {
+            if(result == 0 || lanes[j] < result)
+            {
+                result = lanes[j];
+            }
+        }
+    }
+    return result;
+}
+
+__attribute__((target("sse2")))
+static uint32_t max_sse2(const uint32_t* keys, size_t count, uint32_t low,
+    uint32_t high)
+{
+    __m128i below = _mm_set1_epi32((int) (low - 1));
+    __m128i above = _mm_set1_epi32((int) high);
+    __m128i max = _mm_setzero_si128();
+    size_t i = 0;
+
+    /* Keys out of range are taken as 0, which is never a key */
+    for(; i + 4 <= count; i += 4)
+    {
+        __m128i key = _mm_loadu_si128((const __m128i*) &keys[i]);
+        __m128i in = _mm_andnot_si128(_mm_cmpgt_epi32(key, above),
+            _mm_cmpgt_epi32(key, below));
+        __m128i greater = _mm_and_si128(in, _mm_cmpgt_epi32(key, max));
+        max = _mm_or_si128(_mm_and_si128(greater, key),
+            _mm_andnot_si128(greater, max));
+    }
+
+    uint32_t lanes[4];
+    uint32_t result = max_scalar(keys + i, count - i, low, high);
+    _mm_storeu_si128((__m128i*) lanes, max);
+    for(int j = 0; j < 4; ++j)
+    {
+        if(lanes[j] > result)
+        {
+            result = lanes[j];
+        }
+    }
+    return result;
+}
+
+static const struct free_index_ops sse2_ops =
+    {"sse2", next_sse2, min_sse2, max_sse2};
+
+/*
+ * AVX2 searches, in the same way as the SSE2 ones but 8 keys at a time and
+ * with a real min and max.
+ */
+__attribute__((target("avx2")))
+static size_t next_avx2(const uint32_t* keys, size_t from, size_t count,
+    uint32_t low, uint32_t high)
+{
+    __m256i below = _mm256_set1_epi32((int) (low - 1));
+    __m256i above = _mm256_set1_epi32((int) high);
+    size_t i = from;
+
+    for(; i + 8 <= count; i += 8)
+    {
+        __m256i key = _mm256_loadu_si256((const __m256i*) &keys[i]);
+        __m256i in = _mm256_andnot_si256(_mm256_cmpgt_epi32(key, above),
+            _mm256_cmpgt_epi32(key, below));
+        int mask = _mm256_movemask_ps(_mm256_castsi256_ps(in));
+        if(mask != 0)
+        {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return next_scalar(keys, i, count, low, high);
+}
+
+__attribute__((target("avx2")))
+static uint32_t min_avx2(const uint32_t* keys, size_t count, uint32_t low,
+    uint32_t high)
+{
+    __m256i below = _mm256_set1_epi32((int) (low - 1));
+    __m256i above = _mm256_set1_epi32((int) high);
+    __m256i none = _mm256_set1_epi32((int) FREE_INDEX_KEY_MAX);
+    __m256i min = none;
+    __m256i found = _mm256_setzero_si256();
+    size_t i = 0;
+
+    for(; i + 8 <= count; i += 8)
+    {
+        __m256i key = _mm256_loadu_si256((const __m256i*) &keys[i]);
+        __m256i in = _mm256_andnot_si256(_mm256_cmpgt_epi32(key, above),
+            _mm256_cmpgt_epi32(key, below));
+        min = _mm256_min_epi32(min, _mm256_blendv_epi8(none, key, in));
+        found = _mm256_or_si256(found, in);
+    }
+
+    uint32_t lanes[8];
+    uint32_t result = min_scalar(keys + i, count - i, low, high);
+    _mm256_storeu_si256((__m256i*) lanes, min);
+    if(!_mm256_testz_si256(found, found))
+    {
+        for(int j = 0; j < 8; ++j)
+        {
+            if(result == 0 || lanes[j] < result)
+            {
+                result = lanes[j];
+            }
+        }
+    }
+    return result;
+}
+
+__attribute__((target("avx2")))
+static uint32_t max_avx2(const uint32_t* keys, size_t count, uint32_t low,
+    uint32_t high)
+{
+    __m256i below = _mm256_set1_epi32((int) (low - 1));
+    __m256i above = _mm256_set1_epi32((int) high);
+    __m256i max = _mm256_setzero_si256();
+    size_t i = 0;
+
+    for(; i + 8 <= count; i += 8)
+    {
+        __m256i key = _mm256_loadu_si256((const __m256i*) &keys[i]);
+        __m256i in = _mm256_andnot_si256(_mm256_cmpgt_epi32(key, above),
+            _mm256_cmpgt_epi32(key, below));
+        max = _mm256_max_epi32(max, _mm256_and_si256(key, in));
+    }
+
+    uint32_t lanes[8];
+    uint32_t result = max_scalar(keys + i, count - i, low, high);
+    _mm256_storeu_si256((__m256i*) lanes, max);
+    for(int j = 0; j < 8; ++j)
+    {
+        if(lanes[j] > result)
+        {
+            result = lanes[j];
+        }
+    }
+    return result;
+}
+
+static const struct free_index_ops avx2_ops =
+    {"avx2", next_avx2, min_avx2, max_avx2};
+
+#endif
+
+/* Searches in use, chosen from what the CPU has on first use */
+static const struct free_index_ops* ops = &scalar_ops;
+static pthread_once_t ops_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Choose the best searches the CPU has.
+ */
+static void choose_ops()
+{
+    #ifdef FREE_INDEX_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+    {
+        __atomic_store_n(&ops, &avx2_ops, __ATOMIC_RELEASE);
+    }
+    else if(__builtin_cpu_supports("sse2"))
+    {
+        __atomic_store_n(&ops, &sse2_ops, __ATOMIC_RELEASE);
+    }
+    #endif
+
+    #ifdef DEBUG
+    printf("-->Free index searching with %s\n", ops->name);
+    #endif
+}
+
+/*
+ * Map 'bytes' for an array of the index, or move 'old' of 'old_bytes' to a
+ * mapping that large.
+ */
+static void* map_array(void* old, size_t old_bytes, size_t bytes)
+{
+    void* array = old == NULL ?
+        mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+            -1, 0) :
+        mremap(old, old_bytes, bytes, MREMAP_MAYMOVE);
+
+    if(array == MAP_FAILED)
+    {
+        perror("Can't map free index");
+        abort();
+    }
+    return array;
+}
+
+/*
+ * Move every block down over the holes, keeping them in order.
+ */
+static void pack(struct free_index* index)
+{
+    size_t count = 0;
+
+    for(size_t i = 0; i < index->count; ++i)
+    {
+        if(index->keys[i] != 0)
+        {
+            index->keys[count] = index->keys[i];
+            index->blocks[count] = index->blocks[i];
+            index->blocks[count]->slot = count;
+            ++count;
+        }
+    }
+    index->count = count;
+    index->holes = 0;
+}
+
+void free_index_insert(struct free_index* index, struct block* block)
+{
+    pthread_once(&ops_once, choose_ops);
+
+    if(index->count == index->capacity)
+    {
+        /* Packing is enough if a quarter of the index is holes */
+        if(index->holes > index->count / 4)
+        {
+            pack(index);
+        }
+        else
+        {
+            size_t capacity = index->capacity == 0 ?
+                FREE_INDEX_INITIAL : index->capacity * 2;
+            index->keys = map_array(index->keys,
+                index->capacity * sizeof(uint32_t),
+                capacity * sizeof(uint32_t));
+            index->blocks = map_array(index->blocks,
+                index->capacity * sizeof(struct block*),
+                capacity * sizeof(struct block*));
+            index->capacity = capacity;
+        }
+    }
+
+    index->keys[index->count] = free_index_key(block->size);
+    index->blocks[index->count] = block;
+    block->slot = index->count++;
+}
+
+void free_index_delete(struct free_index* index, struct block* block)
+{
+    size_t slot = block->slot;
+
+    #ifdef DEBUG
+    if(slot >= index->count || index->blocks[slot] != block)
+    {
+        printf("Block %p isnt at slot %ld of the free index\n",
+            (void*) block, slot);
+        abort();
+    }
+    #endif
+
+    index->keys[slot] = 0;
+    index->blocks[slot] = NULL;
+    ++index->holes;
+
+    /* Holes at the end are simply dropped */
+    while(index->count > 0 && index->keys[index->count - 1] == 0)
+    {
+        --index->count;
+        --index->holes;
+    }
+
+    if(index->holes > FREE_INDEX_PACK_MIN && index->holes > index->count / 2)
+    {
+        pack(index);
+    }
+}
+
+size_t free_index_next(const struct free_index* index, size_t from,
+    uint32_t low, uint32_t high)
+{
+    if(from >= index->count)
+    {
+        return index->count;
+    }
+    return __atomic_load_n(&ops, __ATOMIC_ACQUIRE)->next(index->keys, from,
+        index->count, low, high);
+}
+
+uint32_t free_index_min(const struct free_index* index, uint32_t low,
+    uint32_t high)
+{
+    if(index->count == 0)
+    {
+        return 0;
+    }
+    return __atomic_load_n(&ops, __ATOMIC_ACQUIRE)->min(index->keys,
+        index->count, low, high);
+}
+
+uint32_t free_index_max(const struct free_index* index, uint32_t low,
+    uint32_t high)
+{
+    if(index->count == 0)
+    {
+        return 0;
+    }
+    return __atomic_load_n(&ops, __ATOMIC_ACQUIRE)->max(index->keys,
+        index->count, low, high);
+}
+
+int free_index_use(const char* isa)
+{
+    const struct free_index_ops* chosen = NULL;
+
+    pthread_once(&ops_once, choose_ops);
+
+    if(strcmp(isa, "scalar") == 0)
+    {
+        chosen = &scalar_ops;
+    }
+    #ifdef FREE_INDEX_X86
+    else if(strcmp(isa, "sse2") == 0 && __builtin_cpu_supports("sse2"))
+    {
+        chosen = &sse2_ops;
+    }
+    else if(strcmp(isa, "avx2") == 0 && __builtin_cpu_supports("avx2"))
+    {
+        chosen = &avx2_ops;
+    }
+    #endif
+
+    if(chosen == NULL)
+    {
+        return -1;
+    }
+    __atomic_store_n(&ops, chosen, __ATOMIC_RELEASE);
+    return 0;
+}
+
+const char* free_index_isa()
+{
+    pthread_once(&ops_once, choose_ops);
+    return __atomic_load_n(&ops, __ATOMIC_ACQUIRE)->name;
+}
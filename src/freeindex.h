@@ -0,0 +1,92 @@
+/*
+ * Header file for freeindex.c - An index of the blocks in a freed list, which
+ * keeps a key for each block's size in one dense array alongside a pointer to
+ * the block, so a fit search compares a vector of sizes at a time rather than
+ * following each block's next pointer to read its size.
+ *
+ * The blocks are kept in the same order as their freed list, so the first
+ * block the index finds is the first the list would. Deleting a block leaves
+ * a hole (a key of 0) behind it until enough holes have built up for the
+ * index to be packed down again, which keeps deleting cheap.
+ *
+ * The searches are done with AVX2 or SSE2 compares when the CPU has them,
+ * chosen when the first block is inserted, and with plain loops otherwise.
+ *
+ * Every function must be called with the freed list locked, for writing if it
+ * changes the index.
+ */
+#include <stdint.h>
+#include <stddef.h>
+
+/* Bytes of size each unit of a key stands for, and the largest key. Keys are
+ * compared as signed 32 bit numbers, so larger blocks share the largest */
+#define FREE_INDEX_UNIT 16
+#define FREE_INDEX_KEY_MAX 0x7fffffffu
+
+/*
+ * Index of one freed list. 'keys' and 'blocks' are 'count' long, holes
+ * included.
+ */
+struct free_index
+{
+    uint32_t* keys;
+    struct block** blocks;
+    size_t count;
+    size_t holes;
+    size_t capacity;
+};
+
+/*
+ * Returns the key of a size, being the units needed to hold it. A block of
+ * at least a size has a key of at least the size's, so the keys find every
+ * block that fits, but blocks sharing a key can differ in size by up to a
+ * unit (or more, at FREE_INDEX_KEY_MAX) and have to be checked.
+ */
+static inline uint32_t free_index_key(size_t size)
+{
+    size_t units = (size + FREE_INDEX_UNIT - 1) / FREE_INDEX_UNIT;
+    if(units == 0)
+    {
+        return 1;
+    }
+    return units < FREE_INDEX_KEY_MAX ? (uint32_t) units : FREE_INDEX_KEY_MAX;
+}
+
+/*
+ * Add a block to the end of the index, as list_append() does to the list.
+ */
+void free_index_insert(struct free_index* index, struct block* block);
+
+/*
+ * Remove a block from the index.
+ */
+void free_index_delete(struct free_index* index, struct block* block);
+
+/*
+ * Returns the position of the first block from 'from' on whose key is
+ * between 'low' and 'high' (inclusive), or the index's count if there isnt
+ * one.
+ */
+size_t free_index_next(const struct free_index* index, size_t from,
+    uint32_t low, uint32_t high);
+
+/*
+ * Returns the smallest or largest key between 'low' and 'high' (inclusive),
+ * or 0 if there isnt one.
+ */
+uint32_t free_index_min(const struct free_index* index, uint32_t low,
+    uint32_t high);
+uint32_t free_index_max(const struct free_index* index, uint32_t low,
+    uint32_t high);
+
+/*
+ * Search with the named instruction set ("avx2", "sse2" or "scalar") rather
+ * than the best the CPU has. Returns 0 on success or -1 if the CPU doesnt
+ * have it.
+ */
+int free_index_use(const char* isa);
+
+/*
+ * Returns the name of the instruction set the searches are using.
+ */
+const char* free_index_isa();
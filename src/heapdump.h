@@ -0,0 +1,48 @@
+/*
+ * Format of the heap dumps written by heap_dump() and read by heapstat.
+ *
+ * A heap dump is a dump_header followed by a dump_record for every chunk in
+ * the alloc and freed lists, in order of address.
+ */
+#include <stdint.h>
+
+/* Magic number and version at the start of every heap dump */
+#define DUMP_MAGIC "M2HD"
+#define DUMP_VERSION 1
+
+/*
+ * States a chunk can be in.
+ *
+ * allocated - The chunk is in an alloc list.
+ * free      - The chunk is in a freed list, or in a thread's cache (where
+ *             it is still in an alloc list and has 'cached' set).
+ */
+enum dump_state{DUMP_ALLOCATED = 1, DUMP_FREE = 2};
+
+/*
+ * Header at the start of a heap dump.
+ */
+struct dump_header
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t reserved;
+    uint64_t heap_size; /* Bytes the heap had been grown by */
+    uint64_t os_bytes;  /* Bytes mapped from the OS */
+    uint64_t count;     /* Records that follow */
+};
+
+/*
+ * A single chunk. The list is the size class of an allocated chunk, or the
+ * policy range of a free one.
+ */
+struct dump_record
+{
+    uint64_t address; /* Start of the chunk's data */
+    uint64_t size;    /* Bytes of data */
+    uint8_t state;    /* One of dump_state */
+    uint8_t flags;    /* The block's BLOCK_ flags */
+    uint16_t list;    /* Index of the list holding it */
+    uint32_t reserved;
+};
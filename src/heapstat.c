@@ -0,0 +1,244 @@
+/*
+ * Analyses a heap dump written by heap_dump().
+ *
+ * The dump is memory mapped and its chunks (already in order of address) are
+ * walked once to report the free chunk size histogram, the largest run of
+ * address adjacent free chunks, the external fragmentation and a heat map of
+ * how much of each MiB of the heap is allocated.
+ *
+ * usage: heapstat.out dump
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "heapdump.h"
+
+/* Power of two buckets in the free size histogram */
+#define HISTOGRAM_BUCKETS 64
+
+/* Bytes of heap shown by each character of the heat map, and the characters
+ * on each row */
+#define HEAT_BYTES (1024 * 1024)
+#define HEAT_ROW 64
+
+/* Characters of the heat map, from least to most of the MiB allocated. A MiB
+ * holding only free chunks is shown as HEAT_FREE, and one without any chunks
+ * as a space */
+#define HEAT_LEVELS ".:-=+*#%@"
+#define HEAT_FREE '_'
+
+/*
+ * A row of the heat map being filled in.
+ */
+struct heat_row
+{
+    uint64_t base;
+    uint64_t allocated[HEAT_ROW];
+    uint64_t covered[HEAT_ROW];
+    int used;
+};
+
+/*
+ * Print a row of the heat map and empty it.
+ */
+static void print_row(struct heat_row* row)
+{
+    char line[HEAT_ROW + 1];
+    int levels = sizeof(HEAT_LEVELS) - 1;
+
+    if(!row->used)
+    {
+        return;
+    }
+
+    for(int i = 0; i < HEAT_ROW; ++i)
+    {
+        if(row->covered[i] == 0)
+        {
+            line[i] = ' ';
+        }
+        else if(row->allocated[i] == 0)
+        {
+            line[i] = HEAT_FREE;
+        }
+        else
+        {
+            int level = (int) (row->allocated[i] * levels / HEAT_BYTES);
+            line[i] = HEAT_LEVELS[level < levels ? level : levels - 1];
+        }
+    }
+    line[HEAT_ROW] = '\0';
+
+    printf("  0x%012llx |%s|\n", (unsigned long long) row->base, line);
+
+    memset(row, 0, sizeof(struct heat_row));
+}
+
+/*
+ * Add a chunk to the heat map, printing each row once the chunks have moved
+ * past it. Rows without any chunks are skipped, and marked with '...'.
+ */
+static void heat_add(struct heat_row* row, const struct dump_record* record)
+{
+    uint64_t row_bytes = (uint64_t) HEAT_BYTES * HEAT_ROW;
+    uint64_t address = record->address;
+    uint64_t end = record->address + record->size;
+
+    while(address < end)
+    {
+        uint64_t base = address - address % row_bytes;
+        if(!row->used || base != row->base)
+        {
+            int skipped = row->used && base > row->base + row_bytes;
+            print_row(row);
+            if(skipped)
+            {
+                printf("  ...\n");
+            }
+            row->base = base;
+            row->used = 1;
+        }
+
+        uint64_t mib = (address - base) / HEAT_BYTES;
+        uint64_t mib_end = base + (mib + 1) * HEAT_BYTES;
+        uint64_t piece = (end < mib_end ? end : mib_end) - address;
+
+        row->covered[mib] += piece;
+        if(record->state == DUMP_ALLOCATED)
+        {
+            row->allocated[mib] += piece;
+        }
+        address += piece;
+    }
+}
+
+/*
+ * Main.
+ */
+int main(int argc, char* argv[])
+{
+    uint64_t free_counts[HISTOGRAM_BUCKETS] = {0};
+    uint64_t free_bytes[HISTOGRAM_BUCKETS] = {0};
+    uint64_t allocated_count = 0, allocated_total = 0;
+    uint64_t free_count = 0, free_total = 0;
+    uint64_t extent_start = 0, extent_end = 0;
+    uint64_t largest_start = 0, largest_size = 0;
+    struct heat_row* row = calloc(1, sizeof(struct heat_row));
+    struct stat info;
+
+    if(argc != 2)
+    {
+        printf("usage: %s dump\n", argv[0]);
+        exit(1);
+    }
+
+    /* Map the dump and check it is one we can read */
+    int fd = open(argv[1], O_RDONLY);
+    if(fd < 0 || fstat(fd, &info) != 0)
+    {
+        perror("Can't open heap dump");
+        exit(1);
+    }
+    if((size_t) info.st_size < sizeof(struct dump_header))
+    {
+        printf("Error: '%s' is not a heap dump.\n", argv[1]);
+        exit(1);
+    }
+    const char* map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(map == MAP_FAILED)
+    {
+        perror("Can't map heap dump");
+        exit(1);
+    }
+    const struct dump_header* header = (const struct dump_header*) map;
+    if(memcmp(header->magic, DUMP_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != DUMP_VERSION ||
+        header->record_size != sizeof(struct dump_record) ||
+        header->count > (info.st_size - sizeof(struct dump_header)) /
+            sizeof(struct dump_record))
+    {
+        printf("Error: '%s' is not a version %d heap dump.\n", argv[1],
+            DUMP_VERSION);
+        exit(1);
+    }
+    const struct dump_record* records =
+        (const struct dump_record*) (map + sizeof(struct dump_header));
+
+    printf("heap dump: %s\n", argv[1]);
+    printf("heap size: %llu bytes (%llu mapped from the OS)\n",
+        (unsigned long long) header->heap_size,
+        (unsigned long long) header->os_bytes);
+    printf("\nheat map (one character per MiB, '%c' free only, '%s' from "
+        "least to most allocated):\n", HEAT_FREE, HEAT_LEVELS);
+
+    for(uint64_t i = 0; i < header->count; ++i)
+    {
+        const struct dump_record* record = &records[i];
+
+        heat_add(row, record);
+
+        if(record->state == DUMP_ALLOCATED)
+        {
+            ++allocated_count;
+            allocated_total += record->size;
+            continue;
+        }
+
+        ++free_count;
+        free_total += record->size;
+        int bucket = 63 - __builtin_clzll(record->size ? record->size : 1);
+        ++free_counts[bucket];
+        free_bytes[bucket] += record->size;
+
+        /* Free chunks that follow on from each other make one extent */
+        if(free_count == 1 || record->address != extent_end)
+        {
+            extent_start = record->address;
+        }
+        extent_end = record->address + record->size;
+        if(extent_end - extent_start > largest_size)
+        {
+            largest_start = extent_start;
+            largest_size = extent_end - extent_start;
+        }
+    }
+    print_row(row);
+
+    printf("\nallocated: %llu chunks, %llu bytes\n",
+        (unsigned long long) allocated_count,
+        (unsigned long long) allocated_total);
+    printf("free: %llu chunks, %llu bytes\n", (unsigned long long) free_count,
+        (unsigned long long) free_total);
+
+    printf("\nfree size histogram:\n");
+    printf("  %-24s %12s %16s\n", "size", "chunks", "bytes");
+    for(int i = 0; i < HISTOGRAM_BUCKETS; ++i)
+    {
+        if(free_counts[i] > 0)
+        {
+            char range[48];
+            snprintf(range, sizeof(range), "%llu - %llu", 1ULL << i,
+                i < 63 ? (2ULL << i) - 1 : UINT64_MAX);
+            printf("  %-24s %12llu %16llu\n", range,
+                (unsigned long long) free_counts[i],
+                (unsigned long long) free_bytes[i]);
+        }
+    }
+
+    printf("\nlargest free extent: %llu bytes at 0x%llx\n",
+        (unsigned long long) largest_size,
+        (unsigned long long) largest_start);
+    printf("external fragmentation: %.4f (1 - largest free extent / free "
+        "bytes)\n", free_total ? 1.0 - (double) largest_size / free_total :
+        0.0);
+
+    munmap((void*) map, info.st_size);
+    close(fd);
+    free(row);
+    return 0;
+}
@@ -0,0 +1,378 @@
+/*
+ * Test of the free block index in freeindex.c.
+ *
+ * Lists of blocks are filled with random sizes, some of them deleted again to
+ * leave holes in their indexes, and searched for random sizes with first,
+ * best and worst fit the way alloc.c searches them. Every block found has to
+ * be the one a plain walk of the list finds, and every search of the keys
+ * has to match a plain loop over them. The lists are made in lengths that
+ * arent a multiple of the vector width, with sizes up to and past those
+ * FREE_INDEX_KEY_MAX stands for, and everything is run with each of the
+ * scalar, SSE2 and AVX2 searches the CPU has.
+ *
+ * usage: indextest.out [-s seed] [-r rounds]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "locks.h"
+#include "list.h"
+#include "freeindex.h"
+
+/* Default values of the command line options */
+#define DEFAULT_SEED 88172645463325252ull
+#define DEFAULT_ROUNDS 200
+
+/* Searches of each kind done on each list */
+#define SEARCHES 64
+
+/* Longest list made, being past the blocks an index first has room for so it
+ * has to grow */
+#define MAX_BLOCKS 1500
+
+/* Largest size a key stands for on its own, past which sizes share a key */
+#define KEY_MAX_SIZE ((size_t) FREE_INDEX_KEY_MAX * FREE_INDEX_UNIT)
+
+/* Fit policies, as in alloc.c */
+enum stratergy {FIRST, BEST, WORST};
+
+static const char* fit_names[] = {"first", "best", "worst"};
+
+/*
+ * A list of blocks and its index, kept in step as alloc.c does.
+ */
+struct test_list
+{
+    struct block* head;
+    struct block* tail;
+    struct free_index index;
+};
+
+static unsigned long failures = 0;
+
+/*
+ * Xorshift random number generator, as used by bench.c.
+ */
+static uint64_t next_random(uint64_t* state)
+{
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+/*
+ * Returns a random block or search size. Most are small, some are large and
+ * some are within a few units either side of the largest key.
+ */
+static size_t random_size(uint64_t* rng)
+{
+    uint64_t roll = next_random(rng) % 8;
+    if(roll < 5)
+    {
+        return 1 + next_random(rng) % 4096;
+    }
+    if(roll < 7)
+    {
+        return 1 + next_random(rng) % (1ul << 24);
+    }
+    return KEY_MAX_SIZE - 3 * FREE_INDEX_UNIT +
+        next_random(rng) % (6 * FREE_INDEX_UNIT);
+}
+
+static void append(struct test_list* list, struct block* block)
+{
+    block->next = NULL;
+    block->prev = list->tail;
+    if(list->tail != NULL)
+    {
+        list->tail->next = block;
+    }
+    else
+    {
+        list->head = block;
+    }
+    list->tail = block;
+    block->flags |= BLOCK_FREE;
+    free_index_insert(&list->index, block);
+}
+
+static void delete(struct test_list* list, struct block* block)
+{
+    if(block->prev != NULL)
+    {
+        block->prev->next = block->next;
+    }
+    else
+    {
+        list->head = block->next;
+    }
+    if(block->next != NULL)
+    {
+        block->next->prev = block->prev;
+    }
+    else
+    {
+        list->tail = block->prev;
+    }
+    block->flags &= ~BLOCK_FREE;
+    free_index_delete(&list->index, block);
+}
+
+/*
+ * Returns the block a walk of the list finds for the size with the fit
+ * policy passed in, keeping the first of equal blocks.
+ */
+static struct block* walk_fit(struct test_list* list, size_t size,
+    enum stratergy fit)
+{
+    struct block* found = NULL;
+
+    for(struct block* block = list->head; block != NULL; block = block->next)
+    {
+        if(block->size < size)
+        {
+            continue;
+        }
+        if(found == NULL || (fit == BEST && block->size < found->size) ||
+            (fit == WORST && block->size > found->size))
+        {
+            found = block;
+        }
+        if(fit == FIRST)
+        {
+            break;
+        }
+    }
+    return found;
+}
+
+/*
+ * Returns the block found through the index for the size with the fit policy
+ * passed in, searching the keys as first_fit, best_fit and worst_fit in
+ * alloc.c do.
+ */
+static struct block* index_fit(struct test_list* list, size_t size,
+    enum stratergy fit)
+{
+    struct free_index* index = &list->index;
+    uint32_t low = free_index_key(size);
+    uint32_t high = FREE_INDEX_KEY_MAX;
+    uint32_t key;
+    struct block* found = NULL;
+
+    if(fit == FIRST)
+    {
+        size_t i = free_index_next(index, 0, low, high);
+        while(i < index->count && index->blocks[i]->size < size)
+        {
+            i = free_index_next(index, i + 1, low, high);
+        }
+        return i < index->count ? index->blocks[i] : NULL;
+    }
+
+    while(found == NULL && low <= high && (key = fit == BEST ?
+        free_index_min(index, low, high) : free_index_max(index, low, high)))
+    {
+        for(size_t i = free_index_next(index, 0, key, key); i < index->count;
+            i = free_index_next(index, i + 1, key, key))
+        {
+            struct block* block = index->blocks[i];
+            if(block->size >= size && (found == NULL || (fit == BEST ?
+                block->size < found->size : block->size > found->size)))
+            {
+                found = block;
+            }
+        }
+        if(fit == BEST)
+        {
+            low = key + 1;
+        }
+        else
+        {
+            high = key - 1;
+        }
+    }
+    return found;
+}
+
+static void fail(const char* isa, const char* what, size_t count)
+{
+    printf("FAILED (%s): %s with %ld keys\n", isa, what, count);
+    ++failures;
+}
+
+/*
+ * Check the key searches of an index against plain loops over its keys, from
+ * every position near the end so each length of tail is covered.
+ */
+static void check_keys(const char* isa, struct free_index* index,
+    uint32_t low, uint32_t high)
+{
+    uint32_t min = 0;
+    uint32_t max = 0;
+
+    for(size_t i = 0; i < index->count; ++i)
+    {
+        uint32_t key = index->keys[i];
+        if(key >= low && key <= high)
+        {
+            min = min == 0 || key < min ? key : min;
+            max = key > max ? key : max;
+        }
+    }
+    if(free_index_min(index, low, high) != min)
+    {
+        fail(isa, "min", index->count);
+    }
+    if(free_index_max(index, low, high) != max)
+    {
+        fail(isa, "max", index->count);
+    }
+
+    size_t from = index->count > 20 ? index->count - 20 : 0;
+    for(; from <= index->count + 1; ++from)
+    {
+        size_t expected = from;
+        while(expected < index->count && (index->keys[expected] < low ||
+            index->keys[expected] > high))
+        {
+            ++expected;
+        }
+        if(expected > index->count)
+        {
+            expected = index->count;
+        }
+        if(free_index_next(index, from, low, high) != expected)
+        {
+            fail(isa, "next", index->count);
+        }
+    }
+}
+
+/*
+ * Fill a list with 'count' random blocks, delete some of them to leave holes
+ * and add a few more after them, then check searches for random sizes.
+ */
+static void run_round(const char* isa, struct test_list* list,
+    struct block* blocks, size_t count, uint64_t* rng)
+{
+    size_t deleted = 0;
+
+    for(size_t i = 0; i < count; ++i)
+    {
+        blocks[i].size = random_size(rng);
+        append(list, &blocks[i]);
+    }
+
+    /* Delete up to three quarters of them, which packs larger indexes */
+    size_t holes = count > 0 ? next_random(rng) % (count * 3 / 4 + 1) : 0;
+    for(size_t i = 0; i < count && deleted < holes; ++i)
+    {
+        if(next_random(rng) % 2 == 0)
+        {
+            delete(list, &blocks[i]);
+            ++deleted;
+        }
+    }
+    for(size_t i = 0; i < count && deleted > 0; i += 3)
+    {
+        if(!(blocks[i].flags & BLOCK_FREE))
+        {
+            blocks[i].size = random_size(rng);
+            append(list, &blocks[i]);
+            --deleted;
+        }
+    }
+
+    for(int i = 0; i < SEARCHES; ++i)
+    {
+        size_t size = i == 0 ? KEY_MAX_SIZE + FREE_INDEX_UNIT :
+            random_size(rng);
+        for(enum stratergy fit = FIRST; fit <= WORST; ++fit)
+        {
+            if(index_fit(list, size, fit) != walk_fit(list, size, fit))
+            {
+                fail(isa, fit_names[fit], list->index.count);
+            }
+        }
+        check_keys(isa, &list->index, free_index_key(size),
+            FREE_INDEX_KEY_MAX);
+    }
+    check_keys(isa, &list->index, FREE_INDEX_KEY_MAX, FREE_INDEX_KEY_MAX);
+    check_keys(isa, &list->index, 1, FREE_INDEX_KEY_MAX - 1);
+
+    /* Empty the list again for the next round */
+    while(list->head != NULL)
+    {
+        delete(list, list->head);
+    }
+}
+
+/*
+ * Run every round with the searches of the named instruction set.
+ */
+static void run_isa(const char* isa, uint64_t seed, int rounds)
+{
+    struct test_list list = {NULL, NULL, {NULL, NULL, 0, 0, 0}};
+    struct block* blocks = calloc(MAX_BLOCKS, sizeof(struct block));
+    unsigned long before = failures;
+    uint64_t rng = seed;
+
+    if(free_index_use(isa) != 0)
+    {
+        printf("%-6s skipped, the CPU doesnt have it\n", isa);
+        free(blocks);
+        return;
+    }
+
+    for(int round = 0; round < rounds; ++round)
+    {
+        /* Every short length, so each tail length is covered, and then
+         * lists long enough to grow the index */
+        size_t count = round < 48 ? (size_t) round :
+            48 + next_random(&rng) % (MAX_BLOCKS - 47);
+        run_round(isa, &list, blocks, count, &rng);
+    }
+
+    printf("%-6s %s\n", isa, failures == before ? "passed" : "FAILED");
+    free(blocks);
+}
+
+int main(int argc, char** argv)
+{
+    uint64_t seed = DEFAULT_SEED;
+    int rounds = DEFAULT_ROUNDS;
+    int opt;
+
+    while((opt = getopt(argc, argv, "s:r:")) != -1)
+    {
+        switch(opt)
+        {
+            case 's':
+                seed = strtoull(optarg, NULL, 10);
+                break;
+            case 'r':
+                rounds = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-s seed] [-r rounds]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if(seed == 0)
+    {
+        seed = DEFAULT_SEED;
+    }
+
+    run_isa("scalar", seed, rounds);
+    run_isa("sse2", seed, rounds);
+    run_isa("avx2", seed, rounds);
+
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -7,6 +7,12 @@
  */
 #include <stddef.h>
 
+/* Flags that can be set on a block */
+#define BLOCK_ZEROED  0x1 /* Every byte of data is known to be zero */
+#define BLOCK_SAMPLED 0x2 /* Chunk is a live sample of the heap profiler */
+#define BLOCK_FREE    0x4 /* Block is in a freed list */
+#define BLOCK_SHORT   0x8 /* Data is in a short lived region */
+
 /*
  * This is the metadata for the allocated memory pointed to by 'data'.
  */
@@ -16,8 +22,17 @@ struct block
     struct block* prev;
     pthread_mutex_t lock;
     size_t size;
+    size_t asked;           /* Rounded size the chunk was last asked for */
+    unsigned int flags;
+    unsigned int owner;     /* Thread whose pages hold the data, or 0 */
+    unsigned int cached;    /* Thread whose cache holds the chunk, or 0 */
+    unsigned int site;      /* Call site that allocated it, or 0 */
+    unsigned short tag;     /* Tag it was allocated with, or 0 */
+    unsigned long born;     /* Lifetime clock when it was allocated */
+    unsigned long freed_at; /* Maintenance tick the block was last freed at */
+    size_t slot;            /* Position in its freed index or chunk table */
     void* data;
-} block;
+};
 
 /*
  * Linked list for storing the metadata block structs, with a read write lock
@@ -28,4 +43,4 @@ struct linked_list
     struct block* head;
     struct block* tail;
     struct rw_lock_t rw_lock;
-} linked_list;
+};
@@ -33,7 +33,7 @@ struct rw_lock_t
     unsigned int writing;
     unsigned int readers_waiting;
     unsigned int writers_waiting;
-} rw_lock_t;
+};
 
 /*
  * We can use this function to initialise the rw_lock to its default values
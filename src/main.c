@@ -62,6 +62,24 @@ struct large_block* large_alloc[ARRAY_LENGTH];
 struct huge_block* huge_alloc[ARRAY_LENGTH];
 int alloc_array[STRING_LENGTH];
 
+/* Whether the initial blocks are freed with dealloc_sized instead of dealloc */
+int sized_dealloc = 0;
+
+/*
+ * Free a block using whichever dealloc function was chosen on the command line.
+ */
+void free_block(void* chunk, size_t size)
+{
+    if(sized_dealloc)
+    {
+        dealloc_sized(chunk, size);
+    }
+    else
+    {
+        dealloc(chunk);
+    }
+}
+
 /*
  * This is our worker thread function that will be doing the name allocations.
  * It waits for main to deligate some valid data to allocate, and then goes
@@ -77,6 +95,33 @@ void *thread_func(void *unused)
     return 0;
 }
 
+/*
+ * Stats callback that reports each time the adaptive stratergy switches its
+ * fit policy.
+ */
+void print_event(const struct alloc_event* event)
+{
+    static const char* names[] = {"FIRST", "BEST", "WORST", "ADAPTIVE"};
+
+    if(event->type == EVENT_SOFT_LIMIT)
+    {
+        printf("Soft limit neared (%ld of %ld bytes, pressure %.2f), "
+            "reclaimed %ld bytes\n", event->usage, event->limit,
+            event->pressure, event->reclaimed);
+        return;
+    }
+    if(event->type == EVENT_TAG_QUOTA)
+    {
+        printf("Tag %u over its quota (%ld of %ld bytes)\n", event->tag,
+            event->usage, event->limit);
+        return;
+    }
+
+    printf("Stratergy switched %s -> %s (search %.1f, splits %.2f, "
+        "fragmentation %.2f)\n", names[event->from], names[event->to],
+        event->avg_search_length, event->split_rate, event->fragmentation);
+}
+
 /*
  * Main.
  */
@@ -86,13 +131,13 @@ int main(int argc, char* argv[])
         printf("-->DEBUG ENABLED\n");
     #endif
 
-    /* Parse the args, we only take the stratergy or if no input we set to
-     * first */
+    /* Parse the args, we take the stratergy (or if no input we set to first)
+     * and optionally SIZED to free the initial blocks with dealloc_sized */
     if(argc == 1)
     { 
         set_stratergy(FIRST);
     }
-    else if(argc == 2)
+    else if(argc == 2 || argc == 3)
     {
         if(strcmp(argv[1], "FIRST") == 0)
         {
@@ -106,18 +151,36 @@ int main(int argc, char* argv[])
         {
             set_stratergy(WORST);
         }
+        else if(strcmp(argv[1], "ADAPTIVE") == 0)
+        {
+            set_stratergy(ADAPTIVE);
+        }
         else
         {
             printf("Error: argument '%s' not valid.\n", argv[1]);
             exit(1);
         }
     }
-    else if(argc >= 3)
+    if(argc == 3)
+    {
+        if(strcmp(argv[2], "SIZED") == 0)
+        {
+            sized_dealloc = 1;
+        }
+        else
+        {
+            printf("Error: argument '%s' not valid.\n", argv[2]);
+            exit(1);
+        }
+    }
+    else if(argc >= 4)
     {
         printf("Error: Too many arguments\n");
         exit(1);
     }
 
+    set_stats_callback(print_event);
+
     /* Random seed */
     srand(time(0));
 
@@ -153,6 +216,9 @@ int main(int argc, char* argv[])
     }
 
     /* Dealloc all the allocations in random order */
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+
     for(i = 0; i < ARRAY_LENGTH; ++i)
     {
         rnum = rand() % BLOCK_TYPE_COUNT;
@@ -164,41 +230,45 @@ int main(int argc, char* argv[])
                     if(t_count > 0)
                     {
                         --t_count;
-                        dealloc(tiny_alloc[t_count]);
+                        free_block(tiny_alloc[t_count], sizeof(struct tiny_block));
                         break;    
                     }
                 case 1:
                     if(s_count > 0)
                     {
                         --s_count;
-                        dealloc(small_alloc[s_count]);
+                        free_block(small_alloc[s_count], sizeof(struct small_block));
                         break;    
                     }
                 case 2:
                     if(m_count > 0)
                     {
                         --m_count;
-                        dealloc(medium_alloc[m_count]);
+                        free_block(medium_alloc[m_count], sizeof(struct medium_block));
                         break;    
                     }
                 case 3:
                     if(l_count > 0)
                     {
                         --l_count;
-                        dealloc(large_alloc[l_count]);
+                        free_block(large_alloc[l_count], sizeof(struct large_block));
                         break;    
                     }
                 case 4:
                     if(h_count > 0)
                     {
                         --h_count;
-                        dealloc(huge_alloc[h_count]);
+                        free_block(huge_alloc[h_count], sizeof(struct huge_block));
                         break;    
                     }
             }
         }
     }
 
+    gettimeofday(&end, NULL);
+    double dealloc_time = (double) (end.tv_sec - start.tv_sec)*MILLI
+            + (double) (end.tv_usec - start.tv_usec)/MILLI;
+
     /* Now that we have a bunch of random blocks in our freed list
      * we can start allocating random strings and test the performace
      * of the allocation algorithms. */
@@ -217,7 +287,6 @@ int main(int argc, char* argv[])
         alloc_array[j] = getline(&line, &len, names);
     }
 
-    struct timeval start, end;
     pthread_t thr_ids[NO_OF_THREADS];
     gettimeofday(&start, NULL);
 
@@ -241,6 +310,8 @@ int main(int argc, char* argv[])
     list();
     printf("Time to allocate: %.3fms\n", (double) (end.tv_sec - start.tv_sec)*MILLI
             + (double) (end.tv_usec - start.tv_usec)/MILLI);
+    printf("Time to deallocate (%s): %.3fms\n", 
+            sized_dealloc ? "dealloc_sized" : "dealloc", dealloc_time);
 
     fclose(names);
     printf("Main terminated.\n");
@@ -0,0 +1,724 @@
+/*
+ * Implementation of pheap.h
+ *
+ * The free chunks of a heap are kept in power of two size lists that only
+ * live as long as the heap is open. Rather than walking the whole file when
+ * it is opened, the chunks that were below the top at the time are scanned a
+ * few at a time whenever an allocation cant be met from the lists, merging
+ * free chunks that sit next to each other as they are found. A chunk being
+ * freed is merged with the free chunks after it straight away, and handed
+ * back to the top if it ends the heap. The lists are linked both ways, the
+ * link back kept in the first bytes of a free chunk's data, so a chunk can be
+ * taken out of the middle of one as it is merged.
+ *
+ * Each allocation or deallocation is committed by a single 8 byte store to
+ * the chunk's header, once any new header it needs has been written. When it
+ * also has to move the top or store the chunk's offset for the caller, the
+ * whole change is written to the redo record in the file header first, and
+ * replayed by pheap_open() if the process died before it was finished.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "pheap.h"
+
+/* Offset of the first chunk, leaving the header a page of its own */
+#define PHEAP_START 4096
+
+/* Chunks are sized and aligned to 16 bytes, header included */
+#define PHEAP_ALIGN 16
+#define PHEAP_MIN_CHUNK (sizeof(struct pheap_chunk) + PHEAP_ALIGN)
+
+/* Lowest bit of a chunk's size, set while it is allocated */
+#define PHEAP_ALLOCATED 0x1
+
+/* Power of two free lists, and the chunks scanned for free ones at a time */
+#define PHEAP_LISTS 64
+#define PHEAP_SCAN_CHUNKS 64
+
+/*
+ * The redo record follows the header in its page, so older tools reading the
+ * header dont need to know about it.
+ */
+struct pheap_file
+{
+    struct pheap_header header;
+    struct pheap_redo redo;
+};
+
+/*
+ * An open heap.
+ *
+ * scan     - Offset of the next chunk to scan for free ones.
+ * scan_end - The top as the heap was opened. Chunks allocated after it are
+ *            put straight into the lists as they are freed.
+ */
+struct pheap
+{
+    char* base;
+    struct pheap_file* file;
+    size_t size;
+    int fd;
+    int flags;
+    pthread_mutex_t lock;
+    uint64_t scan;
+    uint64_t scan_end;
+    uint64_t free_lists[PHEAP_LISTS];
+};
+
+/*
+ * Make sure the bytes written so far reach the file before any written after.
+ * Stores to a shared mapping reach the file in the page cache as they are
+ * made, so only the compiler and CPU need holding back unless the heap was
+ * opened with PHEAP_SYNC.
+ */
+static int persist(struct pheap* heap, const void* start, size_t size)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if(!(heap->flags & PHEAP_SYNC))
+    {
+        return 0;
+    }
+
+    long page = sysconf(_SC_PAGESIZE);
+    uintptr_t first = (uintptr_t) start & ~(page - 1);
+    uintptr_t end = (uintptr_t) start + size;
+
+    return msync((void*) first, end - first, MS_SYNC);
+}
+
+/*
+ * Returns the header of the chunk at the given offset
+ */
+static inline struct pheap_chunk* chunk_at(struct pheap* heap, uint64_t offset)
+{
+    return (struct pheap_chunk*) (heap->base + offset);
+}
+
+/*
+ * Returns the free list for chunks of the given size
+ */
+static inline int list_index(uint64_t size)
+{
+    return 63 - __builtin_clzll(size);
+}
+
+/*
+ * Returns the link back to the chunk before a free chunk in its list, kept
+ * in the first bytes of its data
+ */
+static inline uint64_t* prev_link(struct pheap* heap, uint64_t offset)
+{
+    return (uint64_t*) (chunk_at(heap, offset) + 1);
+}
+
+/*
+ * Add a free chunk to its list. The links are only used while the heap is
+ * open, so they arent persisted.
+ */
+static void list_push(struct pheap* heap, uint64_t offset)
+{
+    struct pheap_chunk* chunk = chunk_at(heap, offset);
+    int index = list_index(chunk->size);
+
+    chunk->next = heap->free_lists[index];
+    *prev_link(heap, offset) = PHEAP_NULL;
+    if(chunk->next != PHEAP_NULL)
+    {
+        *prev_link(heap, chunk->next) = offset;
+    }
+    heap->free_lists[index] = offset;
+}
+
+/*
+ * Take a free chunk out of its list
+ */
+static void list_remove(struct pheap* heap, uint64_t offset)
+{
+    struct pheap_chunk* chunk = chunk_at(heap, offset);
+    uint64_t prev = *prev_link(heap, offset);
+
+    if(prev != PHEAP_NULL)
+    {
+        chunk_at(heap, prev)->next = chunk->next;
+    }
+    else
+    {
+        heap->free_lists[list_index(chunk->size)] = chunk->next;
+    }
+    if(chunk->next != PHEAP_NULL)
+    {
+        *prev_link(heap, chunk->next) = prev;
+    }
+}
+
+/*
+ * Returns 1 if 'bytes' at the offset lie between the first chunk and the end
+ * of the file, and the offset is a multiple of 'align'.
+ */
+static inline int in_heap(struct pheap* heap, uint64_t offset, uint64_t bytes,
+    uint64_t align)
+{
+    return offset >= PHEAP_START && offset <= heap->size - bytes &&
+        offset % align == 0;
+}
+
+/*
+ * Replay the redo record if it was written but not finished, then clear it.
+ * A record pointing outside of the heap can only come from a damaged file,
+ * so it is dropped rather than written through.
+ */
+static void redo(struct pheap* heap)
+{
+    struct pheap_redo* record = &heap->file->redo;
+
+    if(!record->valid)
+    {
+        return;
+    }
+
+    if(!in_heap(heap, record->chunk, sizeof(struct pheap_chunk),
+        PHEAP_ALIGN) || record->top > heap->size ||
+        record->top % PHEAP_ALIGN != 0 || (record->dest != PHEAP_NULL &&
+        !in_heap(heap, record->dest, sizeof(uint64_t), sizeof(uint64_t))))
+    {
+        #ifdef DEBUG
+        printf("-->Bad pheap redo record for chunk %ld, dropped it\n",
+            record->chunk);
+        #endif
+        record->valid = 0;
+        persist(heap, record, sizeof(struct pheap_redo));
+        return;
+    }
+
+    chunk_at(heap, record->chunk)->size = record->size;
+    if(record->top > heap->file->header.top)
+    {
+        heap->file->header.top = record->top;
+    }
+    persist(heap, chunk_at(heap, record->chunk), sizeof(struct pheap_chunk));
+    persist(heap, &heap->file->header, sizeof(struct pheap_header));
+    if(record->dest != PHEAP_NULL)
+    {
+        *(uint64_t*) (heap->base + record->dest) = record->value;
+        persist(heap, heap->base + record->dest, sizeof(uint64_t));
+    }
+
+    record->valid = 0;
+    persist(heap, record, sizeof(struct pheap_redo));
+}
+
+/*
+ * Commit a change to a chunk's size. A change that also moves the top or has
+ * to store its result in the heap goes through the redo record, otherwise
+ * the single store to the chunk's size is enough.
+ */
+static void commit(struct pheap* heap, uint64_t offset, uint64_t size,
+    uint64_t top, uint64_t* dest, uint64_t value)
+{
+    struct pheap_redo* record = &heap->file->redo;
+    uint64_t dest_offset = PHEAP_NULL;
+
+    /* Only a destination in the heap survives a restart, anywhere else it
+     * is simply written once the change is made. It is checked the same way
+     * redo() checks it */
+    if((char*) dest >= heap->base && (char*) dest < heap->base + heap->size &&
+        in_heap(heap, (char*) dest - heap->base, sizeof(uint64_t),
+        sizeof(uint64_t)))
+    {
+        dest_offset = (char*) dest - heap->base;
+    }
+
+    if(top == 0 && dest_offset == PHEAP_NULL)
+    {
+        __atomic_store_n(&chunk_at(heap, offset)->size, size,
+            __ATOMIC_RELEASE);
+        persist(heap, chunk_at(heap, offset), sizeof(struct pheap_chunk));
+    }
+    else
+    {
+        record->chunk = offset;
+        record->size = size;
+        record->top = top;
+        record->dest = dest_offset;
+        record->value = value;
+        persist(heap, record, sizeof(struct pheap_redo));
+        record->valid = 1;
+        persist(heap, record, sizeof(struct pheap_redo));
+
+        redo(heap);
+    }
+
+    if(dest != NULL && dest_offset == PHEAP_NULL)
+    {
+        *dest = value;
+    }
+}
+
+/*
+ * Scan the next few chunks below the top the heap was opened with, merging
+ * and listing the free ones. Returns 0 once there is nothing left to scan.
+ */
+static int scan_chunks(struct pheap* heap)
+{
+    if(heap->scan >= heap->scan_end)
+    {
+        return 0;
+    }
+
+    for(int i = 0; i < PHEAP_SCAN_CHUNKS && heap->scan < heap->scan_end; ++i)
+    {
+        struct pheap_chunk* chunk = chunk_at(heap, heap->scan);
+        uint64_t size = chunk->size & ~(uint64_t) PHEAP_ALLOCATED;
+
+        /* A chunk running past the top can only come from a damaged file,
+         * so nothing past it is trusted */
+        if(size < PHEAP_MIN_CHUNK || size % PHEAP_ALIGN != 0 ||
+            size > heap->scan_end - heap->scan)
+        {
+            #ifdef DEBUG
+            printf("-->Bad pheap chunk at %ld, stopped scanning\n",
+                heap->scan);
+            #endif
+            heap->scan = heap->scan_end;
+            break;
+        }
+
+        if(chunk->size & PHEAP_ALLOCATED)
+        {
+            heap->scan += size;
+            continue;
+        }
+
+        /* The chunks after a free one that are free too are merged into it.
+         * The merged size covers only free chunks, so it is safe to store
+         * whenever it is made */
+        uint64_t merged = size;
+        while(heap->scan + merged < heap->scan_end)
+        {
+            uint64_t next = chunk_at(heap, heap->scan + merged)->size;
+            if(next & PHEAP_ALLOCATED || next < PHEAP_MIN_CHUNK ||
+                next > heap->scan_end - heap->scan - merged)
+            {
+                break;
+            }
+            merged += next;
+        }
+        if(merged != size)
+        {
+            __atomic_store_n(&chunk->size, merged, __ATOMIC_RELEASE);
+            persist(heap, chunk, sizeof(struct pheap_chunk));
+        }
+
+        list_push(heap, heap->scan);
+        heap->scan += merged;
+    }
+
+    return 1;
+}
+
+/*
+ * Take the first chunk of at least 'size' bytes out of the free lists,
+ * returning its offset or PHEAP_NULL if there isnt one.
+ */
+static uint64_t list_take(struct pheap* heap, uint64_t size)
+{
+    for(int i = list_index(size); i < PHEAP_LISTS; ++i)
+    {
+        for(uint64_t offset = heap->free_lists[i]; offset != PHEAP_NULL;
+            offset = chunk_at(heap, offset)->next)
+        {
+            if(chunk_at(heap, offset)->size >= size)
+            {
+                list_remove(heap, offset);
+                return offset;
+            }
+        }
+    }
+    return PHEAP_NULL;
+}
+
+/*
+ * Allocate a chunk, storing its offset at 'dest' in the same commit
+ */
+void* pheap_alloc_to(struct pheap* heap, size_t size, uint64_t* dest)
+{
+    uint64_t need = (size + sizeof(struct pheap_chunk) + PHEAP_ALIGN - 1) &
+        ~(uint64_t) (PHEAP_ALIGN - 1);
+    uint64_t offset;
+
+    if(size > heap->size)
+    {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&heap->lock);
+
+    while((offset = list_take(heap, need)) == PHEAP_NULL && scan_chunks(heap));
+
+    if(offset != PHEAP_NULL)
+    {
+        /* The remainder's header is written before the chunk is shrunk, so
+         * until the commit it is still hidden inside the free chunk */
+        uint64_t have = chunk_at(heap, offset)->size;
+        if(have - need >= PHEAP_MIN_CHUNK)
+        {
+            struct pheap_chunk* rest = chunk_at(heap, offset + need);
+            rest->size = have - need;
+            rest->next = PHEAP_NULL;
+            persist(heap, rest, sizeof(struct pheap_chunk));
+        }
+        else
+        {
+            need = have;
+        }
+
+        commit(heap, offset, need | PHEAP_ALLOCATED, 0, dest,
+            offset + sizeof(struct pheap_chunk));
+
+        if(have != need)
+        {
+            list_push(heap, offset + need);
+        }
+    }
+    else
+    {
+        /* Carve the chunk from the top. Its header lies past the top until
+         * the commit moves the top over it */
+        uint64_t top = heap->file->header.top;
+        if(need > heap->size - top)
+        {
+            pthread_mutex_unlock(&heap->lock);
+            return NULL;
+        }
+
+        offset = top;
+        chunk_at(heap, offset)->size = need | PHEAP_ALLOCATED;
+        chunk_at(heap, offset)->next = PHEAP_NULL;
+        persist(heap, chunk_at(heap, offset), sizeof(struct pheap_chunk));
+
+        commit(heap, offset, need | PHEAP_ALLOCATED, top + need, dest,
+            offset + sizeof(struct pheap_chunk));
+    }
+
+    pthread_mutex_unlock(&heap->lock);
+
+    #ifdef DEBUG
+    printf("-->Allocated pheap chunk of %ld bytes at %ld\n", need, offset);
+    #endif
+
+    return heap->base + offset + sizeof(struct pheap_chunk);
+}
+
+/*
+ * Create a new heap file 'size' bytes long and write its header
+ */
+static int create_file(int fd, size_t size)
+{
+    struct pheap_file file;
+
+    if(ftruncate(fd, size) != 0)
+    {
+        return -1;
+    }
+
+    /* The magic is written last, so a file only half created is never
+     * taken for a heap */
+    memset(&file, 0, sizeof(file));
+    file.header.version = PHEAP_VERSION;
+    file.header.chunk_size = sizeof(struct pheap_chunk);
+    file.header.size = size;
+    file.header.top = PHEAP_START;
+    file.header.root = PHEAP_NULL;
+    if(pwrite(fd, &file, sizeof(file), 0) != sizeof(file) || fsync(fd) != 0)
+    {
+        return -1;
+    }
+
+    if(pwrite(fd, PHEAP_MAGIC, sizeof(file.header.magic), 0) !=
+        sizeof(file.header.magic) || fsync(fd) != 0)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Open or create the heap file and map it
+ */
+struct pheap* pheap_open(const char* path, size_t size, int flags)
+{
+    struct stat info;
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if(fd < 0)
+    {
+        return NULL;
+    }
+    if(fstat(fd, &info) != 0)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    if(info.st_size == 0)
+    {
+        size = (size + PHEAP_START - 1) & ~(size_t) (PHEAP_START - 1);
+        if(size < PHEAP_START * 2 || create_file(fd, size) != 0)
+        {
+            close(fd);
+            return NULL;
+        }
+    }
+    else
+    {
+        size = info.st_size;
+    }
+
+    struct pheap* heap = mmap(NULL, sizeof(struct pheap),
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(heap == MAP_FAILED)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    heap->base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(heap->base == MAP_FAILED)
+    {
+        munmap(heap, sizeof(struct pheap));
+        close(fd);
+        return NULL;
+    }
+
+    heap->file = (struct pheap_file*) heap->base;
+    heap->size = size;
+    heap->fd = fd;
+    heap->flags = flags;
+
+    struct pheap_header* header = &heap->file->header;
+    if(size < PHEAP_START * 2 ||
+        memcmp(header->magic, PHEAP_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != PHEAP_VERSION ||
+        header->chunk_size != sizeof(struct pheap_chunk) ||
+        header->size != size || header->top < PHEAP_START ||
+        header->top > size || header->top % PHEAP_ALIGN != 0)
+    {
+        munmap(heap->base, size);
+        munmap(heap, sizeof(struct pheap));
+        close(fd);
+        return NULL;
+    }
+
+    pthread_mutex_init(&heap->lock, NULL);
+    redo(heap);
+    heap->scan = PHEAP_START;
+    heap->scan_end = header->top;
+
+    #ifdef DEBUG
+    printf("-->Opened pheap '%s', %ld of %ld bytes below the top\n", path,
+        heap->scan_end, size);
+    #endif
+
+    return heap;
+}
+
+/*
+ * Write out the whole heap and unmap it
+ */
+int pheap_close(struct pheap* heap)
+{
+    int result = msync(heap->base, heap->size, MS_SYNC);
+
+    if(munmap(heap->base, heap->size) != 0 || close(heap->fd) != 0)
+    {
+        result = -1;
+    }
+    pthread_mutex_destroy(&heap->lock);
+    munmap(heap, sizeof(struct pheap));
+
+    return result;
+}
+
+/*
+ * Allocate a chunk in the heap
+ */
+void* pheap_alloc(struct pheap* heap, size_t size)
+{
+    return pheap_alloc_to(heap, size, NULL);
+}
+
+/*
+ * Merge the free chunks after the free chunk at the offset into it, taking
+ * them out of their lists (or skipping the scan over the next one), and
+ * return its merged size. The merged size covers only free chunks, so it is
+ * safe to store whenever it is made. A chunk the scan has yet to reach only
+ * takes in those it hasnt reached either, which arent in a list.
+ */
+static uint64_t merge_next(struct pheap* heap, uint64_t offset, uint64_t size)
+{
+    uint64_t top = heap->file->header.top;
+    uint64_t merged = size;
+
+    while(offset + merged < top)
+    {
+        uint64_t next = offset + merged;
+        uint64_t next_size = chunk_at(heap, next)->size;
+        if(next_size & PHEAP_ALLOCATED || next_size < PHEAP_MIN_CHUNK ||
+            next_size % PHEAP_ALIGN != 0 || next_size > top - next)
+        {
+            break;
+        }
+
+        /* Only the chunk the scan is about to look at can follow a chunk it
+         * has passed */
+        if(next >= heap->scan && next < heap->scan_end)
+        {
+            if(offset < heap->scan && next != heap->scan)
+            {
+                break;
+            }
+            if(next == heap->scan)
+            {
+                heap->scan += next_size;
+            }
+        }
+        else
+        {
+            list_remove(heap, next);
+        }
+        merged += next_size;
+    }
+
+    if(merged != size)
+    {
+        __atomic_store_n(&chunk_at(heap, offset)->size, merged,
+            __ATOMIC_RELEASE);
+        persist(heap, chunk_at(heap, offset), sizeof(struct pheap_chunk));
+    }
+    return merged;
+}
+
+/*
+ * Mark a chunk free and merge it with the free chunks after it, then hand it
+ * back to the top if it ends the heap, or list it unless the scan has yet to
+ * reach it (in which case the scan lists it). A pointer that isnt the data of an allocated chunk below the top
+ * terminates the program.
+ */
+void pheap_free(struct pheap* heap, void* chunk)
+{
+    if(chunk == NULL)
+    {
+        return;
+    }
+
+    if((char*) chunk < heap->base + PHEAP_START + sizeof(struct pheap_chunk) ||
+        (char*) chunk >= heap->base + heap->size)
+    {
+        printf("Attempted to free a pointer outside of the pheap: %p\n",
+            chunk);
+        abort();
+    }
+
+    uint64_t offset = (char*) chunk - heap->base - sizeof(struct pheap_chunk);
+    struct pheap_chunk* header = chunk_at(heap, offset);
+
+    pthread_mutex_lock(&heap->lock);
+
+    uint64_t top = heap->file->header.top;
+    uint64_t size = header->size & ~(uint64_t) PHEAP_ALLOCATED;
+    if(!in_heap(heap, offset, sizeof(struct pheap_chunk), PHEAP_ALIGN) ||
+        offset >= top || size < PHEAP_MIN_CHUNK || size % PHEAP_ALIGN != 0 ||
+        size > top - offset)
+    {
+        printf("Attempted to free an invalid pheap chunk: %p\n", chunk);
+        abort();
+    }
+    if(!(header->size & PHEAP_ALLOCATED))
+    {
+        printf("Attempted to free a pheap chunk twice: %p\n", chunk);
+        abort();
+    }
+
+    commit(heap, offset, size, 0, NULL, 0);
+    size = merge_next(heap, offset, size);
+
+    /* The chunk is already free, so moving the top back over it is a single
+     * store whichever side of it a crash falls */
+    if(offset + size == top)
+    {
+        __atomic_store_n(&heap->file->header.top, offset, __ATOMIC_RELEASE);
+        persist(heap, &heap->file->header, sizeof(struct pheap_header));
+        if(heap->scan_end > offset)
+        {
+            heap->scan_end = offset;
+        }
+
+        #ifdef DEBUG
+        printf("-->Moved pheap top back to %ld\n", offset);
+        #endif
+    }
+    else if(offset < heap->scan || offset >= heap->scan_end)
+    {
+        list_push(heap, offset);
+    }
+
+    pthread_mutex_unlock(&heap->lock);
+}
+
+/*
+ * Returns the root chunk
+ */
+void* pheap_root(struct pheap* heap)
+{
+    uint64_t root = __atomic_load_n(&heap->file->header.root,
+        __ATOMIC_ACQUIRE);
+    return root == PHEAP_NULL ? NULL : heap->base + root;
+}
+
+/*
+ * Set the root chunk with a single store
+ */
+void pheap_set_root(struct pheap* heap, void* chunk)
+{
+    __atomic_store_n(&heap->file->header.root, pheap_offset(heap, chunk),
+        __ATOMIC_RELEASE);
+    persist(heap, &heap->file->header, sizeof(struct pheap_header));
+}
+
+/*
+ * Write part of the heap out to the file, whether or not it was opened with
+ * PHEAP_SYNC
+ */
+int pheap_persist(struct pheap* heap, const void* start, size_t size)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    uintptr_t first = (uintptr_t) start & ~(page - 1);
+    uintptr_t end = (uintptr_t) start + size;
+
+    (void) heap;
+    return msync((void*) first, end - first, MS_SYNC);
+}
+
+/*
+ * Returns the offset of a pointer into the heap
+ */
+uint64_t pheap_offset(struct pheap* heap, const void* chunk)
+{
+    return chunk == NULL ? PHEAP_NULL : (uint64_t) ((char*) chunk - heap->base);
+}
+
+/*
+ * Returns the pointer to an offset in the heap
+ */
+void* pheap_ptr(struct pheap* heap, uint64_t offset)
+{
+    return offset == PHEAP_NULL ? NULL : heap->base + offset;
+}
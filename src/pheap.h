@@ -0,0 +1,141 @@
+/*
+ * Header file for pheap.c - A persistent heap kept in a memory mapped file,
+ * so the chunks allocated in it (and whatever they point to within it)
+ * survive the process and can be used again straight after a restart.
+ *
+ * The file may be mapped at a different address each time it is opened, so
+ * the heap never stores a raw pointer. Every chunk's header, the links of the
+ * free lists and the root are offsets from the start of the file, and the
+ * chunks themselves should link to each other with pheap_offset() and
+ * pheap_ptr() in the same way.
+ *
+ * A pheap file is a pheap_header, padded out to a page, followed by chunks
+ * that each start with a pheap_chunk header. Chunks are carved from the top
+ * of the file and their headers are always written before the top is moved
+ * past them, so the chunks below the top can be walked by their sizes alone
+ * whatever point a crash happened at.
+ */
+#include <stdint.h>
+#include <stddef.h>
+
+/* Magic number and version at the start of every pheap file */
+#define PHEAP_MAGIC "M2PHEAP"
+#define PHEAP_VERSION 1
+
+/* Offset that doesnt point at anything, as NULL for a pointer */
+#define PHEAP_NULL 0
+
+/*
+ * Flags for pheap_open().
+ *
+ * PHEAP_SYNC - msync() each step of an allocation or deallocation before the
+ *              next is written, so the heap is consistent after a power
+ *              failure and not only after the process crashes.
+ */
+#define PHEAP_SYNC 0x1
+
+/*
+ * Header at the start of a pheap file.
+ */
+struct pheap_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t chunk_size; /* Bytes of a pheap_chunk, to check the layout */
+    uint64_t size;       /* Bytes of the file */
+    uint64_t top;        /* Offset of the first byte never allocated */
+    uint64_t root;       /* Offset of the root chunk, or PHEAP_NULL */
+};
+
+/*
+ * A change to the heap that has to be made all at once, kept straight after
+ * the pheap_header. Replaying it sets the chunk's size, raises the top and
+ * stores the value at 'dest'. It is only replayed while 'valid' is set, and
+ * only if the chunk and 'dest' lie inside the heap.
+ */
+struct pheap_redo
+{
+    uint64_t valid;
+    uint64_t chunk;
+    uint64_t size;
+    uint64_t top;
+    uint64_t dest;
+    uint64_t value;
+};
+
+/*
+ * Header before every chunk's data. The size includes the header and is a
+ * multiple of 16, leaving its lowest bit to mark the chunk as allocated so
+ * the size and state of a chunk are always written together. The link to the
+ * next chunk of a free list is only meaningful while the heap is open, the
+ * lists are rebuilt after the file is reopened.
+ */
+struct pheap_chunk
+{
+    uint64_t size;
+    uint64_t next;
+};
+
+/* A persistent heap opened by pheap_open() */
+struct pheap;
+
+/*
+ * Open the pheap file at 'path', creating it 'size' bytes long if it doesnt
+ * exist (an existing file keeps its size). The free chunks are found lazily
+ * by later allocations, so opening a heap only maps the file and the chunks
+ * in it can be used straight away. Returns NULL if the file couldnt be opened
+ * or mapped, or isnt a pheap file.
+ */
+struct pheap* pheap_open(const char* path, size_t size, int flags);
+
+/*
+ * Write every change out to the file and close the heap. Returns 0 on success
+ * or -1 if the file couldnt be written.
+ */
+int pheap_close(struct pheap* heap);
+
+/*
+ * Allocate a chunk of 'size' bytes in the heap, returning NULL if the file
+ * is full.
+ */
+void* pheap_alloc(struct pheap* heap, size_t size);
+
+/*
+ * Allocate a chunk as pheap_alloc() does, storing the offset of its data at
+ * 'dest' (if it isnt NULL) as part of the same commit. When 'dest' is in the
+ * heap, such as a link in another chunk, a crash leaves either both or
+ * neither written, so the chunk is never leaked.
+ */
+void* pheap_alloc_to(struct pheap* heap, size_t size, uint64_t* dest);
+
+/*
+ * Deallocate a chunk allocated by pheap_alloc(). It is merged with any free
+ * chunks that follow it, and if it then ends the heap the top is moved back
+ * over it. The program terminates if the pointer isnt the data of a chunk of
+ * the heap, or the chunk is already free.
+ */
+void pheap_free(struct pheap* heap, void* chunk);
+
+/*
+ * Returns the root chunk set by pheap_set_root(), or NULL. The root is how
+ * the data in a reopened heap is found again.
+ */
+void* pheap_root(struct pheap* heap);
+
+/*
+ * Make the passed in chunk (or NULL) the root of the heap.
+ */
+void pheap_set_root(struct pheap* heap, void* chunk);
+
+/*
+ * Write 'size' bytes of a chunk's data from 'start' out to the file, so they
+ * survive a power failure. Returns 0 on success or -1 if it failed.
+ */
+int pheap_persist(struct pheap* heap, const void* start, size_t size);
+
+/*
+ * Convert between pointers into the heap and offsets from the start of its
+ * file, which stay the same wherever the file is mapped.
+ */
+uint64_t pheap_offset(struct pheap* heap, const void* chunk);
+void* pheap_ptr(struct pheap* heap, uint64_t offset);
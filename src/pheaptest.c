@@ -0,0 +1,452 @@
+/*
+ * Test of the persistent heap in pheap.c.
+ *
+ * A heap file is created and filled with a list of chunks linked by offsets,
+ * each allocated with pheap_alloc_to() straight into the link of the chunk
+ * before it, with some of them freed again. The heap is closed and reopened
+ * and the list walked from the root, checking every chunk is still there,
+ * and the freed chunks are allocated again. A commit interrupted after its
+ * redo record was written is then made by hand in the file, and reopening
+ * has to finish it, while redo records pointing outside of the heap have to
+ * be dropped without touching it. Last, chunks freed next to each other and
+ * at the end of a new heap have to be merged and handed back to the top, and
+ * freeing a chunk twice or a pointer that isnt a chunk has to terminate.
+ *
+ * usage: pheaptest.out [-f file] [-n chunks]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include "pheap.h"
+
+/* Default values of the command line options */
+#define DEFAULT_FILE "/tmp/pheaptest.heap"
+#define DEFAULT_CHUNKS 1000
+
+/* Bytes of the heap file created */
+#define HEAP_SIZE (4 * 1024 * 1024)
+
+/* Offset of the first chunk, as in pheap.c */
+#define HEAP_START 4096
+
+/*
+ * A chunk of the list kept in the heap. 'next' is 8 bytes into the data, so
+ * it is aligned to its size but not to a whole chunk.
+ */
+struct node
+{
+    uint64_t value;
+    uint64_t next;
+    char fill[48];
+};
+
+static unsigned long failures = 0;
+
+static void check(int passed, const char* what)
+{
+    if(!passed)
+    {
+        printf("FAILED: %s\n", what);
+        ++failures;
+    }
+}
+
+/*
+ * Returns the header of the chunk whose data is at the offset
+ */
+static struct pheap_chunk* chunk_of(struct pheap* heap, uint64_t offset)
+{
+    return (struct pheap_chunk*) pheap_ptr(heap, offset) - 1;
+}
+
+/*
+ * Walk the list from the root, returning the chunks in it, or -1 if a
+ * chunk is out of order or has lost its data.
+ */
+static long walk(struct pheap* heap)
+{
+    struct node* root = pheap_root(heap);
+    uint64_t next_value = 0;
+    long count = 0;
+
+    if(root == NULL)
+    {
+        return -1;
+    }
+    for(uint64_t offset = root->next; offset != PHEAP_NULL;
+        offset = ((struct node*) pheap_ptr(heap, offset))->next)
+    {
+        struct node* node = pheap_ptr(heap, offset);
+        if(node->value < next_value || node->fill[0] != (char) node->value)
+        {
+            return -1;
+        }
+        next_value = node->value + 1;
+        ++count;
+    }
+    return count;
+}
+
+/*
+ * Write a redo record into the closed heap file, as pheap.c would just before
+ * a crash.
+ */
+static int write_redo(const char* path, const struct pheap_redo* record)
+{
+    int fd = open(path, O_RDWR);
+    if(fd < 0)
+    {
+        return -1;
+    }
+    int result = pwrite(fd, record, sizeof(struct pheap_redo),
+        sizeof(struct pheap_header)) == sizeof(struct pheap_redo) ? 0 : -1;
+    close(fd);
+    return result;
+}
+
+/*
+ * Read back the header and redo record of a closed heap file
+ */
+static int read_file(const char* path, struct pheap_header* header,
+    struct pheap_redo* record)
+{
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+    {
+        return -1;
+    }
+    int result = pread(fd, header, sizeof(struct pheap_header), 0) ==
+        sizeof(struct pheap_header) && pread(fd, record,
+        sizeof(struct pheap_redo), sizeof(struct pheap_header)) ==
+        sizeof(struct pheap_redo) ? 0 : -1;
+    close(fd);
+    return result;
+}
+
+/*
+ * Create a heap holding a list of 'chunks' nodes, every third one of which
+ * is unlinked and freed, then reopen it and check the rest are still there.
+ */
+static void test_reopen(const char* path, long chunks)
+{
+    struct pheap_header header;
+    struct pheap_redo record;
+    long freed = (chunks + 1) / 3;
+    struct pheap* heap = pheap_open(path, HEAP_SIZE, 0);
+    check(heap != NULL, "create");
+    if(heap == NULL)
+    {
+        return;
+    }
+
+    struct node* root = pheap_alloc(heap, sizeof(struct node));
+    root->value = 0;
+    root->next = PHEAP_NULL;
+    pheap_set_root(heap, root);
+
+    struct node* tail = root;
+    for(long i = 0; i < chunks; ++i)
+    {
+        struct node* node = pheap_alloc_to(heap, sizeof(struct node),
+            &tail->next);
+        check(node != NULL && pheap_ptr(heap, tail->next) == node,
+            "alloc_to");
+        if(node == NULL)
+        {
+            break;
+        }
+        node->value = i;
+        node->next = PHEAP_NULL;
+        memset(node->fill, (char) i, sizeof(node->fill));
+        tail = node;
+    }
+
+    /* The top before any are freed, as freeing the last node moves it back */
+    uint64_t full_top = pheap_offset(heap, tail) - sizeof(struct pheap_chunk) +
+        (chunk_of(heap, pheap_offset(heap, tail))->size & ~(uint64_t) 0x1);
+
+    /* Unlink and free every third node */
+    struct node* prev = root;
+    while(prev->next != PHEAP_NULL)
+    {
+        struct node* node = pheap_ptr(heap, prev->next);
+        if(node->value % 3 == 1)
+        {
+            prev->next = node->next;
+            pheap_free(heap, node);
+        }
+        else
+        {
+            prev = node;
+        }
+    }
+    check(walk(heap) == chunks - freed, "walk before reopening");
+    check(pheap_close(heap) == 0, "close");
+
+    heap = pheap_open(path, 0, 0);
+    check(heap != NULL, "reopen");
+    if(heap == NULL)
+    {
+        return;
+    }
+    check(walk(heap) == chunks - freed, "walk after reopening");
+
+    /* The freed chunks are found again rather than the heap growing */
+    for(long i = 0; i < freed; ++i)
+    {
+        check(pheap_alloc(heap, sizeof(struct node)) != NULL,
+            "alloc after reopening");
+    }
+    check(pheap_close(heap) == 0, "close after reallocating");
+    check(read_file(path, &header, &record) == 0 && header.top == full_top,
+        "reuse of freed chunks");
+}
+
+/*
+ * Leave a commit that carves a chunk from the top and links it to the root
+ * half made, as if the process died once the redo record was valid, and
+ * check reopening finishes it.
+ */
+static void test_interrupted(const char* path)
+{
+    struct pheap_header header;
+    struct pheap_redo record;
+    struct pheap* heap = pheap_open(path, 0, 0);
+    check(heap != NULL, "open for an interrupted commit");
+    if(heap == NULL)
+    {
+        return;
+    }
+
+    struct node* root = pheap_root(heap);
+    uint64_t link = pheap_offset(heap, &root->next);
+    uint64_t old_next = root->next;
+    check(pheap_close(heap) == 0, "close before an interrupted commit");
+    check(read_file(path, &header, &record) == 0 && !record.valid,
+        "no redo record left by close");
+
+    /* The chunk's header is written past the top before the record */
+    uint64_t top = header.top;
+    uint64_t size = sizeof(struct pheap_chunk) + sizeof(struct node);
+    struct pheap_chunk chunk = {size | 0x1, PHEAP_NULL};
+    int fd = open(path, O_RDWR);
+    check(fd >= 0 && pwrite(fd, &chunk, sizeof(chunk), top) == sizeof(chunk),
+        "write chunk header");
+    if(fd >= 0)
+    {
+        close(fd);
+    }
+
+    record.valid = 1;
+    record.chunk = top;
+    record.size = size | 0x1;
+    record.top = top + size;
+    record.dest = link;
+    record.value = top + sizeof(struct pheap_chunk);
+    check(write_redo(path, &record) == 0, "write redo record");
+
+    heap = pheap_open(path, 0, 0);
+    check(heap != NULL, "reopen after an interrupted commit");
+    if(heap == NULL)
+    {
+        return;
+    }
+    root = pheap_root(heap);
+    check(root->next == top + sizeof(struct pheap_chunk),
+        "link replayed by reopening");
+    check(chunk_of(heap, root->next)->size == (size | 0x1),
+        "chunk replayed by reopening");
+    check(pheap_close(heap) == 0, "close after replaying");
+    check(read_file(path, &header, &record) == 0 && !record.valid &&
+        header.top == top + size, "top replayed by reopening");
+
+    heap = pheap_open(path, 0, 0);
+    check(heap != NULL, "reopen after replaying");
+    if(heap == NULL)
+    {
+        return;
+    }
+    root = pheap_root(heap);
+
+    /* Put the list back so it can be walked again. The replayed chunk ends
+     * the heap, so freeing it moves the top back */
+    struct node* node = pheap_ptr(heap, root->next);
+    node->value = 0;
+    node->next = old_next;
+    memset(node->fill, 0, sizeof(node->fill));
+    pheap_free(heap, node);
+    root->next = old_next;
+    check(pheap_close(heap) == 0, "close after an interrupted commit");
+    check(read_file(path, &header, &record) == 0 && header.top == top,
+        "top moved back by freeing the last chunk");
+}
+
+/*
+ * Leave redo records pointing outside of the heap, or misaligned, and check
+ * reopening drops them without changing anything.
+ */
+static void test_bad_records(const char* path, long kept)
+{
+    struct pheap_header before;
+    struct pheap_header after;
+    struct pheap_redo record;
+    check(read_file(path, &before, &record) == 0, "read header");
+
+    struct pheap_redo bad[] =
+    {
+        {1, before.size, 0x11, 0, PHEAP_NULL, 0},
+        {1, HEAP_START + 8, 0x11, 0, PHEAP_NULL, 0},
+        {1, HEAP_START - 16, 0x11, 0, PHEAP_NULL, 0},
+        {1, HEAP_START, 0x11, before.size + 16, PHEAP_NULL, 0},
+        {1, HEAP_START, 0x11, 0, before.size, 1},
+        {1, HEAP_START, 0x11, 0, HEAP_START + 4, 1},
+        {1, HEAP_START, 0x11, 0, 8, 1}
+    };
+
+    for(size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); ++i)
+    {
+        check(write_redo(path, &bad[i]) == 0, "write bad redo record");
+
+        struct pheap* heap = pheap_open(path, 0, 0);
+        check(heap != NULL, "reopen with a bad redo record");
+        if(heap == NULL)
+        {
+            continue;
+        }
+        check(walk(heap) == kept, "walk after a bad redo record");
+        check(pheap_close(heap) == 0, "close after a bad redo record");
+        check(read_file(path, &after, &record) == 0 && !record.valid &&
+            after.top == before.top && after.root == before.root,
+            "bad redo record dropped");
+    }
+}
+
+/*
+ * Free chunks next to each other in a new heap, checking the first is merged
+ * with the one after it and that freeing the chunks at the end moves the top
+ * back over them.
+ */
+static void test_merge(const char* path)
+{
+    struct pheap_header header;
+    struct pheap_redo record;
+    char* chunks[4];
+    struct pheap* heap = pheap_open(path, HEAP_SIZE, 0);
+    check(heap != NULL, "create for merging");
+    if(heap == NULL)
+    {
+        return;
+    }
+
+    for(int i = 0; i < 4; ++i)
+    {
+        chunks[i] = pheap_alloc(heap, 64);
+    }
+    uint64_t first = pheap_offset(heap, chunks[0]);
+    uint64_t size = chunk_of(heap, first)->size & ~(uint64_t) 0x1;
+
+    pheap_free(heap, chunks[1]);
+    pheap_free(heap, chunks[0]);
+    check(chunk_of(heap, first)->size == size * 2, "merge with the next chunk");
+    check(pheap_alloc(heap, size * 2 - sizeof(struct pheap_chunk)) ==
+        chunks[0], "alloc from a merged chunk");
+
+    uint64_t end = pheap_offset(heap, chunks[2]) - sizeof(struct pheap_chunk);
+    pheap_free(heap, chunks[3]);
+    pheap_free(heap, chunks[2]);
+    check(pheap_close(heap) == 0, "close after merging");
+    check(read_file(path, &header, &record) == 0 && header.top == end,
+        "top moved back over the last chunks");
+}
+
+/*
+ * Returns 1 if a bad free of the given kind terminates a process of its own
+ * that opens the heap file. Kind 0 frees a chunk twice, 1 frees a pointer
+ * into the middle of a chunk, 2 frees a pointer outside of the heap, and 3
+ * is a good free that mustnt terminate.
+ */
+static int terminates(const char* path, int kind)
+{
+    int status;
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if(pid == 0)
+    {
+        uint64_t outside = 0;
+        struct pheap* heap = pheap_open(path, 0, 0);
+        char* chunk = heap != NULL ? pheap_alloc(heap, 64) : NULL;
+
+        /* The message printed as it terminates isnt part of the output */
+        if(chunk == NULL || freopen("/dev/null", "w", stdout) == NULL)
+        {
+            _exit(EXIT_FAILURE);
+        }
+        switch(kind)
+        {
+            case 0:
+                pheap_free(heap, chunk);
+                pheap_free(heap, chunk);
+                break;
+            case 1:
+                pheap_free(heap, chunk + 8);
+                break;
+            case 2:
+                pheap_free(heap, &outside);
+                break;
+            default:
+                pheap_free(heap, chunk);
+                break;
+        }
+        _exit(EXIT_SUCCESS);
+    }
+
+    return pid > 0 && waitpid(pid, &status, 0) == pid && WIFSIGNALED(status);
+}
+
+static void test_bad_frees(const char* path)
+{
+    check(terminates(path, 0), "double free terminates");
+    check(terminates(path, 1), "free inside a chunk terminates");
+    check(terminates(path, 2), "free outside of the heap terminates");
+    check(!terminates(path, 3), "good free doesnt terminate");
+}
+
+int main(int argc, char** argv)
+{
+    const char* path = DEFAULT_FILE;
+    long chunks = DEFAULT_CHUNKS;
+    int opt;
+
+    while((opt = getopt(argc, argv, "f:n:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'f':
+                path = optarg;
+                break;
+            case 'n':
+                chunks = atol(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-f file] [-n chunks]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    unlink(path);
+    test_reopen(path, chunks);
+    test_interrupted(path);
+    test_bad_records(path, chunks - (chunks + 1) / 3);
+    unlink(path);
+    test_merge(path);
+    test_bad_frees(path);
+    unlink(path);
+
+    printf("pheap %s\n", failures == 0 ? "passed" : "FAILED");
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
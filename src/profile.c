@@ -0,0 +1,476 @@
+/*
+ * Implementation of profile.h
+ *
+ * Every distinct call stack that has been sampled is kept in an array, which
+ * is only ever appended to so a sample can refer to its stack by index, with
+ * a hash table to find a stack in it. The live samples are kept in a second
+ * hash table keyed by their chunk. Both are guarded by profile_lock, which is
+ * only taken when a chunk is sampled or a sampled chunk is deallocated.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <execinfo.h>
+#include <sys/mman.h>
+#include "profile.h"
+
+/* Most frames recorded of each sampled stack */
+#define PROFILE_MAX_DEPTH 32
+
+/* Frames of profile_sample() and the allocator at the top of every stack,
+ * which are left out of the profile */
+#define PROFILE_SKIP_FRAMES 2
+
+/* Bytes a thread allocates between checks for a new rate while sampling is
+ * off */
+#define PROFILE_IDLE_BYTES (1024 * 1024)
+
+/* Slots the tables start with, which double whenever they are half full */
+#define PROFILE_INITIAL_CAPACITY 1024
+
+/*
+ * A distinct call stack, with the samples taken from it that are still live
+ * and every sample it has ever had.
+ */
+struct profile_stack
+{
+    uint64_t hash;
+    int depth;
+    void* frames[PROFILE_MAX_DEPTH];
+    unsigned long live_count;
+    unsigned long live_bytes;
+    unsigned long alloc_count;
+    unsigned long alloc_bytes;
+};
+
+/*
+ * A live sample. A chunk of NULL marks an empty slot.
+ */
+struct profile_sample
+{
+    const void* chunk;
+    size_t size;
+    size_t stack;
+};
+
+__thread long profile_countdown = 0;
+
+/* Average bytes between samples, or 0 when not sampling. The generation is
+ * changed along with the rate so every thread knows to pick it up */
+static size_t profile_rate = 0;
+static unsigned long profile_generation = 1;
+
+/* Last rate samples were taken at, written to the profile's header */
+static size_t sampled_rate = PROFILE_DEFAULT_RATE;
+
+/* Generation of the rate this thread's countdown was picked with, and the
+ * state of its random numbers */
+static __thread unsigned long thread_generation = 0;
+static __thread uint64_t random_state = 0;
+
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Every sampled stack, and the hash table of their indexes plus one, with 0
+ * marking an empty slot */
+static struct profile_stack* stacks = NULL;
+static size_t stack_count = 0;
+static size_t stack_capacity = 0;
+static size_t* stack_index = NULL;
+static size_t stack_index_capacity = 0;
+
+/* Hash table of the live samples */
+static struct profile_sample* samples = NULL;
+static size_t sample_count = 0;
+static size_t sample_capacity = 0;
+
+/*
+ * Map zeroed memory for a table. The tables are mapped directly so sampling
+ * never calls back into an allocator.
+ */
+static void* profile_map(size_t size)
+{
+    void* map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(map == MAP_FAILED)
+    {
+        perror("'mmap()' failed unexpectedly");
+        abort();
+    }
+    return map;
+}
+
+/*
+ * Bytes this thread should allocate before its next sample, picked from a
+ * geometric distribution with a mean of 'rate'.
+ */
+static long next_interval(size_t rate)
+{
+    if(random_state == 0)
+    {
+        random_state = (uint64_t) (uintptr_t) &random_state ^
+            (uint64_t) time(NULL) ^ 0x9E3779B97F4A7C15ULL;
+    }
+
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+
+    /* A uniform number in (0, 1], so its log is never infinite */
+    double uniform = ((random_state >> 11) + 1) * (1.0 / 9007199254740992.0);
+    double interval = -log(uniform) * rate;
+
+    if(interval < 1.0)
+    {
+        return 1;
+    }
+    if(interval > (double) (LONG_MAX / 2))
+    {
+        return LONG_MAX / 2;
+    }
+    return (long) interval;
+}
+
+/*
+ * Slot a key with the passed in hash should be placed in, before probing.
+ */
+static size_t profile_slot(uint64_t hash, size_t capacity)
+{
+    return (size_t) ((hash * 0x9E3779B97F4A7C15ULL) >> 17) & (capacity - 1);
+}
+
+/*
+ * Hash the frames of a stack.
+ */
+static uint64_t hash_frames(void* const* frames, int depth)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for(int i = 0; i < depth; ++i)
+    {
+        hash = (hash ^ (uint64_t) (uintptr_t) frames[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+/*
+ * Put a stack's index into the stack index, which must have a free slot.
+ */
+static void index_stack(size_t* index, size_t capacity, size_t stack)
+{
+    size_t slot = profile_slot(stacks[stack].hash, capacity);
+    while(index[slot] != 0)
+    {
+        slot = (slot + 1) & (capacity - 1);
+    }
+    index[slot] = stack + 1;
+}
+
+/*
+ * Returns the index of the stack with the passed in frames, adding it if it
+ * hasnt been sampled before. Must be called with profile_lock held.
+ */
+static size_t find_stack(void* const* frames, int depth)
+{
+    uint64_t hash = hash_frames(frames, depth);
+
+    if(stack_index_capacity > 0)
+    {
+        size_t slot = profile_slot(hash, stack_index_capacity);
+        for(; stack_index[slot] != 0;
+            slot = (slot + 1) & (stack_index_capacity - 1))
+        {
+            struct profile_stack* stack = &stacks[stack_index[slot] - 1];
+            if(stack->hash == hash && stack->depth == depth &&
+                memcmp(stack->frames, frames, depth * sizeof(void*)) == 0)
+            {
+                return stack_index[slot] - 1;
+            }
+        }
+    }
+
+    /* Grow the array of stacks when full, and the index whenever it would be
+     * more than half full */
+    if(stack_count == stack_capacity)
+    {
+        size_t capacity = stack_capacity ? stack_capacity * 2 :
+            PROFILE_INITIAL_CAPACITY;
+        struct profile_stack* grown =
+            profile_map(capacity * sizeof(struct profile_stack));
+        if(stacks != NULL)
+        {
+            memcpy(grown, stacks, stack_count * sizeof(struct profile_stack));
+            munmap(stacks, stack_capacity * sizeof(struct profile_stack));
+        }
+        stacks = grown;
+        stack_capacity = capacity;
+    }
+    if((stack_count + 1) * 2 > stack_index_capacity)
+    {
+        size_t capacity = stack_index_capacity ? stack_index_capacity * 2 :
+            PROFILE_INITIAL_CAPACITY;
+        size_t* grown = profile_map(capacity * sizeof(size_t));
+        for(size_t i = 0; i < stack_count; ++i)
+        {
+            index_stack(grown, capacity, i);
+        }
+        if(stack_index != NULL)
+        {
+            munmap(stack_index, stack_index_capacity * sizeof(size_t));
+        }
+        stack_index = grown;
+        stack_index_capacity = capacity;
+    }
+
+    struct profile_stack* stack = &stacks[stack_count];
+    memset(stack, 0, sizeof(struct profile_stack));
+    stack->hash = hash;
+    stack->depth = depth;
+    memcpy(stack->frames, frames, depth * sizeof(void*));
+    index_stack(stack_index, stack_index_capacity, stack_count);
+
+    return stack_count++;
+}
+
+/*
+ * Add a live sample, doubling the table whenever it is half full. Must be
+ * called with profile_lock held.
+ */
+static void put_sample(const void* chunk, size_t size, size_t stack)
+{
+    if((sample_count + 1) * 2 > sample_capacity)
+    {
+        size_t capacity = sample_capacity ? sample_capacity * 2 :
+            PROFILE_INITIAL_CAPACITY;
+        struct profile_sample* grown =
+            profile_map(capacity * sizeof(struct profile_sample));
+        for(size_t i = 0; i < sample_capacity; ++i)
+        {
+            if(samples[i].chunk != NULL)
+            {
+                size_t slot = profile_slot((uintptr_t) samples[i].chunk,
+                    capacity);
+                while(grown[slot].chunk != NULL)
+                {
+                    slot = (slot + 1) & (capacity - 1);
+                }
+                grown[slot] = samples[i];
+            }
+        }
+        if(samples != NULL)
+        {
+            munmap(samples, sample_capacity * sizeof(struct profile_sample));
+        }
+        samples = grown;
+        sample_capacity = capacity;
+    }
+
+    size_t slot = profile_slot((uintptr_t) chunk, sample_capacity);
+    while(samples[slot].chunk != NULL)
+    {
+        slot = (slot + 1) & (sample_capacity - 1);
+    }
+    samples[slot].chunk = chunk;
+    samples[slot].size = size;
+    samples[slot].stack = stack;
+    ++sample_count;
+}
+
+/*
+ * Remove a live sample, copying it into 'sample'. Returns 0 if it wasnt
+ * there. The samples after it are shifted back so no probe sequence is
+ * broken. Must be called with profile_lock held.
+ */
+static int take_sample(const void* chunk, struct profile_sample* sample)
+{
+    if(sample_capacity == 0)
+    {
+        return 0;
+    }
+
+    size_t mask = sample_capacity - 1;
+    size_t slot = profile_slot((uintptr_t) chunk, sample_capacity);
+    while(samples[slot].chunk != chunk)
+    {
+        if(samples[slot].chunk == NULL)
+        {
+            return 0;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    *sample = samples[slot];
+    size_t hole = slot;
+    samples[hole].chunk = NULL;
+    --sample_count;
+
+    for(slot = (hole + 1) & mask; samples[slot].chunk != NULL;
+        slot = (slot + 1) & mask)
+    {
+        size_t home = profile_slot((uintptr_t) samples[slot].chunk,
+            sample_capacity);
+        if(((slot - home) & mask) >= ((slot - hole) & mask))
+        {
+            samples[hole] = samples[slot];
+            samples[slot].chunk = NULL;
+            hole = slot;
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * Set the sampling rate and move to a new generation
+ */
+void set_heap_profile_rate(size_t rate)
+{
+    /* The first backtrace() loads the unwinder, which allocates, so it is
+     * done here rather than part way through an allocation */
+    if(rate > 0)
+    {
+        void* frame;
+        backtrace(&frame, 1);
+        __atomic_store_n(&sampled_rate, rate, __ATOMIC_RELAXED);
+    }
+
+    __atomic_store_n(&profile_rate, rate, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&profile_generation, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Pick this thread's next countdown and, if sampling is on and the countdown
+ * was picked with the current rate, record the chunk's stack
+ */
+int profile_sample(const void* chunk, size_t size)
+{
+    void* frames[PROFILE_MAX_DEPTH + PROFILE_SKIP_FRAMES];
+    unsigned long generation =
+        __atomic_load_n(&profile_generation, __ATOMIC_ACQUIRE);
+    size_t rate = __atomic_load_n(&profile_rate, __ATOMIC_RELAXED);
+
+    if(rate == 0)
+    {
+        profile_countdown = PROFILE_IDLE_BYTES;
+        thread_generation = generation;
+        return 0;
+    }
+
+    /* A countdown picked with an old rate says nothing about this one, so
+     * this allocation isnt sampled and a fresh countdown is started */
+    profile_countdown = next_interval(rate);
+    if(thread_generation != generation)
+    {
+        thread_generation = generation;
+        return 0;
+    }
+
+    int depth = backtrace(frames, PROFILE_MAX_DEPTH + PROFILE_SKIP_FRAMES);
+    depth = depth > PROFILE_SKIP_FRAMES ? depth - PROFILE_SKIP_FRAMES : 0;
+
+    pthread_mutex_lock(&profile_lock);
+
+    size_t index = find_stack(frames + PROFILE_SKIP_FRAMES, depth);
+    struct profile_stack* stack = &stacks[index];
+    ++stack->live_count;
+    stack->live_bytes += size;
+    ++stack->alloc_count;
+    stack->alloc_bytes += size;
+    put_sample(chunk, size, index);
+
+    pthread_mutex_unlock(&profile_lock);
+
+    #ifdef DEBUG
+    printf("-->Sampled %ld bytes at %p (stack %ld)\n", size, chunk, index);
+    #endif
+
+    return 1;
+}
+
+/*
+ * Take the chunk's sample out of the live samples of its stack
+ */
+void profile_drop(const void* chunk)
+{
+    struct profile_sample sample;
+
+    pthread_mutex_lock(&profile_lock);
+
+    if(take_sample(chunk, &sample))
+    {
+        --stacks[sample.stack].live_count;
+        stacks[sample.stack].live_bytes -= sample.size;
+    }
+
+    pthread_mutex_unlock(&profile_lock);
+}
+
+/*
+ * Write a line per stack in the legacy pprof heap format, then the mapped
+ * libraries
+ */
+int heap_profile_dump(const char* path)
+{
+    unsigned long live_count = 0, live_bytes = 0;
+    unsigned long alloc_count = 0, alloc_bytes = 0;
+    char buffer[4096];
+    size_t read;
+
+    FILE* file = fopen(path, "w");
+    if(file == NULL)
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&profile_lock);
+
+    for(size_t i = 0; i < stack_count; ++i)
+    {
+        live_count += stacks[i].live_count;
+        live_bytes += stacks[i].live_bytes;
+        alloc_count += stacks[i].alloc_count;
+        alloc_bytes += stacks[i].alloc_bytes;
+    }
+
+    /* pprof scales the samples back up using the rate in the header */
+    fprintf(file, "heap profile: %lu: %lu [%lu: %lu] @ heap_v2/%zu\n",
+        live_count, live_bytes, alloc_count, alloc_bytes,
+        __atomic_load_n(&sampled_rate, __ATOMIC_RELAXED));
+
+    for(size_t i = 0; i < stack_count; ++i)
+    {
+        fprintf(file, "%lu: %lu [%lu: %lu] @", stacks[i].live_count,
+            stacks[i].live_bytes, stacks[i].alloc_count,
+            stacks[i].alloc_bytes);
+        for(int frame = 0; frame < stacks[i].depth; ++frame)
+        {
+            fprintf(file, " %p", stacks[i].frames[frame]);
+        }
+        fprintf(file, "\n");
+    }
+
+    pthread_mutex_unlock(&profile_lock);
+
+    /* pprof needs to know where every library was loaded to symbolise the
+     * addresses */
+    fprintf(file, "\nMAPPED_LIBRARIES:\n");
+    FILE* maps = fopen("/proc/self/maps", "r");
+    if(maps != NULL)
+    {
+        while((read = fread(buffer, 1, sizeof(buffer), maps)) > 0)
+        {
+            fwrite(buffer, 1, read, file);
+        }
+        fclose(maps);
+    }
+
+    int error = ferror(file);
+    if(fclose(file) != 0 || error)
+    {
+        return -1;
+    }
+    return 0;
+}
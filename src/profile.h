@@ -0,0 +1,51 @@
+/*
+ * Header file for profile.c - A sampling heap profiler. While it is enabled,
+ * an allocation is sampled on average once every 'rate' bytes allocated by a
+ * thread, and the call stack that made it is recorded until it is
+ * deallocated. heap_profile_dump() writes the live and cumulative samples in
+ * the legacy heap profile format read by pprof.
+ *
+ * The sampling points are picked from a geometric distribution, so every byte
+ * allocated has the same chance of being sampled however the allocations are
+ * sized, and pprof can scale the samples back up to estimate the whole heap.
+ */
+#include <stddef.h>
+
+/* Bytes allocated between samples on average, when no other rate is given */
+#define PROFILE_DEFAULT_RATE (512 * 1024)
+
+/*
+ * Bytes this thread can still allocate before its next sample. alloc()
+ * subtracts the size of every allocation from it and only calls
+ * profile_sample() once it falls below zero.
+ */
+extern __thread long profile_countdown;
+
+/*
+ * Set the average bytes allocated between samples, or 0 to stop sampling.
+ * Samples already taken are kept. A thread picks up the new rate on its next
+ * allocation once it has allocated about a MiB, or straight away if it hasnt
+ * allocated since the rate was last set.
+ */
+void set_heap_profile_rate(size_t rate);
+
+/*
+ * Called by the allocator once this thread's countdown has run out. Returns 1
+ * if the chunk was sampled, in which case profile_drop() must be called with
+ * it when it is deallocated, otherwise 0.
+ */
+int profile_sample(const void* chunk, size_t size);
+
+/*
+ * Remove a sampled chunk from the live samples as it is deallocated.
+ */
+void profile_drop(const void* chunk);
+
+/*
+ * Write the live and cumulative samples, along with the mapped libraries
+ * pprof needs to symbolise them, to the file at 'path'. Returns 0 on success
+ * or -1 if the file couldnt be written.
+ *
+ * eg. pprof --inuse_space malloc2.out heap.prof
+ */
+int heap_profile_dump(const char* path);
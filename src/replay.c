@@ -0,0 +1,522 @@
+/*
+ * Replays a trace recorded by trace.c against any stratergy.
+ *
+ * The trace is memory mapped and its records are put in order of their seq.
+ * By default every operation is replayed on a single thread in that order. With
+ * -i, one thread is started for each thread in the trace and each operation
+ * waits for its turn, so the original interleaving of the threads is kept.
+ * Either way the replay is deterministic.
+ *
+ * With -b, the trace is replayed against each of the listed backends (or all
+ * of them) in turn and their results are printed side by side.
+ *
+ * usage: replay.out [-s stratergy] [-b backends] [-i] trace
+ */
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include "alloc.h"
+#include "trace.h"
+#include "backend.h"
+
+/* Most backends that can be compared in one run */
+#define MAX_BACKENDS 16
+
+/*
+ * Map of the chunk ids in the trace to the chunks allocated while replaying.
+ * Uses linear probing, with an id of 0 marking an empty slot.
+ */
+struct chunk_map
+{
+    uint64_t* ids;
+    void** chunks;
+    size_t capacity;
+    size_t count;
+};
+
+/*
+ * A replay thread, holding the positions in the ordered records of the
+ * operations made by one of the trace's threads.
+ */
+struct replay_thread
+{
+    pthread_t id;
+    size_t* ops;
+    size_t count;
+};
+
+/* Records of the mapped trace, and their indexes in order of seq */
+static const struct trace_record* records;
+static size_t record_count;
+static size_t* order;
+
+static struct chunk_map chunk_map;
+
+/* Backend being replayed against, and the latency of each replayed operation
+ * in the order they were replayed */
+static const struct backend* backend;
+static uint64_t* latencies;
+
+/* Position in 'order' of the next operation to replay when interleaving */
+static volatile size_t next_turn = 0;
+
+/* Whether the interleaving of the traced threads is kept */
+static int interleave = 0;
+
+/*
+ * Seconds on the monotonic clock.
+ */
+static double now_seconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+ * Slot an id should be placed in, before probing.
+ */
+static size_t map_slot(const struct chunk_map* map, uint64_t id)
+{
+    return (size_t) ((id * 0x9E3779B97F4A7C15ULL) >> 17) & (map->capacity - 1);
+}
+
+/*
+ * Add an id to the map, doubling the map whenever it is half full.
+ */
+static void map_put(struct chunk_map* map, uint64_t id, void* chunk)
+{
+    if((map->count + 1) * 2 > map->capacity)
+    {
+        struct chunk_map grown = {NULL, NULL, map->capacity * 2, 0};
+        grown.ids = calloc(grown.capacity, sizeof(uint64_t));
+        grown.chunks = calloc(grown.capacity, sizeof(void*));
+        for(size_t i = 0; i < map->capacity; ++i)
+        {
+            if(map->ids[i] != 0)
+            {
+                map_put(&grown, map->ids[i], map->chunks[i]);
+            }
+        }
+        free(map->ids);
+        free(map->chunks);
+        *map = grown;
+    }
+
+    size_t slot = map_slot(map, id);
+    while(map->ids[slot] != 0 && map->ids[slot] != id)
+    {
+        slot = (slot + 1) & (map->capacity - 1);
+    }
+    if(map->ids[slot] == 0)
+    {
+        ++map->count;
+    }
+    map->ids[slot] = id;
+    map->chunks[slot] = chunk;
+}
+
+/*
+ * Remove an id from the map, returning its chunk or NULL if it wasnt there.
+ * The entries after it are shifted back so no probe sequence is broken.
+ */
+static void* map_take(struct chunk_map* map, uint64_t id)
+{
+    size_t slot = map_slot(map, id);
+    while(map->ids[slot] != id)
+    {
+        if(map->ids[slot] == 0)
+        {
+            return NULL;
+        }
+        slot = (slot + 1) & (map->capacity - 1);
+    }
+
+    void* chunk = map->chunks[slot];
+    size_t hole = slot;
+    map->ids[hole] = 0;
+    --map->count;
+
+    for(slot = (hole + 1) & (map->capacity - 1); map->ids[slot] != 0;
+        slot = (slot + 1) & (map->capacity - 1))
+    {
+        size_t home = map_slot(map, map->ids[slot]);
+        if(((slot - home) & (map->capacity - 1)) >=
+            ((slot - hole) & (map->capacity - 1)))
+        {
+            map->ids[hole] = map->ids[slot];
+            map->chunks[hole] = map->chunks[slot];
+            map->ids[slot] = 0;
+            hole = slot;
+        }
+    }
+
+    return chunk;
+}
+
+/*
+ * Replay a single record, the 'turn'th in order, timing the operation.
+ */
+static void replay_record(const struct trace_record* record, size_t turn)
+{
+    uint64_t before = 0, after = 0;
+    void* chunk;
+
+    switch(record->op)
+    {
+        case TRACE_ALLOC:
+            before = read_cycles();
+            chunk = backend->alloc(record->size);
+            after = read_cycles();
+            map_put(&chunk_map, record->id, chunk);
+            break;
+        case TRACE_ZALLOC:
+            before = read_cycles();
+            chunk = backend->calloc(1, record->size);
+            after = read_cycles();
+            map_put(&chunk_map, record->id, chunk);
+            break;
+        case TRACE_DEALLOC:
+            chunk = map_take(&chunk_map, record->id);
+
+            /* A dealloc of a chunk allocated before the trace started has
+             * nothing to free */
+            before = read_cycles();
+            if(chunk != NULL && record->size > 0)
+            {
+                backend->free_sized(chunk, record->size);
+            }
+            else if(chunk != NULL)
+            {
+                backend->free(chunk);
+            }
+            after = read_cycles();
+            break;
+    }
+
+    latencies[turn] = after - before;
+}
+
+/*
+ * Compare two record indexes by their seq for qsort.
+ */
+static int compare_seq(const void* a, const void* b)
+{
+    uint64_t x = records[*(const size_t*) a].seq;
+    uint64_t y = records[*(const size_t*) b].seq;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Replay thread for interleaved replays. Each operation waits until every
+ * operation before it, on any thread, has been replayed.
+ */
+static void* replay_thread_func(void* arg)
+{
+    struct replay_thread* thread = arg;
+
+    for(size_t i = 0; i < thread->count; ++i)
+    {
+        size_t turn = thread->ops[i];
+        while(__atomic_load_n(&next_turn, __ATOMIC_ACQUIRE) != turn)
+        {
+            sched_yield();
+        }
+
+        replay_record(&records[order[turn]], turn);
+
+        __atomic_store_n(&next_turn, turn + 1, __ATOMIC_RELEASE);
+    }
+
+    return 0;
+}
+
+/*
+ * Replay with one thread per traced thread, keeping their interleaving.
+ */
+static void replay_interleaved()
+{
+    struct replay_thread* threads;
+    size_t thread_count = 0;
+
+    for(size_t i = 0; i < record_count; ++i)
+    {
+        if((size_t) records[i].thread + 1 > thread_count)
+        {
+            thread_count = records[i].thread + 1;
+        }
+    }
+
+    threads = calloc(thread_count, sizeof(struct replay_thread));
+    for(size_t i = 0; i < record_count; ++i)
+    {
+        ++threads[records[i].thread].count;
+    }
+    for(size_t i = 0; i < thread_count; ++i)
+    {
+        threads[i].ops = malloc((threads[i].count + 1) * sizeof(size_t));
+        threads[i].count = 0;
+    }
+    for(size_t turn = 0; turn < record_count; ++turn)
+    {
+        struct replay_thread* thread = &threads[records[order[turn]].thread];
+        thread->ops[thread->count++] = turn;
+    }
+
+    for(size_t i = 0; i < thread_count; ++i)
+    {
+        if(pthread_create(&threads[i].id, NULL, replay_thread_func,
+            &threads[i]) != 0)
+        {
+            perror("Can not create thread");
+            exit(1);
+        }
+    }
+    for(size_t i = 0; i < thread_count; ++i)
+    {
+        pthread_join(threads[i].id, NULL);
+    }
+}
+
+/*
+ * Replay the whole trace against the backend and fill in the result.
+ */
+static void run_replay(const struct backend* run_backend,
+    struct backend_result* result)
+{
+    struct backend_stats stats;
+
+    backend = run_backend;
+    latencies = malloc((record_count + 1) * sizeof(uint64_t));
+
+    chunk_map.capacity = 1024;
+    chunk_map.count = 0;
+    chunk_map.ids = calloc(chunk_map.capacity, sizeof(uint64_t));
+    chunk_map.chunks = calloc(chunk_map.capacity, sizeof(void*));
+    next_turn = 0;
+
+    double start = now_seconds();
+    if(interleave)
+    {
+        replay_interleaved();
+    }
+    else
+    {
+        for(size_t i = 0; i < record_count; ++i)
+        {
+            replay_record(&records[order[i]], i);
+        }
+    }
+    result->seconds = now_seconds() - start;
+
+    backend->stats(&stats);
+    fill_latencies(result, latencies, record_count);
+    result->ops_per_sec = record_count / result->seconds;
+    result->heap_bytes = stats.heap_bytes;
+    result->max_rss_kb = 0;
+}
+
+/*
+ * Print the results of a single replay as JSON.
+ */
+static void print_json(const char* path, const struct backend_result* result)
+{
+    struct backend_stats stats;
+    struct rusage usage;
+
+    backend->stats(&stats);
+    getrusage(RUSAGE_SELF, &usage);
+
+    printf("{\n");
+    printf("  \"trace\": \"%s\",\n", path);
+    printf("  \"backend\": \"%s\",\n", backend->name);
+    printf("  \"interleaved\": %s,\n", interleave ? "true" : "false");
+    printf("  \"operations\": %zu,\n", record_count);
+    printf("  \"seconds\": %.6f,\n", result->seconds);
+    printf("  \"ops_per_sec\": %.1f,\n", result->ops_per_sec);
+    printf("  \"latency\": {\"unit\": \"%s\", \"p50\": %llu, \"p99\": %llu, "
+        "\"p99.9\": %llu, \"max\": %llu},\n", LATENCY_UNIT, result->p50,
+        result->p99, result->p999, result->max);
+    printf("  \"heap_bytes\": %zu,\n", stats.heap_bytes);
+    printf("  \"peak_heap_bytes\": %zu,\n", stats.peak_heap_bytes);
+    printf("  \"max_rss_kb\": %ld,\n", usage.ru_maxrss);
+    printf("  \"fragmentation\": {\"alloc_bytes\": %zu, \"freed_bytes\": %zu, "
+        "\"largest_freed\": %zu, \"external\": %.6f}\n",
+        stats.alloc_bytes, stats.freed_bytes, stats.largest_freed,
+        stats.freed_bytes && stats.largest_freed ? 1.0 -
+            (double) stats.largest_freed / stats.freed_bytes : 0.0);
+    printf("}\n");
+}
+
+/*
+ * Print the usage message and exit.
+ */
+static void usage(const char* name)
+{
+    printf("usage: %s [-s stratergy] [-b backends] [-i] trace\n"
+        "  -s  FIRST, BEST, WORST or ADAPTIVE (default FIRST)\n"
+        "  -b  comma separated backends to compare, or 'all'\n"
+        "  -i  keep the interleaving of the traced threads\n", name);
+    printf("backends:");
+    for(int i = 0; i < backend_count; ++i)
+    {
+        printf(" %s", backends[i].name);
+    }
+    printf("\n");
+    exit(1);
+}
+
+/*
+ * Main.
+ */
+int main(int argc, char* argv[])
+{
+    const char* stratergy_name = "FIRST";
+    const char* backend_names = NULL;
+    const struct backend* run_backends[MAX_BACKENDS];
+    struct backend_result results[MAX_BACKENDS];
+    int run_count = 0;
+    struct stat info;
+    int opt;
+
+    while((opt = getopt(argc, argv, "s:b:ih")) != -1)
+    {
+        switch(opt)
+        {
+            case 's':
+                stratergy_name = optarg;
+                break;
+            case 'b':
+                backend_names = optarg;
+                break;
+            case 'i':
+                interleave = 1;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if(optind + 1 != argc)
+    {
+        usage(argv[0]);
+    }
+
+    /* Without -b, the malloc2 backend for the -s stratergy is replayed */
+    if(backend_names == NULL)
+    {
+        char name[64];
+        snprintf(name, sizeof(name), "malloc2-%s", stratergy_name);
+        for(char* c = name; *c != '\0'; ++c)
+        {
+            *c = tolower(*c);
+        }
+
+        run_backends[0] = find_backend(name);
+        run_count = 1;
+        if(run_backends[0] == NULL)
+        {
+            printf("Error: stratergy '%s' not valid.\n", stratergy_name);
+            exit(1);
+        }
+    }
+    else if(strcmp(backend_names, "all") == 0)
+    {
+        for(int i = 0; i < backend_count && i < MAX_BACKENDS; ++i)
+        {
+            run_backends[run_count++] = &backends[i];
+        }
+    }
+    else
+    {
+        char buffer[256];
+        snprintf(buffer, sizeof(buffer), "%s", backend_names);
+        for(char* name = strtok(buffer, ","); name != NULL;
+            name = strtok(NULL, ","))
+        {
+            if(run_count == MAX_BACKENDS ||
+                (run_backends[run_count++] = find_backend(name)) == NULL)
+            {
+                printf("Error: backend '%s' not valid.\n", name);
+                exit(1);
+            }
+        }
+    }
+
+    /* Map the trace and check it is one we can read */
+    int fd = open(argv[optind], O_RDONLY);
+    if(fd < 0 || fstat(fd, &info) != 0)
+    {
+        perror("Can't open trace");
+        exit(1);
+    }
+    if((size_t) info.st_size < sizeof(struct trace_header))
+    {
+        printf("Error: '%s' is not a trace.\n", argv[optind]);
+        exit(1);
+    }
+    const char* map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(map == MAP_FAILED)
+    {
+        perror("Can't map trace");
+        exit(1);
+    }
+    const struct trace_header* header = (const struct trace_header*) map;
+    if(memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != TRACE_VERSION ||
+        header->record_size != sizeof(struct trace_record))
+    {
+        printf("Error: '%s' is not a version %d trace.\n", argv[optind],
+            TRACE_VERSION);
+        exit(1);
+    }
+
+    records = (const struct trace_record*) (map + sizeof(struct trace_header));
+    record_count = (info.st_size - sizeof(struct trace_header)) /
+        sizeof(struct trace_record);
+
+    /* Put the records in the order they happened across every thread */
+    order = malloc((record_count + 1) * sizeof(size_t));
+    for(size_t i = 0; i < record_count; ++i)
+    {
+        order[i] = i;
+    }
+    qsort(order, record_count, sizeof(size_t), compare_seq);
+
+    /* A single backend is replayed in process and reported in full, while
+     * several are each replayed in a child of their own and compared */
+    if(run_count == 1)
+    {
+        struct backend_result result;
+
+        run_backends[0]->init();
+        run_replay(run_backends[0], &result);
+        print_json(argv[optind], &result);
+    }
+    else
+    {
+        for(int i = 0; i < run_count; ++i)
+        {
+            if(run_isolated(run_backends[i], run_replay, &results[i]) != 0)
+            {
+                printf("Error: backend '%s' failed.\n", run_backends[i]->name);
+                exit(1);
+            }
+        }
+        print_comparison(run_backends, results, run_count, LATENCY_UNIT);
+    }
+
+    munmap((void*) map, info.st_size);
+    close(fd);
+    return 0;
+}
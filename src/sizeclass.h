@@ -0,0 +1,30 @@
+/*
+ * Generated by classopt.out, run it again rather than editing this.
+ *
+ * Size classes of the thread cache, chosen to waste the fewest bytes
+ * rounding up the 54945 allocations of up to 512 bytes read from:
+ *     data/sizes.txt
+ *
+ * bytes wasted per allocation: 3.62 (3.62 with 16 byte classes, 6.53 with
+ * power of two classes)
+ */
+#define SIZE_CLASSES 16
+#define SIZE_CLASS_ALIGN 16
+#define SIZE_CLASS_MAX 512
+
+/* Bytes of each size class, smallest first */
+static const unsigned short size_class_sizes[SIZE_CLASSES] =
+{
+    16, 32, 48, 80, 128, 160, 192, 224, 256, 288, 320, 352,
+    384, 416, 464, 512
+};
+
+/* Size class of a chunk of up to SIZE_CLASS_MAX bytes, indexed by its size
+ * rounded up to SIZE_CLASS_ALIGN and divided by it */
+static const unsigned char
+    size_class_index[SIZE_CLASS_MAX / SIZE_CLASS_ALIGN + 1] =
+{
+    0, 0, 1, 2, 3, 3, 4, 4, 4, 5, 5, 6,
+    6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12,
+    12, 13, 13, 14, 14, 14, 15, 15, 15
+};
@@ -1,90 +1,486 @@
+/*
+ * Lock scalability benchmark for the rw_lock in locks.c.
+ *
+ * Each thread takes a lock over and over, as a reader or a writer in the
+ * ratio asked for, holding it for a critical section of a set length and then
+ * doing work of the same length outside of it. The time each thread waited
+ * for the lock is taken with the cycle counter, for readers and writers
+ * apart, and the throughput and wait percentiles are printed for each lock
+ * at 1, 2, 4 and so on up to the number of threads asked for. The max wait
+ * shows whether readers or writers are being starved.
+ *
+ * The locks compared are the rw_lock_t, a pthread_rwlock_t and a plain
+ * pthread mutex (taken the same way by readers and writers). Readers check
+ * that no writer is part way through its section, and any that see one are
+ * counted as errors.
+ *
+ * usage: lockbench.out [-t threads] [-n ops] [-r read%] [-c section]
+ *                      [-o outside] [-l locks]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
 #include "locks.h"
+#include "backend.h"
 
-int var = 0;
-static struct rw_lock_t lock = RW_LOCK_INIT;
+/* Default values of the command line options */
+#define DEFAULT_THREADS 4
+#define DEFAULT_OPS 100000
+#define DEFAULT_READS 90
+#define DEFAULT_SECTION 100
+#define DEFAULT_OUTSIDE 100
 
-void* thread1_ex(void* data)
+/* Most threads that can be asked for */
+#define MAX_THREADS 256
+
+/*
+ * A lock that can be benchmarked, taken through its read and write
+ * functions.
+ */
+struct bench_lock
+{
+    const char* name;
+    void (*read_lock)();
+    void (*read_unlock)();
+    void (*write_lock)();
+    void (*write_unlock)();
+};
+
+/*
+ * Everything set on the command line.
+ */
+struct bench_config
+{
+    int threads;
+    long ops;
+    int reads;
+    long section;
+    long outside;
+};
+
+/*
+ * State of a single benchmark thread, with the time it waited for each lock
+ * it took as a reader and as a writer.
+ */
+struct bench_thread
+{
+    pthread_t id;
+    uint64_t rng;
+    uint64_t* read_waits;
+    uint64_t* write_waits;
+    long reads;
+    long writes;
+    long errors;
+};
+
+/*
+ * Results of one lock at one number of threads.
+ */
+struct bench_result
 {
-    while(1)
+    double ops_per_sec;
+    uint64_t read_p50, read_p99, read_max;
+    uint64_t write_p50, write_p99, write_max;
+    long reads;
+    long writes;
+    long errors;
+};
+
+static struct bench_config config;
+static const struct bench_lock* lock;
+static pthread_barrier_t start_barrier;
+
+/* The locks being compared */
+static struct rw_lock_t rw_lock = RW_LOCK_INIT;
+static pthread_rwlock_t pthread_rw_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Data guarded by the lock. A writer bumps 'first' at the start of its
+ * section and 'second' at the end, so a reader seeing them differ has run at
+ * the same time as a writer */
+static volatile uint64_t first;
+static volatile uint64_t second;
+
+static void rw_read_lock()
+{
+    r_lock(&rw_lock);
+}
+
+static void rw_read_unlock()
+{
+    r_unlock(&rw_lock);
+}
+
+static void rw_write_lock()
+{
+    w_lock(&rw_lock);
+}
+
+static void rw_write_unlock()
+{
+    w_unlock(&rw_lock);
+}
+
+static void pthread_read_lock()
+{
+    pthread_rwlock_rdlock(&pthread_rw_lock);
+}
+
+static void pthread_write_lock()
+{
+    pthread_rwlock_wrlock(&pthread_rw_lock);
+}
+
+static void pthread_rw_unlock()
+{
+    pthread_rwlock_unlock(&pthread_rw_lock);
+}
+
+static void mutex_lock()
+{
+    pthread_mutex_lock(&mutex);
+}
+
+static void mutex_unlock()
+{
+    pthread_mutex_unlock(&mutex);
+}
+
+static const struct bench_lock locks[] =
+{
+    {"rw_lock", rw_read_lock, rw_read_unlock, rw_write_lock, rw_write_unlock},
+    {"pthread_rwlock", pthread_read_lock, pthread_rw_unlock,
+        pthread_write_lock, pthread_rw_unlock},
+    {"mutex", mutex_lock, mutex_unlock, mutex_lock, mutex_unlock}
+};
+static const int lock_count = sizeof(locks) / sizeof(locks[0]);
+
+/*
+ * Xorshift random number generator, so each thread has its own sequence
+ * without sharing any state.
+ */
+static uint64_t next_random(uint64_t* state)
+{
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+/*
+ * Busy work of 'length' steps, in or out of the lock.
+ */
+static void spin(long length)
+{
+    for(volatile long i = 0; i < length; ++i)
     {
-        r_lock(&lock);
-	printf("Var: %d\n", var);
-        if(var > 1024)
-	{
-		r_unlock(&lock);		
-        	break;
-	}	
-        r_unlock(&lock);
     }
+}
 
-    return 0;
+/*
+ * Seconds on the monotonic clock.
+ */
+static double now_seconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
 }
 
-void* thread2_ex(void* data)
+/*
+ * Body of each benchmark thread.
+ */
+static void* thread_func(void* arg)
 {
-    while(1)
+    struct bench_thread* thread = (struct bench_thread*) arg;
+
+    pthread_barrier_wait(&start_barrier);
+
+    for(long i = 0; i < config.ops; ++i)
     {
-        w_lock(&lock);
-        if(++var > 1024)
-	{
-		w_unlock(&lock);		
-        	break;
-	}	
-	//printf("Var: %d\n", var);
-        w_unlock(&lock);
+        if((long) (next_random(&thread->rng) % 100) < config.reads)
+        {
+            uint64_t before = read_cycles();
+            lock->read_lock();
+            thread->read_waits[thread->reads++] = read_cycles() - before;
+
+            uint64_t seen = first;
+            spin(config.section);
+            if(second != seen)
+            {
+                ++thread->errors;
+            }
+
+            lock->read_unlock();
+        }
+        else
+        {
+            uint64_t before = read_cycles();
+            lock->write_lock();
+            thread->write_waits[thread->writes++] = read_cycles() - before;
+
+            first = first + 1;
+            spin(config.section);
+            second = second + 1;
+
+            lock->write_unlock();
+        }
+
+        spin(config.outside);
     }
 
-    return 0;
+    return NULL;
 }
 
-void* thread4_ex(void* data)
+/*
+ * Compare two waits for qsort.
+ */
+static int compare_wait(const void* a, const void* b)
 {
-    while(1)
+    uint64_t x = *(const uint64_t*) a;
+    uint64_t y = *(const uint64_t*) b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Sort the waits and fill in their 50th and 99th percentiles and max.
+ */
+static void fill_waits(uint64_t* waits, size_t count, uint64_t* p50,
+    uint64_t* p99, uint64_t* max)
+{
+    *p50 = *p99 = *max = 0;
+    if(count == 0)
     {
-        w_lock(&lock);
-        if(++var > 1024)
-	{
-		w_unlock(&lock);		
-        	break;
-	}	
-	//printf("Var: %d\n", var);
-        w_unlock(&lock);
+        return;
     }
 
-    return 0;
+    qsort(waits, count, sizeof(uint64_t), compare_wait);
+    *p50 = waits[(size_t) (count * 0.50)];
+    *p99 = waits[(size_t) (count * 0.99)];
+    *max = waits[count - 1];
 }
 
-void* thread3_ex(void* data)
+/*
+ * Run every thread against the lock and fill in the results.
+ */
+static void run(const struct bench_lock* bench_lock, int thread_count,
+    struct bench_result* result)
 {
-    while(1)
+    struct bench_thread* threads = calloc(thread_count,
+        sizeof(struct bench_thread));
+    uint64_t* read_waits = malloc(thread_count * config.ops *
+        sizeof(uint64_t));
+    uint64_t* write_waits = malloc(thread_count * config.ops *
+        sizeof(uint64_t));
+    size_t read_count = 0, write_count = 0;
+
+    lock = bench_lock;
+    first = second = 0;
+    pthread_barrier_init(&start_barrier, NULL, thread_count + 1);
+
+    for(int i = 0; i < thread_count; ++i)
     {
-        r_lock(&lock);
-	printf("Var: %d\n", var);
-        if(var > 1024)
-	{
-		r_unlock(&lock);		
-        	break;
-	}
-        r_unlock(&lock);
+        threads[i].rng = 0x9e3779b97f4a7c15ULL * (i + 1);
+        threads[i].read_waits = read_waits + i * config.ops;
+        threads[i].write_waits = write_waits + i * config.ops;
+        if(pthread_create(&threads[i].id, NULL, thread_func, &threads[i]))
+        {
+            perror("Can't create thread");
+            exit(1);
+        }
     }
 
-    return 0;
+    pthread_barrier_wait(&start_barrier);
+    double start = now_seconds();
+    for(int i = 0; i < thread_count; ++i)
+    {
+        pthread_join(threads[i].id, NULL);
+    }
+    double seconds = now_seconds() - start;
+
+    pthread_barrier_destroy(&start_barrier);
+
+    /* Pack every thread's waits together so the percentiles cover them all */
+    memset(result, 0, sizeof(struct bench_result));
+    for(int i = 0; i < thread_count; ++i)
+    {
+        memmove(read_waits + read_count, threads[i].read_waits,
+            threads[i].reads * sizeof(uint64_t));
+        memmove(write_waits + write_count, threads[i].write_waits,
+            threads[i].writes * sizeof(uint64_t));
+        read_count += threads[i].reads;
+        write_count += threads[i].writes;
+        result->errors += threads[i].errors;
+    }
+
+    result->reads = read_count;
+    result->writes = write_count;
+    result->ops_per_sec = (read_count + write_count) / seconds;
+    fill_waits(read_waits, read_count, &result->read_p50, &result->read_p99,
+        &result->read_max);
+    fill_waits(write_waits, write_count, &result->write_p50,
+        &result->write_p99, &result->write_max);
+
+    free(read_waits);
+    free(write_waits);
+    free(threads);
+}
+
+/*
+ * Parse a comma separated list of lock names, or 'all', into 'list'.
+ * Returns 0 on success or -1 if a name isnt a lock.
+ */
+static int parse_locks(const char* names, const struct bench_lock** list,
+    int* count)
+{
+    char buffer[256];
+
+    *count = 0;
+    if(strcmp(names, "all") == 0)
+    {
+        for(int i = 0; i < lock_count; ++i)
+        {
+            list[(*count)++] = &locks[i];
+        }
+        return 0;
+    }
+
+    snprintf(buffer, sizeof(buffer), "%s", names);
+    for(char* name = strtok(buffer, ","); name != NULL;
+        name = strtok(NULL, ","))
+    {
+        int found = -1;
+        for(int i = 0; i < lock_count; ++i)
+        {
+            if(strcmp(name, locks[i].name) == 0)
+            {
+                found = i;
+            }
+        }
+        if(found < 0 || *count == lock_count)
+        {
+            return -1;
+        }
+        list[(*count)++] = &locks[found];
+    }
+    return *count > 0 ? 0 : -1;
 }
 
-int main(int argc, char** argv)
+/*
+ * Print the usage message and exit.
+ */
+static void usage(const char* name)
 {
-    pthread_t thread1;
-    pthread_t thread2;
-    pthread_t thread3;
-    pthread_t thread4;
+    printf("usage: %s [-t threads] [-n ops] [-r read%%] [-c section] "
+        "[-o outside] [-l locks]\n"
+        "  -t  most threads, run at 1, 2, 4 and so on up to it (default %d)\n"
+        "  -n  lock operations by each thread (default %d)\n"
+        "  -r  percent of operations that read (default %d)\n"
+        "  -c  steps of work in the critical section (default %d)\n"
+        "  -o  steps of work between sections (default %d)\n"
+        "  -l  comma separated locks to compare, or 'all' (default)\n",
+        name, DEFAULT_THREADS, DEFAULT_OPS, DEFAULT_READS, DEFAULT_SECTION,
+        DEFAULT_OUTSIDE);
+    printf("locks:");
+    for(int i = 0; i < lock_count; ++i)
+    {
+        printf(" %s", locks[i].name);
+    }
+    printf("\n");
+    exit(1);
+}
+
+/*
+ * Main.
+ */
+int main(int argc, char* argv[])
+{
+    const struct bench_lock* run_locks[sizeof(locks) / sizeof(locks[0])];
+    const char* lock_names = "all";
+    int run_count = 0;
+    int opt;
+
+    config.threads = DEFAULT_THREADS;
+    config.ops = DEFAULT_OPS;
+    config.reads = DEFAULT_READS;
+    config.section = DEFAULT_SECTION;
+    config.outside = DEFAULT_OUTSIDE;
 
-    pthread_create(&thread1, NULL, thread1_ex, NULL);
-    pthread_create(&thread2, NULL, thread2_ex, NULL);
-    pthread_create(&thread3, NULL, thread3_ex, NULL);
-    pthread_create(&thread4, NULL, thread4_ex, NULL);
+    while((opt = getopt(argc, argv, "t:n:r:c:o:l:h")) != -1)
+    {
+        switch(opt)
+        {
+            case 't':
+                config.threads = atoi(optarg);
+                break;
+            case 'n':
+                config.ops = atol(optarg);
+                break;
+            case 'r':
+                config.reads = atoi(optarg);
+                break;
+            case 'c':
+                config.section = atol(optarg);
+                break;
+            case 'o':
+                config.outside = atol(optarg);
+                break;
+            case 'l':
+                lock_names = optarg;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if(optind != argc || config.threads < 1 ||
+        config.threads > MAX_THREADS || config.ops < 1 ||
+        config.reads < 0 || config.reads > 100 || config.section < 0 ||
+        config.outside < 0 || parse_locks(lock_names, run_locks, &run_count))
+    {
+        usage(argv[0]);
+    }
+
+    printf("reads: %d%%, section: %ld, outside: %ld, ops per thread: %ld, "
+        "waits in %s\n\n", config.reads, config.section, config.outside,
+        config.ops, LATENCY_UNIT);
+    printf("%-16s %7s %12s %10s %10s %12s %10s %10s %12s %7s\n", "lock",
+        "threads", "ops/sec", "read p50", "read p99", "read max",
+        "write p50", "write p99", "write max", "errors");
+
+    for(int i = 0; i < run_count; ++i)
+    {
+        for(int threads = 1; ; threads *= 2)
+        {
+            struct bench_result result;
+
+            if(threads > config.threads)
+            {
+                threads = config.threads;
+            }
+            run(run_locks[i], threads, &result);
+
+            printf("%-16s %7d %12.1f %10llu %10llu %12llu %10llu %10llu "
+                "%12llu %7ld\n", run_locks[i]->name, threads,
+                result.ops_per_sec, (unsigned long long) result.read_p50,
+                (unsigned long long) result.read_p99,
+                (unsigned long long) result.read_max,
+                (unsigned long long) result.write_p50,
+                (unsigned long long) result.write_p99,
+                (unsigned long long) result.write_max, result.errors);
 
-    pthread_join(thread1, NULL);
-    pthread_join(thread2, NULL);
-    pthread_join(thread3, NULL);
-    pthread_join(thread4, NULL);
+            if(threads == config.threads)
+            {
+                break;
+            }
+        }
+    }
+
+    return 0;
 }
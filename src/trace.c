@@ -0,0 +1,208 @@
+/*
+ * Implementation of trace.h
+ *
+ * Each thread records into its own buffer, only taking the file lock when the
+ * buffer is full. The buffers are kept in a list so trace_stop() can write out
+ * whatever is left in them.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "alloc.h"
+#include "trace.h"
+
+/* Records each thread buffers before writing them to the file */
+#define TRACE_BUFFER_RECORDS 4096
+
+/*
+ * A thread's buffer of records. The owning thread holds 'lock' while adding
+ * a record, so trace_stop() can safely write out the buffer of a thread that
+ * is still running.
+ */
+struct trace_buffer
+{
+    struct trace_buffer* next;
+    pthread_mutex_t lock;
+    uint16_t thread;
+    size_t count;
+    struct trace_record records[TRACE_BUFFER_RECORDS];
+};
+
+volatile int trace_enabled = 0;
+
+/* File being recorded to, and the lock serialising writes to it */
+static FILE* trace_file = NULL;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static int trace_error = 0;
+
+/* Every thread's buffer, guarded by trace_lock */
+static struct trace_buffer* buffers = NULL;
+
+/* Next operation's position and next thread's id */
+static uint64_t next_seq = 0;
+static uint16_t next_thread = 0;
+
+/* This thread's buffer, created on its first record */
+static __thread struct trace_buffer* thread_buffer = NULL;
+
+/*
+ * Write out and empty the passed in buffer. Must be called with the buffer's
+ * lock held.
+ */
+static void flush_buffer(struct trace_buffer* buffer)
+{
+    pthread_mutex_lock(&trace_lock);
+
+    if(trace_file != NULL && buffer->count > 0 &&
+        fwrite(buffer->records, sizeof(struct trace_record), buffer->count,
+            trace_file) != buffer->count)
+    {
+        trace_error = 1;
+    }
+
+    pthread_mutex_unlock(&trace_lock);
+
+    buffer->count = 0;
+}
+
+/*
+ * Create this thread's buffer and add it to the list of buffers. The buffers
+ * are mapped directly so tracing never calls back into an allocator.
+ */
+static struct trace_buffer* create_buffer()
+{
+    struct trace_buffer* buffer = mmap(NULL, sizeof(struct trace_buffer),
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(buffer == MAP_FAILED)
+    {
+        perror("'mmap()' failed unexpectedly");
+        abort();
+    }
+
+    pthread_mutex_init(&buffer->lock, NULL);
+    buffer->count = 0;
+
+    pthread_mutex_lock(&trace_lock);
+
+    buffer->thread = next_thread++;
+    buffer->next = buffers;
+    buffers = buffer;
+
+    pthread_mutex_unlock(&trace_lock);
+
+    return buffer;
+}
+
+/*
+ * Add a record for the operation to this thread's buffer, writing the buffer
+ * out if it is full.
+ */
+void trace_event(enum trace_op op, const void* chunk, size_t size)
+{
+    struct timespec now;
+    struct trace_buffer* buffer = thread_buffer;
+
+    if(buffer == NULL)
+    {
+        buffer = thread_buffer = create_buffer();
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&buffer->lock);
+
+    struct trace_record* record = &buffer->records[buffer->count++];
+    record->seq = __atomic_fetch_add(&next_seq, 1, __ATOMIC_RELAXED);
+    record->timestamp = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+    record->id = (uint64_t) (uintptr_t) chunk;
+    record->size = size;
+    record->thread = buffer->thread;
+    record->op = op;
+    memset(record->reserved, 0, sizeof(record->reserved));
+
+    if(buffer->count == TRACE_BUFFER_RECORDS)
+    {
+        flush_buffer(buffer);
+    }
+
+    pthread_mutex_unlock(&buffer->lock);
+}
+
+/*
+ * Open the trace file, write its header and enable tracing
+ */
+int trace_start(const char* path)
+{
+    struct trace_header header;
+
+    pthread_mutex_lock(&trace_lock);
+
+    if(trace_file != NULL)
+    {
+        pthread_mutex_unlock(&trace_lock);
+        return -1;
+    }
+
+    trace_file = fopen(path, "wb");
+    if(trace_file == NULL)
+    {
+        pthread_mutex_unlock(&trace_lock);
+        return -1;
+    }
+
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.record_size = sizeof(struct trace_record);
+    header.reserved = 0;
+    trace_error =
+        fwrite(&header, sizeof(header), 1, trace_file) != 1;
+    next_seq = 0;
+
+    pthread_mutex_unlock(&trace_lock);
+
+    trace_enabled = 1;
+
+    /* Chunks taken from the thread caches arent traced, so their budgets are
+     * taken back */
+    __atomic_add_fetch(&alloc_cache_generation, 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/*
+ * Disable tracing, write out whatever is left in every buffer and close the
+ * trace file
+ */
+int trace_stop()
+{
+    trace_enabled = 0;
+
+    /* The list of buffers is only ever added to at the head, so it is safe
+     * to walk from a snapshot of the head without holding trace_lock */
+    pthread_mutex_lock(&trace_lock);
+    struct trace_buffer* buffer = buffers;
+    pthread_mutex_unlock(&trace_lock);
+
+    for(; buffer != NULL; buffer = buffer->next)
+    {
+        pthread_mutex_lock(&buffer->lock);
+        flush_buffer(buffer);
+        pthread_mutex_unlock(&buffer->lock);
+    }
+
+    pthread_mutex_lock(&trace_lock);
+
+    int result = trace_error ? -1 : 0;
+    if(trace_file == NULL || fclose(trace_file) != 0)
+    {
+        result = -1;
+    }
+    trace_file = NULL;
+
+    pthread_mutex_unlock(&trace_lock);
+
+    return result;
+}
@@ -0,0 +1,72 @@
+/*
+ * Header file for trace.c - Records every alloc and dealloc made while tracing
+ * is enabled to a binary file, which the replay tool can play back against
+ * any stratergy.
+ *
+ * A trace file is a trace_header followed by trace_records. Each thread
+ * buffers its records and writes them out in blocks, so the records are only
+ * in order within a thread. The seq field gives the order across all threads.
+ */
+#include <stdint.h>
+#include <stddef.h>
+
+/* Magic number and version at the start of every trace file */
+#define TRACE_MAGIC "M2TR"
+#define TRACE_VERSION 1
+
+/*
+ * Operations that can be recorded.
+ *
+ * alloc   - A chunk of 'size' bytes was allocated with alloc().
+ * zalloc  - A chunk of 'size' bytes was allocated with zalloc().
+ * dealloc - The chunk 'id' was deallocated (size is 0 if it wasnt known).
+ */
+enum trace_op{TRACE_ALLOC = 1, TRACE_ZALLOC = 2, TRACE_DEALLOC = 3};
+
+/*
+ * Header at the start of a trace file.
+ */
+struct trace_header
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t reserved;
+};
+
+/*
+ * A single recorded operation. The id of a chunk is the address it was given,
+ * which is unique for as long as the chunk is allocated.
+ */
+struct trace_record
+{
+    uint64_t seq;       /* Position of this operation across every thread */
+    uint64_t timestamp; /* Monotonic clock in nanoseconds */
+    uint64_t id;        /* Chunk allocated or deallocated */
+    uint64_t size;      /* Bytes requested */
+    uint16_t thread;    /* Small id of the thread, in order of first use */
+    uint8_t op;         /* One of trace_op */
+    uint8_t reserved[5];
+};
+
+/* Non zero while a trace is being recorded */
+extern volatile int trace_enabled;
+
+/*
+ * Start recording every alloc and dealloc to the file at 'path', replacing
+ * it if it exists. Returns 0 on success or -1 if the file couldnt be opened
+ * or a trace is already being recorded.
+ */
+int trace_start(const char* path);
+
+/*
+ * Stop recording, writing out every thread's buffered records and closing
+ * the file. Returns 0 on success or -1 if any records couldnt be written.
+ */
+int trace_stop();
+
+/*
+ * Record an operation on the chunk 'chunk' to this thread's buffer. This
+ * should only be called while trace_enabled is set.
+ */
+void trace_event(enum trace_op op, const void* chunk, size_t size);